@@ -72,6 +72,23 @@ order by the way that you specify ROS_PACKAGE_PATH.  The search order
 within a given element of ROS_PACKAGE_PATH can be unpredictably affected by
 the details of how files are laid out on disk.
 
+The directory trees are walked by a pool of threads, which pick up
+subdirectories from each other as they run out of work.  What they find is
+registered afterward in the same order that a single-threaded crawl would
+use, so the choice of thread count never changes which stackage wins.
+Each package.xml that needs parsing (to learn the package's name) is
+parsed by the thread that found it, so that parsing overlaps with waiting
+on the filesystem.  The number of threads defaults to the number of cores
+(at most 8) and can be set with the environment variable
+ROS_CRAWL_THREADS; set it to 1 to crawl on a single thread.  On Linux,
+each directory is read just once, with entry types taken from the
+directory listing itself, so that a crawl needs little more than one
+system call per directory.  When built with USE_IO_URING, the
+subdirectories of each directory are then opened (or stat'd) in one batch
+through io_uring, which helps on storage with high latency such as NFS;
+rospack falls back to plain system calls if the kernel doesn't support
+it, or if ROS_CRAWL_IO_URING is set to 0.
+
 \subsection efficiency Efficiency considerations
 librospack re-parses the manifest files and rebuilds the dependency tree
 on each execution.  However, it maintains a cache of stackage directories in
@@ -81,6 +98,151 @@ miss, or when the cache is 60 seconds old.  You can change this timeout by
 setting the environment variable ROS_CACHE_TIMEOUT, in seconds.  Set it to
 0.0 to force a cache rebuild on every invocation of librospack.
 
+Besides that list, the cache is kept in shards, one for each root of the
+search path (ROS_HOME/rospack_cache_shard_*), holding what a crawl of that
+root found.  The result for a whole ROS_PACKAGE_PATH is put together from
+the shards in search path order, so that the first stackage found still
+wins.  A rebuild only crawls the roots whose shards are missing or out of
+date, so switching between workspaces that share an underlay doesn't crawl
+the underlay again.
+
+A crawl doesn't start from scratch, though.  With each shard, librospack
+keeps an index of the directories it crawled, with each one's mtime and
+inode, and a directory whose mtime hasn't changed is not read again; its
+entry in the index says what reading it would find.  Every directory is
+still stat'd, since a change deep in a tree doesn't show up in the mtimes
+of the directories above it.  Within one process, stackages whose manifests
+haven't changed are carried over from one crawl to the next instead of
+being parsed again.
+
+Parsed manifests are in the shards too, which are mapped into memory and
+read in place.  While the cache is valid, a query like depends or
+cflags-only-I looks up each manifest's contents there instead of parsing
+the XML, as long as the manifest's mtime, size and inode are still what
+they were when it was cached.  A crawl uses the shards in the same way, so
+that only the manifests that have changed are parsed again.  Those that do
+need parsing are read by a streaming scanner that keeps only what rospack's
+queries look at (the top-level elements and the contents of export),
+without building a DOM; a manifest that the scanner can't make sense of is
+handed to TinyXML instead.
+
+The age of the cache says nothing about whether the trees it was built from
+have changed, so with ROS_CACHE_VALIDATION set to "fingerprint", each shard
+is instead checked against its directory index: it's used, however old it
+is, as long as the index covers every directory of the crawl and none of
+them has changed (by mtime, size and inode).  That takes a stat of each
+directory and manifest, spread over the crawler threads (and batched through
+io_uring when built with USE_IO_URING), rather than a crawl.  Directories
+modified within a couple of seconds of the crawl can't be vouched for by
+their mtime, so until they settle their root is crawled every time.
+ROS_CACHE_TIMEOUT=0 still forces a rebuild.
+
+A parallel build can start dozens of librospack processes at once, all
+finding the same stale cache.  Rather than each of them crawling, the first
+takes a lock on the cache (ROS_HOME/rospack_cache_*.lock) and rebuilds it,
+and the others wait for the lock and then read what it wrote.  A process
+that has waited 30 seconds gives up and crawls on its own.
+
+Tools like rosbuild and tab completion run rospack over and over, paying
+each time to start a process and parse the manifests.  `rospack daemon`
+(or `rosstack daemon`) stays running and listens on a socket in ROS_HOME
+(rospack_daemon.sock); while it's up, rospack and rosstack hand their
+commands to it, along with their environment and working directory, and
+write out what it sends back, so that it answers exactly as they would
+have.  The daemon keeps what it has crawled for each of the last few
+environments it was asked in, and runs each command in a child process of
+its own, so that commands run side by side and none of them sees what
+another left behind.  Each command still reads the cache as a new process
+would, so the daemon never answers from out-of-date results.  A command
+that the daemon doesn't take at once, or doesn't answer within
+ROS_DAEMON_TIMEOUT seconds (60 by default; 0 to wait for as long as it
+takes), runs in-process, as all commands do with no daemon running.  Only
+the user who started the daemon can connect to its socket, and it turns
+away connections from anyone else (root included), whose commands then
+run in-process too.
+
+Trees that don't change once they're installed, like the install spaces
+under /opt/ros, needn't be crawled by every user.  `rospack index build
+<root>` (or Rosstackage::buildIndex()) crawls root and writes what it found
+next to it, as root.rospack_index (or root.rosstack_index), in the same
+format as a shard: the stackages, their parsed manifests (and so their
+dependencies), and the stamps of all of the tree's directories.  Any crawl
+whose search path includes root, even a forced one, takes root's stackages
+from the index instead, as long as none of those directories has changed,
+and keeps no shard of its own for root.  Once the tree does change, it's
+crawled as usual until the index is built again.  Since the commands in
+the index's export strings are run as they are, an index is ignored
+unless it and the directory holding it belong to root or to the user
+running rospack, and can't be written by anyone else.
+
+Dependencies are worked out as queries need them and kept in one graph per
+crawl, with each stackage numbered and each one's dependencies stored as a
+run of numbers in a single array.  The same array, turned around, says
+which stackages depend directly on each one, so depends-on1 reads its answer
+straight from it and depends-on walks it outward from the stackage in
+question, rather than working out every stackage's dependencies in turn.
+Cycles are found up front from the graph's strongly connected components,
+so a query like depends visits each dependency once instead of descending
+into it again every time it's reached; the error for a circular dependency
+names the same stackages it always has.  For up to 16384 stackages, the
+graph also keeps a bit for each pair of stackages saying whether one depends
+on the other, worked out once per change to the graph; depends-on and
+Rosstackage::dependsOn() read their answers from it.  depends-why only
+follows dependencies that lead to its target, and can instead give one of
+the shortest chains (--shortest), stop after a number of chains
+(--max-paths), or just count them (--count) without listing any.
+
+A wet package may depend on a package that isn't in ROS_PACKAGE_PATH, as
+long as rosdep knows it as a system dependency.  librospack answers that
+from rosdep's sources cache (ROS_HOME/rosdep/sources.cache) itself, reading
+the keys out of the pickles that 'rosdep update' leaves there, rather than
+starting Python to ask rosdep.  Only for names that rosdep lists just for
+some other ROS distro or an OS (which librospack doesn't detect), or when
+the cache isn't in a form it can read, does it ask rosdep after all.
+Either way, the answers are kept in ROS_HOME/rospack_rosdep_cache, so that
+later processes needn't look again, until 'rosdep update' replaces the
+sources cache or ROS_DISTRO changes.  Names that do have to be looked up
+are gathered first (all of those a query like depends or rosdep will meet)
+and looked up together, so rosdep is asked about them in one go.
+
+The cflags-only-* and libs-only-* flags of wet packages come from
+pkg-config.  Where pkg-config is freedesktop.org's, librospack reads the .pc
+files itself, following Requires (and Requires.private, for cflags) and
+ordering and merging flags the way pkg-config 0.29 does, and reads each file
+only once per query.  pkg-config is run (through rosdep) only for what
+librospack can't be sure of: when pkg-config is pkgconf, when another
+PKG_CONFIG_* variable than PKG_CONFIG_PATH or PKG_CONFIG_LIBDIR is set, and
+for packages with version constraints, quoted flags or flags that may name
+system directories.  Unless PKG_CONFIG_LIBDIR is set, the default search
+path built into pkg-config is needed too; it's asked for once, and kept
+with the expansions of export strings below for as long as the
+pkg-config binary is unchanged.  The include and library directories of
+wet packages are then put in workspace order (those in the first catkin
+workspace in CMAKE_PREFIX_PATH first), as catkin_pkg would order them, but
+without starting Python; set ROS_REORDER_PATHS to "python" to have
+catkin_pkg do it instead.
+
+Export strings in manifests may run commands, in backquotes or $(...),
+which takes a shell for each string of each package in every query.  Their
+results are kept in ROS_HOME/rospack_export_cache for ROS_EXPORT_CACHE_TIMEOUT
+seconds (60 by default; 0 keeps nothing), under a key made from the command,
+the package, the working directory and the environment variables that the
+command names or that such commands commonly read (PATH, PKG_CONFIG_PATH,
+ROS_PACKAGE_PATH and the like).  A command that depends on something else
+can be made to run again by changing ROS_EXPORT_CACHE_KEY, which is part of
+the key too.  Strings that only refer to environment variables, like
+"-I${MY_PREFIX}/include", don't need a shell at all and are expanded by
+librospack itself, unless the string has quotes or backslashes in it, a
+variable is unset or a value has backslashes or wildcards in it.
+
+The commands that a query still has to run, and its calls to pkg-config
+through rosdep, are started together rather than one after another, on
+as many threads as there are cores (at most 8), or as many as
+ROS_EXPORT_THREADS says; set it to 1 to run them one at a time.  Their
+results are still put together in the order of the packages, so the
+query takes about as long as its slowest command.  A query that fails may
+have run commands of packages past the one that it fails on.
+
 librospack's performance can be adversely affected by the presence of very
 broad and/or deep directory structures that don't contain manifest files.
 If such directories are in librospack's search path, it can spend a lot of
@@ -105,6 +267,9 @@ and Rosstack.
 #ifndef ROSPACK_ROSPACK_H
 #define ROSPACK_ROSPACK_H
 
+#include <boost/cstdint.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/unordered_set.hpp>
 #include <boost/unordered_map.hpp>
 #include <list>
@@ -132,6 +297,13 @@ typedef enum
 // Forward declarations
 class Stackage;
 class DirectoryCrawlRecord;
+class CrawlNode;
+class BinaryCache;
+class BinaryCacheWriter;
+class DependencyGraph;
+class RosdepView;
+class SysDependencyCache;
+class ExportCache;
 
 /**
  * @brief The base class for package/stack ("stackage") crawlers.  Users of the library should
@@ -150,43 +322,99 @@ class ROSPACK_DECL Rosstackage
     std::vector<std::string> search_paths_;
     boost::unordered_map<std::string, std::vector<std::string> > dups_;
     boost::unordered_map<std::string, Stackage*> stackages_;
+    // stackages from the previous crawl that addStackage() may reuse
+    boost::unordered_map<std::string, Stackage*> reusable_;
+    // dependencies between the stackages computed so far
+    boost::scoped_ptr<DependencyGraph> graph_;
+    // rosdep's sources cache, read on the first system dependency lookup
+    boost::scoped_ptr<RosdepView> rosdep_view_;
+    bool rosdep_view_loaded_;
+    // answers from isSysPackage(), read from and saved to
+    // ROS_HOME/rospack_rosdep_cache
+    boost::scoped_ptr<SysDependencyCache> sys_packages_;
+    // why rosdep couldn't be asked, once it couldn't
+    std::string sys_packages_error_;
+    // expansions of backquotes and $(...) in export strings, read from and
+    // saved to ROS_HOME/rospack_export_cache
+    boost::scoped_ptr<ExportCache> export_cache_;
+    // how the commands in export strings that prefetchExports() ran ahead
+    // of the current query went, and what they printed
+    boost::unordered_map<std::string, std::pair<int, std::string> > expansions_;
     Stackage* findWithRecrawl(const std::string& name);
     void log(const std::string& level, const std::string& msg, bool append_errno);
     void clearStackages();
+    void setAsideStackages();
+    void clearReusable();
+    void clearGraph();
+    int graphId(Stackage* stackage);
     void addStackage(const std::string& path);
-    void crawlDetail(const std::string& path,
+    void addStackage(const std::string& path, const std::string& manifest_name,
+                     CrawlNode* crawled = NULL);
+    void registerStackage(Stackage* stackage);
+    void crawlDetail(const std::vector<std::string>& paths,
                      bool force,
                      int depth,
                      bool collect_profile_data,
                      std::vector<DirectoryCrawlRecord*>& profile_data,
                      boost::unordered_set<std::string>& profile_hash);
+    double commitCrawl(CrawlNode* node,
+                       bool collect_profile_data,
+                       std::vector<DirectoryCrawlRecord*>& profile_data,
+                       boost::unordered_set<std::string>& profile_hash);
     bool isStackage(const std::string& path);
     void loadManifest(Stackage* stackage);
     void computeDeps(Stackage* stackage, bool ignore_errors=false, bool ignore_missing=false);
     void computeDepsInternal(Stackage* stackage, bool ignore_errors, const std::string& depend_tag, bool ignore_missing=false);
     bool isSysPackage(const std::string& pkgname);
+    bool lookupRosdepView(const std::string& pkgname, bool& is_sys_package);
+    void lookupSysPackages(const std::vector<std::string>& pkgnames);
+    void prefetchSysPackages(const std::vector<Stackage*>& roots);
+    void isSysPackagesPython(const std::vector<std::string>& pkgnames,
+                             std::vector<bool>& values);
+    std::string getSysPackageCachePath();
+    std::string getExportCachePath();
+    ExportCache* getExportCache();
+    void exportStrings(Stackage* stackage, const std::string& lang,
+                       const std::string& attrib,
+                       std::vector<std::string>& strings, bool warn);
+    void prefetchExports(const std::vector<std::pair<Stackage*, std::string> >& strings,
+                         const std::string& pkg_config_option,
+                         const std::vector<std::string>& pkg_config_names,
+                         boost::unordered_map<std::string, std::pair<int, std::string> >& pkg_config_flags);
+    bool reorderPathsPython(const std::string& paths, std::string& reordered);
     void gatherDeps(Stackage* stackage, bool direct,
                     traversal_order_t order,
                     std::vector<Stackage*>& deps,
                     bool no_recursion_on_wet=false);
     void gatherDepsFull(Stackage* stackage, bool direct,
                         traversal_order_t order, int depth,
-                        boost::unordered_set<Stackage*>& deps_hash,
                         std::vector<Stackage*>& deps,
                         bool get_indented_deps,
                         std::vector<std::string>& indented_deps,
                         bool no_recursion_on_wet=false);
+    void checkDepsDepth(int id, int depth, bool no_recursion_on_wet);
     std::string getCachePath();
     std::string getCacheHash();
-    bool readCache();
+    bool readCache(const std::vector<std::string>& search_path);
     void writeCache();
     FILE* validateCache();
+    std::string getShardPath(const std::string& root);
+    boost::shared_ptr<BinaryCache> openShard(const std::string& root);
+    void addShardStackages(const boost::shared_ptr<BinaryCache>& shard);
+    bool readBinaryCache(const std::vector<std::string>& search_path);
+    void writeShard(const std::string& root,
+                    const std::vector<CrawlNode*>& found);
+    void addShardRecords(const std::vector<CrawlNode*>& found,
+                         const std::string& old_path,
+                         BinaryCacheWriter& writer);
+    std::string getSystemIndexPath(const std::string& root);
+    boost::shared_ptr<BinaryCache> openSystemIndex(const std::string& root);
     bool expandExportString(Stackage* stackage,
                             const std::string& instring,
                             std::string& outstring);
-    void depsWhyDetail(Stackage* from,
-                       Stackage* to,
-                       std::list<std::list<Stackage*> >& acc_list);
+    int depsWhyDetail(Stackage* from,
+                      Stackage* to,
+                      std::vector<char>& leads_to);
 
     void initPython();
 
@@ -227,6 +455,26 @@ class ROSPACK_DECL Rosstackage
      * @param force If true, then crawl even if the cache looks valid
      */
     void crawl(std::vector<std::string> search_path, bool force);
+    /**
+     * @brief Forget what the last crawl found, so that the next call to
+     *        crawl() goes by the cache (or the filesystem) just as it
+     *        would in a new instance.  Manifests that have been parsed are
+     *        kept, to be used again for stackages whose manifests haven't
+     *        changed since.
+     */
+    void forgetCrawl();
+    /**
+     * @brief Build a prebuilt index of a tree that doesn't change once
+     *        it's installed (e.g., an install space), holding its
+     *        stackages and their parsed manifests.  The index is written
+     *        next to the tree, and crawls use it in place of walking the
+     *        tree for as long as none of the tree's directories has
+     *        changed.
+     * @param root The tree to index, spelled as it appears in the search
+     *             path.
+     * @return True if the index was written, false otherwise.
+     */
+    bool buildIndex(const std::string& root);
     /**
      * @brief Is the current working directory a stackage?
      * @param name If in a stackage, then the stackage's name is written here.
@@ -320,6 +568,21 @@ class ROSPACK_DECL Rosstackage
      */
     bool depsOn(const std::string& name, bool direct,
                    std::vector<std::string>& deps);
+    /**
+     * @brief Does one stackage depend on another, directly or indirectly?
+     *        Once the first stackage's dependencies have been computed,
+     *        the answer comes from a table of every stackage's full
+     *        dependencies, so asking many such questions is cheap.
+     * @param name The stackage to work on.
+     * @param dep The stackage that name may depend on.
+     * @param depends If the question could be answered, the answer is
+     *                written here.
+     * @return True if the question could be answered (both stackages
+     *         exist and name's dependencies were computed), false
+     *         otherwise.
+     */
+    bool dependsOn(const std::string& name, const std::string& dep,
+                   bool& depends);
      /**
      * @brief Compute dependencies of a stackage (i.e., stackages that this
      *        stackages depends on), taking and returning stackage objects..
@@ -404,12 +667,28 @@ Dependency chains from roscpp to roslib:
 * roscpp -> std_msgs -> roslib
 * roscpp -> rosgraph_msgs -> std_msgs -> roslib
 @endverbatim
+     * @param shortest If true, then give just one of the shortest chains.
+     * @param max_paths If not negative, then give at most this many chains.
      * @return True if the dependency chains were computed, false
      * otherwise.
      */
     bool depsWhy(const std::string& from,
                  const std::string& to,
-                 std::string& output);
+                 std::string& output,
+                 bool shortest=false,
+                 int max_paths=-1);
+    /**
+     * @brief Count the dependency chains from one stackage to another,
+     * as depsWhy() would list them, without listing them.
+     * @param from The stackage that depends on.
+     * @param to The stackage that is depended on.
+     * @param count The number of chains, if it was computed.  It stops at
+     * the largest value it can hold.
+     * @return True if the dependency chains were counted, false otherwise.
+     */
+    bool depsWhyCount(const std::string& from,
+                      const std::string& to,
+                      boost::uint64_t& count);
     /**
      * @brief Compute rosdep entries that are declared in manifest of a package
      * and its dependencies.  Used by rosmake.
@@ -424,6 +703,8 @@ Dependency chains from roscpp to roslib:
     bool rosdeps(const std::string& name, bool direct,
                  std::set<std::string>& rosdeps);
     void _rosdeps(Stackage* stackage, std::set<std::string>& rosdeps, const char* tag_name);
+    void _wetRosdeps(Stackage* stackage, std::set<std::string>& rosdeps,
+                     std::vector<std::string>& pkgnames);
     /**
      * @brief Compute vcs entries that are declared in manifest of a package
      * and its dependencies.  Was used by Hudson build scripts; might not
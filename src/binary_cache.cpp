@@ -0,0 +1,567 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "binary_cache.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#if !defined(WIN32)
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
+
+namespace rospack
+{
+
+// The file is a sequence of 32-bit words in native byte order: a header,
+// then the stackage, element, attribute and directory tables, then the
+// strings.
+// Strings are referred to by (offset into the string table, length)
+// pairs.  Bump the version when changing any of this.
+static const boost::uint32_t CACHE_MAGIC = 0x52504b43; // "RPKC"
+static const boost::uint32_t CACHE_VERSION = 2;
+static const boost::uint32_t CACHE_BYTE_ORDER = 0x01020304;
+
+enum
+{
+  HEADER_MAGIC = 0,
+  HEADER_VERSION = 1,
+  HEADER_BYTE_ORDER = 2,
+  HEADER_FILE_SIZE = 3,
+  HEADER_KEY = 4,
+  HEADER_NUM_STACKAGES = 6,
+  HEADER_STACKAGES = 7,
+  HEADER_NUM_ELEMENTS = 8,
+  HEADER_ELEMENTS = 9,
+  HEADER_NUM_ATTRIBUTES = 10,
+  HEADER_ATTRIBUTES = 11,
+  HEADER_NUM_DIRECTORIES = 12,
+  HEADER_DIRECTORIES = 13,
+  HEADER_STRINGS = 14,
+  HEADER_STRINGS_SIZE = 15,
+  HEADER_WORDS = 16
+};
+
+enum
+{
+  STACKAGE_NAME = 0,
+  STACKAGE_PATH = 2,
+  STACKAGE_MANIFEST_PATH = 4,
+  STACKAGE_MANIFEST_NAME = 6,
+  STACKAGE_FLAGS = 8,
+  STACKAGE_INO = 9,
+  STACKAGE_MTIME_SEC = 11,
+  STACKAGE_MTIME_NSEC = 13,
+  STACKAGE_SIZE = 14,
+  STACKAGE_FIRST_ELEMENT = 16,
+  STACKAGE_NUM_ELEMENTS = 17,
+  STACKAGE_WORDS = 18
+};
+
+enum
+{
+  ELEMENT_TAG = 0,
+  ELEMENT_TEXT = 2,
+  ELEMENT_HAS_TEXT = 4,
+  ELEMENT_FIRST_ATTRIBUTE = 5,
+  ELEMENT_NUM_ATTRIBUTES = 6,
+  ELEMENT_FIRST_CHILD = 7,
+  ELEMENT_NUM_CHILDREN = 8,
+  ELEMENT_WORDS = 9
+};
+
+enum
+{
+  ATTRIBUTE_NAME = 0,
+  ATTRIBUTE_VALUE = 2,
+  ATTRIBUTE_WORDS = 4
+};
+
+enum
+{
+  DIRECTORY_PATH = 0,
+  DIRECTORY_INO = 2,
+  DIRECTORY_MTIME_SEC = 4,
+  DIRECTORY_MTIME_NSEC = 6,
+  DIRECTORY_SIZE = 7,
+  DIRECTORY_WORDS = 9
+};
+
+// Only export elements have children, and theirs don't
+static const int MAX_ELEMENT_DEPTH = 2;
+
+static boost::uint64_t
+join64(const boost::uint32_t* words)
+{
+  return (boost::uint64_t)words[0] | ((boost::uint64_t)words[1] << 32);
+}
+
+static void
+split64(boost::uint64_t value, boost::uint32_t* words)
+{
+  words[0] = (boost::uint32_t)value;
+  words[1] = (boost::uint32_t)(value >> 32);
+}
+
+#if !defined(WIN32)
+// Can the file be written only by its owner, who is root or us?
+static bool
+ownedByUs(const struct stat& s)
+{
+  return (s.st_uid == 0 || s.st_uid == geteuid()) &&
+          !(s.st_mode & (S_IWGRP | S_IWOTH));
+}
+#endif
+
+BinaryCache::BinaryCache() :
+        data_(NULL),
+        size_(0),
+        mapped_(false),
+        num_stackages_(0),
+        num_directories_(0)
+{
+}
+
+BinaryCache::~BinaryCache()
+{
+  close();
+}
+
+void
+BinaryCache::close()
+{
+#if !defined(WIN32)
+  if(mapped_)
+    munmap((void*)data_, size_);
+#endif
+  buffer_.clear();
+  data_ = NULL;
+  size_ = 0;
+  mapped_ = false;
+  num_stackages_ = 0;
+  num_directories_ = 0;
+  by_manifest_path_.clear();
+}
+
+bool
+BinaryCache::open(const std::string& filename, bool shared)
+{
+  close();
+#if defined(WIN32)
+  // Files aren't owned the same way here, so even a shared one is taken
+  // as it is
+  FILE* file = fopen(filename.c_str(), "rb");
+  if(!file)
+    return false;
+  char buf[65536];
+  size_t nread;
+  while((nread = fread(buf, 1, sizeof(buf), file)) > 0)
+    buffer_.insert(buffer_.end(), buf, buf + nread);
+  fclose(file);
+  if(buffer_.empty())
+    return false;
+  data_ = &buffer_[0];
+  size_ = buffer_.size();
+#else
+  int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+    return false;
+  struct stat s;
+  if(fstat(fd, &s) != 0 || s.st_size < (off_t)(HEADER_WORDS * sizeof(boost::uint32_t)))
+  {
+    ::close(fd);
+    return false;
+  }
+  if(shared)
+  {
+    // Whoever can write the directory can replace the file
+    std::string dir = filename.substr(0, filename.rfind('/') + 1);
+    struct stat ds;
+    if(!ownedByUs(s) || stat(dir.empty() ? "." : dir.c_str(), &ds) != 0 ||
+       !ownedByUs(ds))
+    {
+      ::close(fd);
+      return false;
+    }
+  }
+  void* data = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(data == MAP_FAILED)
+    return false;
+  data_ = (const char*)data;
+  size_ = s.st_size;
+  mapped_ = true;
+#endif
+
+  const boost::uint32_t* header = (const boost::uint32_t*)data_;
+  bool ok = size_ >= HEADER_WORDS * sizeof(boost::uint32_t) &&
+          header[HEADER_MAGIC] == CACHE_MAGIC &&
+          header[HEADER_VERSION] == CACHE_VERSION &&
+          header[HEADER_BYTE_ORDER] == CACHE_BYTE_ORDER &&
+          header[HEADER_FILE_SIZE] == size_;
+  // Each table has to lie within the file
+  const boost::uint32_t tables[][3] =
+  {
+    {HEADER_STACKAGES, HEADER_NUM_STACKAGES, STACKAGE_WORDS},
+    {HEADER_ELEMENTS, HEADER_NUM_ELEMENTS, ELEMENT_WORDS},
+    {HEADER_ATTRIBUTES, HEADER_NUM_ATTRIBUTES, ATTRIBUTE_WORDS},
+    {HEADER_DIRECTORIES, HEADER_NUM_DIRECTORIES, DIRECTORY_WORDS}
+  };
+  for(size_t i = 0; ok && i < sizeof(tables) / sizeof(tables[0]); i++)
+  {
+    boost::uint64_t offset = header[tables[i][0]];
+    boost::uint64_t end = offset + (boost::uint64_t)header[tables[i][1]] *
+            tables[i][2] * sizeof(boost::uint32_t);
+    ok = (offset % sizeof(boost::uint32_t)) == 0 && end <= size_;
+  }
+  ok = ok && (boost::uint64_t)header[HEADER_STRINGS] + header[HEADER_STRINGS_SIZE] <= size_;
+  if(ok)
+  {
+    num_stackages_ = header[HEADER_NUM_STACKAGES];
+    num_directories_ = header[HEADER_NUM_DIRECTORIES];
+    ok = key() != NULL;
+  }
+  for(size_t i = 0; ok && i < num_stackages_; i++)
+    ok = name(i) && path(i) && manifestPath(i) && manifestName(i);
+  for(size_t i = 0; ok && i < num_directories_; i++)
+    ok = directoryPath(i) != NULL;
+  if(!ok)
+    close();
+  return ok;
+}
+
+// A string from the table, or NULL if the reference is bad
+const char*
+BinaryCache::string(const boost::uint32_t* ref) const
+{
+  const boost::uint32_t* header = (const boost::uint32_t*)data_;
+  boost::uint64_t end = (boost::uint64_t)ref[0] + ref[1];
+  if(end >= header[HEADER_STRINGS_SIZE])
+    return NULL;
+  const char* str = data_ + header[HEADER_STRINGS] + ref[0];
+  if(str[ref[1]] != '\0')
+    return NULL;
+  return str;
+}
+
+const char*
+BinaryCache::key() const
+{
+  return string((const boost::uint32_t*)data_ + HEADER_KEY);
+}
+
+static const boost::uint32_t*
+record(const char* data, int table, size_t i, size_t words)
+{
+  const boost::uint32_t* header = (const boost::uint32_t*)data;
+  return (const boost::uint32_t*)(data + header[table]) + i * words;
+}
+
+const char*
+BinaryCache::name(size_t i) const
+{
+  return string(record(data_, HEADER_STACKAGES, i, STACKAGE_WORDS) + STACKAGE_NAME);
+}
+
+const char*
+BinaryCache::path(size_t i) const
+{
+  return string(record(data_, HEADER_STACKAGES, i, STACKAGE_WORDS) + STACKAGE_PATH);
+}
+
+const char*
+BinaryCache::manifestPath(size_t i) const
+{
+  return string(record(data_, HEADER_STACKAGES, i, STACKAGE_WORDS) + STACKAGE_MANIFEST_PATH);
+}
+
+const char*
+BinaryCache::manifestName(size_t i) const
+{
+  return string(record(data_, HEADER_STACKAGES, i, STACKAGE_WORDS) + STACKAGE_MANIFEST_NAME);
+}
+
+int
+BinaryCache::flags(size_t i) const
+{
+  return record(data_, HEADER_STACKAGES, i, STACKAGE_WORDS)[STACKAGE_FLAGS];
+}
+
+FileStamp
+BinaryCache::manifestStamp(size_t i) const
+{
+  const boost::uint32_t* rec = record(data_, HEADER_STACKAGES, i, STACKAGE_WORDS);
+  FileStamp stamp;
+  stamp.ino_ = join64(rec + STACKAGE_INO);
+  stamp.mtime_sec_ = (boost::int64_t)join64(rec + STACKAGE_MTIME_SEC);
+  stamp.mtime_nsec_ = rec[STACKAGE_MTIME_NSEC];
+  stamp.size_ = join64(rec + STACKAGE_SIZE);
+  return stamp;
+}
+
+const char*
+BinaryCache::directoryPath(size_t i) const
+{
+  return string(record(data_, HEADER_DIRECTORIES, i, DIRECTORY_WORDS) + DIRECTORY_PATH);
+}
+
+FileStamp
+BinaryCache::directoryStamp(size_t i) const
+{
+  const boost::uint32_t* rec = record(data_, HEADER_DIRECTORIES, i, DIRECTORY_WORDS);
+  FileStamp stamp;
+  stamp.ino_ = join64(rec + DIRECTORY_INO);
+  stamp.mtime_sec_ = (boost::int64_t)join64(rec + DIRECTORY_MTIME_SEC);
+  stamp.mtime_nsec_ = rec[DIRECTORY_MTIME_NSEC];
+  stamp.size_ = join64(rec + DIRECTORY_SIZE);
+  return stamp;
+}
+
+bool
+BinaryCache::elements(size_t i, std::vector<ManifestElement>& elements) const
+{
+  const boost::uint32_t* rec = record(data_, HEADER_STACKAGES, i, STACKAGE_WORDS);
+  elements.clear();
+  return decode(rec[STACKAGE_FIRST_ELEMENT], rec[STACKAGE_NUM_ELEMENTS], 1, elements);
+}
+
+bool
+BinaryCache::decode(boost::uint32_t first, boost::uint32_t count, int depth,
+                    std::vector<ManifestElement>& elements) const
+{
+  const boost::uint32_t* header = (const boost::uint32_t*)data_;
+  if(depth > MAX_ELEMENT_DEPTH ||
+     (boost::uint64_t)first + count > header[HEADER_NUM_ELEMENTS])
+    return false;
+
+  elements.resize(count);
+  for(boost::uint32_t k = 0; k < count; k++)
+  {
+    const boost::uint32_t* rec = record(data_, HEADER_ELEMENTS, first + k, ELEMENT_WORDS);
+    ManifestElement& element = elements[k];
+    const char* tag = string(rec + ELEMENT_TAG);
+    const char* text = string(rec + ELEMENT_TEXT);
+    if(!tag || !text)
+      return false;
+    element.tag_.assign(tag, rec[ELEMENT_TAG + 1]);
+    element.has_text_ = rec[ELEMENT_HAS_TEXT] != 0;
+    element.text_.assign(text, rec[ELEMENT_TEXT + 1]);
+
+    boost::uint32_t first_attribute = rec[ELEMENT_FIRST_ATTRIBUTE];
+    boost::uint32_t num_attributes = rec[ELEMENT_NUM_ATTRIBUTES];
+    if((boost::uint64_t)first_attribute + num_attributes > header[HEADER_NUM_ATTRIBUTES])
+      return false;
+    element.attributes_.resize(num_attributes);
+    for(boost::uint32_t a = 0; a < num_attributes; a++)
+    {
+      const boost::uint32_t* att = record(data_, HEADER_ATTRIBUTES, first_attribute + a, ATTRIBUTE_WORDS);
+      const char* name = string(att + ATTRIBUTE_NAME);
+      const char* value = string(att + ATTRIBUTE_VALUE);
+      if(!name || !value)
+        return false;
+      element.attributes_[a].first.assign(name, att[ATTRIBUTE_NAME + 1]);
+      element.attributes_[a].second.assign(value, att[ATTRIBUTE_VALUE + 1]);
+    }
+
+    if(rec[ELEMENT_NUM_CHILDREN] &&
+       !decode(rec[ELEMENT_FIRST_CHILD], rec[ELEMENT_NUM_CHILDREN], depth + 1,
+               element.children_))
+      return false;
+  }
+  return true;
+}
+
+bool
+BinaryCache::find(const std::string& manifest_path, size_t& i) const
+{
+  if(by_manifest_path_.empty())
+  {
+    for(size_t k = 0; k < num_stackages_; k++)
+      by_manifest_path_[manifestPath(k)] = k;
+  }
+  boost::unordered_map<std::string, size_t>::const_iterator it =
+          by_manifest_path_.find(manifest_path);
+  if(it == by_manifest_path_.end())
+    return false;
+  i = it->second;
+  return true;
+}
+
+BinaryCacheWriter::BinaryCacheWriter()
+{
+}
+
+void
+BinaryCacheWriter::addString(const std::string& str, boost::uint32_t* ref)
+{
+  boost::unordered_map<std::string, boost::uint32_t>::const_iterator it =
+          string_offsets_.find(str);
+  if(it != string_offsets_.end())
+    ref[0] = it->second;
+  else
+  {
+    ref[0] = strings_.size();
+    strings_.append(str);
+    strings_.push_back('\0');
+    string_offsets_[str] = ref[0];
+  }
+  ref[1] = str.size();
+}
+
+// Append elements (contiguously, so that they can be found from the
+// index of the first), followed by their children.  Returns the index of
+// the first.
+boost::uint32_t
+BinaryCacheWriter::addElements(const std::vector<ManifestElement>& elements)
+{
+  boost::uint32_t first = elements_.size() / ELEMENT_WORDS;
+  elements_.resize(elements_.size() + elements.size() * ELEMENT_WORDS);
+  for(size_t k = 0; k < elements.size(); k++)
+  {
+    const ManifestElement& element = elements[k];
+    boost::uint32_t* rec = &elements_[(first + k) * ELEMENT_WORDS];
+    addString(element.tag_, rec + ELEMENT_TAG);
+    addString(element.text_, rec + ELEMENT_TEXT);
+    rec[ELEMENT_HAS_TEXT] = element.has_text_;
+    rec[ELEMENT_FIRST_ATTRIBUTE] = attributes_.size() / ATTRIBUTE_WORDS;
+    rec[ELEMENT_NUM_ATTRIBUTES] = element.attributes_.size();
+    for(size_t a = 0; a < element.attributes_.size(); a++)
+    {
+      attributes_.resize(attributes_.size() + ATTRIBUTE_WORDS);
+      boost::uint32_t* att = &attributes_[attributes_.size() - ATTRIBUTE_WORDS];
+      addString(element.attributes_[a].first, att + ATTRIBUTE_NAME);
+      addString(element.attributes_[a].second, att + ATTRIBUTE_VALUE);
+    }
+  }
+  for(size_t k = 0; k < elements.size(); k++)
+  {
+    // elements_ may move as children are added
+    boost::uint32_t first_child = 0;
+    if(!elements[k].children_.empty())
+      first_child = addElements(elements[k].children_);
+    boost::uint32_t* rec = &elements_[(first + k) * ELEMENT_WORDS];
+    rec[ELEMENT_FIRST_CHILD] = first_child;
+    rec[ELEMENT_NUM_CHILDREN] = elements[k].children_.size();
+  }
+  return first;
+}
+
+void
+BinaryCacheWriter::add(const std::string& name,
+                       const std::string& path,
+                       const std::string& manifest_path,
+                       const std::string& manifest_name,
+                       int flags,
+                       const FileStamp& manifest_stamp,
+                       const std::vector<ManifestElement>& elements)
+{
+  boost::uint32_t rec[STACKAGE_WORDS];
+  addString(name, rec + STACKAGE_NAME);
+  addString(path, rec + STACKAGE_PATH);
+  addString(manifest_path, rec + STACKAGE_MANIFEST_PATH);
+  addString(manifest_name, rec + STACKAGE_MANIFEST_NAME);
+  rec[STACKAGE_FLAGS] = flags;
+  split64(manifest_stamp.ino_, rec + STACKAGE_INO);
+  split64((boost::uint64_t)manifest_stamp.mtime_sec_, rec + STACKAGE_MTIME_SEC);
+  rec[STACKAGE_MTIME_NSEC] = (boost::uint32_t)manifest_stamp.mtime_nsec_;
+  split64(manifest_stamp.size_, rec + STACKAGE_SIZE);
+  rec[STACKAGE_FIRST_ELEMENT] = addElements(elements);
+  rec[STACKAGE_NUM_ELEMENTS] = elements.size();
+  stackages_.insert(stackages_.end(), rec, rec + STACKAGE_WORDS);
+}
+
+void
+BinaryCacheWriter::addDirectory(const std::string& path,
+                                const FileStamp& stamp)
+{
+  boost::uint32_t rec[DIRECTORY_WORDS];
+  addString(path, rec + DIRECTORY_PATH);
+  split64(stamp.ino_, rec + DIRECTORY_INO);
+  split64((boost::uint64_t)stamp.mtime_sec_, rec + DIRECTORY_MTIME_SEC);
+  rec[DIRECTORY_MTIME_NSEC] = (boost::uint32_t)stamp.mtime_nsec_;
+  split64(stamp.size_, rec + DIRECTORY_SIZE);
+  directories_.insert(directories_.end(), rec, rec + DIRECTORY_WORDS);
+}
+
+bool
+BinaryCacheWriter::write(const std::string& filename,
+                         const std::string& key)
+{
+  boost::uint32_t header[HEADER_WORDS];
+  addString(key, header + HEADER_KEY);
+  header[HEADER_MAGIC] = CACHE_MAGIC;
+  header[HEADER_VERSION] = CACHE_VERSION;
+  header[HEADER_BYTE_ORDER] = CACHE_BYTE_ORDER;
+  size_t offset = sizeof(header);
+  header[HEADER_NUM_STACKAGES] = stackages_.size() / STACKAGE_WORDS;
+  header[HEADER_STACKAGES] = offset;
+  offset += stackages_.size() * sizeof(boost::uint32_t);
+  header[HEADER_NUM_ELEMENTS] = elements_.size() / ELEMENT_WORDS;
+  header[HEADER_ELEMENTS] = offset;
+  offset += elements_.size() * sizeof(boost::uint32_t);
+  header[HEADER_NUM_ATTRIBUTES] = attributes_.size() / ATTRIBUTE_WORDS;
+  header[HEADER_ATTRIBUTES] = offset;
+  offset += attributes_.size() * sizeof(boost::uint32_t);
+  header[HEADER_NUM_DIRECTORIES] = directories_.size() / DIRECTORY_WORDS;
+  header[HEADER_DIRECTORIES] = offset;
+  offset += directories_.size() * sizeof(boost::uint32_t);
+  header[HEADER_STRINGS] = offset;
+  header[HEADER_STRINGS_SIZE] = strings_.size();
+  offset += strings_.size();
+  header[HEADER_FILE_SIZE] = offset;
+  // Offsets are 32 bits
+  if(offset != header[HEADER_FILE_SIZE])
+    return false;
+
+  std::string tmp_filename;
+  FILE* file = create_replacement_file(filename, tmp_filename);
+  if(!file)
+    return false;
+  bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+  if(ok && !stackages_.empty())
+    ok = fwrite(&stackages_[0], sizeof(boost::uint32_t), stackages_.size(), file) == stackages_.size();
+  if(ok && !elements_.empty())
+    ok = fwrite(&elements_[0], sizeof(boost::uint32_t), elements_.size(), file) == elements_.size();
+  if(ok && !attributes_.empty())
+    ok = fwrite(&attributes_[0], sizeof(boost::uint32_t), attributes_.size(), file) == attributes_.size();
+  if(ok && !directories_.empty())
+    ok = fwrite(&directories_[0], sizeof(boost::uint32_t), directories_.size(), file) == directories_.size();
+  if(ok && !strings_.empty())
+    ok = fwrite(strings_.data(), 1, strings_.size(), file) == strings_.size();
+  if(!ok)
+  {
+    fclose(file);
+    remove(tmp_filename.c_str());
+    return false;
+  }
+  return replace_file(file, tmp_filename, filename);
+}
+
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ROSPACK_BINARY_CACHE_H
+#define ROSPACK_BINARY_CACHE_H
+
+#include "crawl.h"
+#include "manifest.h"
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <string>
+#include <vector>
+
+namespace rospack
+{
+
+/**
+ * @brief A cache of stackages with their manifests already parsed, in a
+ * file that is mapped into memory and read in place.  Each stackage's
+ * manifest elements are decoded only when asked for.
+ *
+ * The file holds a header, a table of stackages, tables of manifest
+ * elements and attributes, a table of directories with their stamps (for
+ * validating the file against the tree it was built from), and a table of
+ * strings, which are stored once each and NUL-terminated so that they can
+ * be handed out as they are.
+ *
+ * Names and paths are read in place, but manifest elements aren't: the
+ * rest of rospack works on ManifestElement, which owns its strings, so
+ * decoding a stackage's elements copies them out of the mapping.  That is
+ * done at most once per stackage, and only for the stackages a query
+ * looks into.
+ */
+class BinaryCache
+{
+  public:
+    // Stackage flags
+    enum
+    {
+      // \brief a wet package with a metapackage export
+      METAPACKAGE = 1 << 0,
+      // \brief the manifest stamp can be trusted to change with the manifest
+      STAMPED = 1 << 1,
+      // \brief the manifest couldn't be parsed
+      PARSE_ERROR = 1 << 2
+    };
+
+    BinaryCache();
+    ~BinaryCache();
+
+    /**
+     * @brief Map a cache file.
+     * @param shared Set for a file that other users may have written.
+     * Whatever the file says is believed, including the commands in its
+     * export strings, so it's then only taken if it and the directory
+     * holding it are owned by root or us, and nobody else can write them.
+     * @return False if it's missing, from another version of rospack,
+     * damaged, or (if shared) open to others.
+     */
+    bool open(const std::string& filename, bool shared = false);
+    // \brief what the cache was written for: the search path root that
+    // was crawled
+    const char* key() const;
+
+    size_t size() const { return num_stackages_; }
+    const char* name(size_t i) const;
+    const char* path(size_t i) const;
+    const char* manifestPath(size_t i) const;
+    const char* manifestName(size_t i) const;
+    int flags(size_t i) const;
+    FileStamp manifestStamp(size_t i) const;
+    /**
+     * @brief Decode the top-level elements of a stackage's manifest, copying
+     * their strings out of the mapping.
+     * @return False if the records are damaged.
+     */
+    bool elements(size_t i, std::vector<ManifestElement>& elements) const;
+    /**
+     * @brief Look up a stackage by the path to its manifest.
+     */
+    bool find(const std::string& manifest_path, size_t& i) const;
+
+    size_t numDirectories() const { return num_directories_; }
+    const char* directoryPath(size_t i) const;
+    FileStamp directoryStamp(size_t i) const;
+
+  private:
+    const char* data_;
+    size_t size_;
+    bool mapped_;
+    std::vector<char> buffer_;
+    size_t num_stackages_;
+    size_t num_directories_;
+    mutable boost::unordered_map<std::string, size_t> by_manifest_path_;
+
+    void close();
+    const char* string(const boost::uint32_t* ref) const;
+    bool decode(boost::uint32_t first, boost::uint32_t count, int depth,
+                std::vector<ManifestElement>& elements) const;
+
+    BinaryCache(const BinaryCache&);
+    BinaryCache& operator=(const BinaryCache&);
+};
+typedef boost::shared_ptr<BinaryCache> BinaryCachePtr;
+
+/**
+ * @brief Builds a binary cache file.
+ */
+class BinaryCacheWriter
+{
+  public:
+    BinaryCacheWriter();
+    void add(const std::string& name,
+             const std::string& path,
+             const std::string& manifest_path,
+             const std::string& manifest_name,
+             int flags,
+             const FileStamp& manifest_stamp,
+             const std::vector<ManifestElement>& elements);
+    void addDirectory(const std::string& path, const FileStamp& stamp);
+    /**
+     * @brief Replace the file with the cache.
+     * @return False if that couldn't be done.
+     */
+    bool write(const std::string& filename,
+               const std::string& key);
+
+  private:
+    std::vector<boost::uint32_t> stackages_;
+    std::vector<boost::uint32_t> elements_;
+    std::vector<boost::uint32_t> attributes_;
+    std::vector<boost::uint32_t> directories_;
+    std::string strings_;
+    boost::unordered_map<std::string, boost::uint32_t> string_offsets_;
+
+    void addString(const std::string& str, boost::uint32_t* ref);
+    boost::uint32_t addElements(const std::vector<ManifestElement>& elements);
+};
+
+}
+
+#endif
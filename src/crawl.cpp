@@ -0,0 +1,990 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "crawl.h"
+#include "utils.h"
+#include "work_queue.h"
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <dirent.h>
+  #include <stdint.h>
+  #include <sys/syscall.h>
+#endif
+#if defined(ROSPACK_USE_IO_URING)
+  #include <linux/io_uring.h>
+  #include <sys/mman.h>
+  #include <sys/resource.h>
+  #include <boost/thread/mutex.hpp>
+  #include <boost/thread/tss.hpp>
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace rospack
+{
+
+// The manifest names have to agree with those used in rospack.cpp
+static const char* CRAWL_MARKER_NAMES[] =
+{
+  "CATKIN_IGNORE",
+  "rospack_nosubdirs",
+  "manifest.xml",
+  "stack.xml",
+  "package.xml"
+};
+static const int CRAWL_MARKER_FLAGS[] =
+{
+  DirectoryListing::CATKIN_IGNORE_FILE,
+  DirectoryListing::NOSUBDIRS_FILE,
+  DirectoryListing::ROSPACK_MANIFEST_FILE,
+  DirectoryListing::ROSSTACK_MANIFEST_FILE,
+  DirectoryListing::PACKAGE_MANIFEST_FILE
+};
+static const size_t NUM_CRAWL_MARKERS =
+        sizeof(CRAWL_MARKER_FLAGS) / sizeof(CRAWL_MARKER_FLAGS[0]);
+
+// Returns the flag for a file that steers the crawl, or 0
+static int
+markerFlag(const char* name)
+{
+  for(size_t i = 0; i < NUM_CRAWL_MARKERS; i++)
+  {
+    if(!strcmp(name, CRAWL_MARKER_NAMES[i]))
+      return CRAWL_MARKER_FLAGS[i];
+  }
+  return 0;
+}
+
+static const char* DIRECTORY_INDEX_VERSION = "#rospack directory index 2";
+// How long after its last modification before an mtime can be trusted to
+// change when the file does.  Filesystems with 2 second timestamps exist.
+static const double MTIME_SETTLE_TIME = 2.0;
+
+static void
+stampFromStat(const struct stat& s, FileStamp& stamp)
+{
+  stamp.ino_ = s.st_ino;
+  stamp.mtime_sec_ = s.st_mtime;
+#if defined(__linux__)
+  stamp.mtime_nsec_ = s.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+  stamp.mtime_nsec_ = s.st_mtimespec.tv_nsec;
+#else
+  stamp.mtime_nsec_ = 0;
+#endif
+  stamp.size_ = s.st_size;
+}
+
+bool
+FileStamp::settled(double now) const
+{
+  return mtime_sec_ + mtime_nsec_ / 1e9 < now - MTIME_SETTLE_TIME;
+}
+
+bool
+stampFile(const std::string& path, FileStamp& stamp)
+{
+  struct stat s;
+  if(stat(path.c_str(), &s) != 0)
+    return false;
+  stampFromStat(s, stamp);
+  return true;
+}
+
+bool
+stampDirectory(const std::string& path,
+               const DirectoryHandlePtr& parent,
+               const std::string& name,
+               FileStamp& stamp)
+{
+  struct stat s;
+#if defined(__linux__)
+  int ret = parent ? fstatat(parent->fd(), name.c_str(), &s, 0) : stat(path.c_str(), &s);
+#else
+  int ret = stat(path.c_str(), &s);
+#endif
+  if(ret != 0 || !S_ISDIR(s.st_mode))
+    return false;
+  stampFromStat(s, stamp);
+  return true;
+}
+
+#if defined(ROSPACK_USE_IO_URING)
+// Directories opened ahead of time stay open until they're listed, so
+// cap how many there may be at once (at a quarter of the descriptor limit)
+static const size_t MAX_PREOPENED_DIRS = 256;
+static boost::mutex preopen_mutex;
+static size_t preopen_count = 0;
+static size_t preopen_limit = 0;
+
+static bool
+acquirePreopenSlot()
+{
+  boost::mutex::scoped_lock lock(preopen_mutex);
+  if(preopen_limit == 0)
+  {
+    preopen_limit = MAX_PREOPENED_DIRS;
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+       rl.rlim_cur / 4 < preopen_limit)
+      preopen_limit = rl.rlim_cur / 4;
+  }
+  if(preopen_count >= preopen_limit)
+    return false;
+  preopen_count++;
+  return true;
+}
+
+static void
+releasePreopenSlot()
+{
+  boost::mutex::scoped_lock lock(preopen_mutex);
+  preopen_count--;
+}
+#endif
+
+DirectoryHandle::~DirectoryHandle()
+{
+  unbudget();
+#if defined(__linux__)
+  if(fd_ >= 0)
+    close(fd_);
+#endif
+}
+
+void
+DirectoryHandle::unbudget()
+{
+#if defined(ROSPACK_USE_IO_URING)
+  if(budgeted_)
+    releasePreopenSlot();
+#endif
+  budgeted_ = false;
+}
+
+#if defined(__linux__)
+
+// The kernel's record layout for getdents64(2); glibc doesn't export it.
+struct linux_dirent64
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+static const size_t GETDENTS_BUFFER_SIZE = 32768;
+static const int DIRECTORY_OPEN_FLAGS = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+
+static std::string
+joinPath(const std::string& path, const std::string& name)
+{
+  if(path.empty() || path[path.size()-1] == '/')
+    return path + name;
+  return path + "/" + name;
+}
+
+bool
+listDirectory(const std::string& path,
+              const DirectoryHandlePtr& parent,
+              const std::string& name,
+              const DirectoryHandlePtr& preopened,
+              bool stamp,
+              DirectoryListing& listing,
+              DirectoryHandlePtr& handle,
+              std::vector<std::string>& warnings)
+{
+  int fd;
+  if(preopened)
+  {
+    preopened->unbudget();
+    fd = preopened->fd();
+  }
+  else if(parent)
+  {
+    fd = openat(parent->fd(), name.c_str(), DIRECTORY_OPEN_FLAGS);
+    // Out of descriptors; the absolute path doesn't need the parent's
+    if(fd < 0 && (errno == EMFILE || errno == ENFILE))
+      fd = open(path.c_str(), DIRECTORY_OPEN_FLAGS);
+  }
+  else
+    fd = open(path.c_str(), DIRECTORY_OPEN_FLAGS);
+
+  if(fd < 0)
+  {
+    // Not a directory, or one we may not read: silently skip it, as for
+    // any other file.
+    if(errno != ENOENT && errno != ENOTDIR && errno != EACCES)
+      warnings.push_back(std::string("error while looking at ") + path + ": " + strerror(errno));
+    return false;
+  }
+  DirectoryHandlePtr dir = preopened ? preopened : DirectoryHandlePtr(new DirectoryHandle(fd));
+
+  // Stamp the directory before reading it, so that a change made while
+  // we're reading shows up as a changed stamp next time.
+  bool stable = false;
+  if(stamp)
+  {
+    struct stat s;
+    if(fstat(fd, &s) == 0)
+    {
+      stampFromStat(s, listing.stamp_);
+      stable = true;
+    }
+  }
+
+  // Entries whose type the kernel couldn't tell us need a stat, but we
+  // put that off (see resolveSubdirs()) unless they might be one of the
+  // markers, since most directories that hold them are packages we won't
+  // descend into.
+  long buf[GETDENTS_BUFFER_SIZE / sizeof(long)];
+  for(;;)
+  {
+    long nread = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+    if(nread < 0)
+    {
+      // suppress logging of error message if reading of directory failed
+      // due to missing permission
+      if(errno != EACCES)
+        warnings.push_back(std::string("error while crawling ") + path + ": " + strerror(errno));
+      stable = false;
+      break;
+    }
+    if(nread == 0)
+      break;
+
+    for(long pos = 0; pos < nread;)
+    {
+      const linux_dirent64* ent =
+              reinterpret_cast<const linux_dirent64*>(reinterpret_cast<const char*>(buf) + pos);
+      pos += ent->d_reclen;
+
+      const char* ent_name = ent->d_name;
+      // Ignore directories starting with '.' (which includes . and ..)
+      if(ent_name[0] == '.' || ent_name[0] == '\0')
+        continue;
+
+      unsigned char type = ent->d_type;
+      if(type == DT_LNK || type == DT_UNKNOWN)
+        stable = false;
+      int flag = markerFlag(ent_name);
+      if(flag && (type == DT_LNK || type == DT_UNKNOWN))
+      {
+        struct stat s;
+        if(fstatat(fd, ent_name, &s, 0) != 0)
+          continue;
+        if(S_ISREG(s.st_mode))
+          type = DT_REG;
+        else if(S_ISDIR(s.st_mode))
+          type = DT_DIR;
+        else
+          continue;
+      }
+
+      if(type == DT_REG)
+        listing.flags_ |= flag;
+      else if(type == DT_DIR || type == DT_LNK || type == DT_UNKNOWN)
+      {
+        listing.subdirs_.push_back(ent_name);
+        listing.unresolved_.push_back(type != DT_DIR);
+      }
+    }
+  }
+
+  listing.stable_ = stable;
+  if(!listing.subdirs_.empty())
+    handle = dir;
+  return true;
+}
+
+#if defined(ROSPACK_USE_IO_URING)
+
+/*
+ * Just enough of an io_uring to push a batch of probes through the kernel
+ * and wait for all of them to complete.  Each crawler thread has its own.
+ */
+class IoUring
+{
+  public:
+    explicit IoUring(unsigned entries);
+    ~IoUring();
+    bool ok() const { return fd_ >= 0; }
+    unsigned capacity() const { return sq_entries_; }
+    // The i'th entry of the next batch, zeroed
+    io_uring_sqe* entry(unsigned i);
+    // Submit entries [0, n) and wait for them; results[user_data] gets the
+    // result of each.  On failure the ring is no longer usable.
+    bool run(unsigned n, std::vector<int>& results);
+  private:
+    int fd_;
+    unsigned sq_entries_;
+    void* sq_ring_;
+    size_t sq_ring_size_;
+    void* cq_ring_;
+    size_t cq_ring_size_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe* cqes_;
+
+    void shutdown();
+};
+
+IoUring::IoUring(unsigned entries) :
+        fd_(-1), sq_entries_(0),
+        sq_ring_(MAP_FAILED), sq_ring_size_(0),
+        cq_ring_(MAP_FAILED), cq_ring_size_(0),
+        sqes_((io_uring_sqe*)MAP_FAILED), sqes_size_(0)
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  if(fd_ < 0)
+    return;
+
+  // Make sure the kernel knows the operations we need (5.6 and later)
+  const unsigned num_ops = 256;
+  std::vector<char> probe_buf(sizeof(io_uring_probe) + num_ops * sizeof(io_uring_probe_op));
+  io_uring_probe* probe = (io_uring_probe*)&probe_buf[0];
+  if(syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, num_ops) < 0 ||
+     probe->last_op < IORING_OP_OPENAT || probe->last_op < IORING_OP_STATX ||
+     !(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) ||
+     !(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED))
+  {
+    shutdown();
+    return;
+  }
+
+  sq_entries_ = params.sq_entries;
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if(sq_ring_ == MAP_FAILED)
+  {
+    shutdown();
+    return;
+  }
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+    cq_ring_ = sq_ring_;
+  else
+  {
+    cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if(cq_ring_ == MAP_FAILED)
+    {
+      shutdown();
+      return;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = (io_uring_sqe*)mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+  if(sqes_ == MAP_FAILED)
+  {
+    shutdown();
+    return;
+  }
+
+  char* sq = (char*)sq_ring_;
+  sq_tail_ = (unsigned*)(sq + params.sq_off.tail);
+  sq_mask_ = *(unsigned*)(sq + params.sq_off.ring_mask);
+  sq_array_ = (unsigned*)(sq + params.sq_off.array);
+  char* cq = (char*)cq_ring_;
+  cq_head_ = (unsigned*)(cq + params.cq_off.head);
+  cq_tail_ = (unsigned*)(cq + params.cq_off.tail);
+  cq_mask_ = *(unsigned*)(cq + params.cq_off.ring_mask);
+  cqes_ = (io_uring_cqe*)(cq + params.cq_off.cqes);
+}
+
+IoUring::~IoUring()
+{
+  shutdown();
+}
+
+void
+IoUring::shutdown()
+{
+  if(sqes_ != MAP_FAILED)
+    munmap(sqes_, sqes_size_);
+  if(cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+  if(sq_ring_ != MAP_FAILED)
+    munmap(sq_ring_, sq_ring_size_);
+  sqes_ = (io_uring_sqe*)MAP_FAILED;
+  cq_ring_ = sq_ring_ = MAP_FAILED;
+  if(fd_ >= 0)
+    close(fd_);
+  fd_ = -1;
+}
+
+io_uring_sqe*
+IoUring::entry(unsigned i)
+{
+  unsigned index = (*sq_tail_ + i) & sq_mask_;
+  io_uring_sqe* sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+bool
+IoUring::run(unsigned n, std::vector<int>& results)
+{
+  // We're the only producer, so nobody else moves the tail
+  unsigned tail = *sq_tail_;
+  for(unsigned i = 0; i < n; i++)
+    sq_array_[(tail + i) & sq_mask_] = (tail + i) & sq_mask_;
+  __atomic_store_n(sq_tail_, tail + n, __ATOMIC_RELEASE);
+
+  unsigned submitted = 0;
+  unsigned completed = 0;
+  while(completed < n)
+  {
+    int ret = syscall(__NR_io_uring_enter, fd_, n - submitted, n - completed,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    if(ret < 0)
+    {
+      if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      {
+        shutdown();
+        return false;
+      }
+    }
+    else
+      submitted += ret;
+
+    unsigned head = *cq_head_;
+    unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for(; head != cq_tail; head++)
+    {
+      const io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+      results[cqe->user_data] = cqe->res;
+      completed++;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+
+static const unsigned IO_URING_ENTRIES = 64;
+static boost::thread_specific_ptr<IoUring> thread_ring;
+
+// This thread's ring, or NULL if io_uring can't (or shouldn't) be used
+static IoUring*
+threadRing()
+{
+  if(!thread_ring.get())
+  {
+    const char* enabled = getenv("ROS_CRAWL_IO_URING");
+    if(enabled && !strcmp(enabled, "0"))
+      thread_ring.reset(new IoUring(0));
+    else
+      thread_ring.reset(new IoUring(IO_URING_ENTRIES));
+  }
+  return thread_ring->ok() ? thread_ring.get() : NULL;
+}
+
+// Queue an openat (while the budget for directories opened ahead of time
+// lasts) or, failing that, a statx for each subdirectory whose type isn't
+// known, and push them through the ring a batch at a time.  is_dir is set
+// to 1 or -1 for the entries that were settled.
+static void
+probeSubdirs(const DirectoryHandlePtr& handle,
+             DirectoryListing& listing,
+             std::vector<int>& is_dir)
+{
+  IoUring* ring = threadRing();
+  if(!ring)
+    return;
+
+  std::vector<size_t> probes;
+  std::vector<bool> opening;
+  for(size_t i = 0; i < listing.subdirs_.size(); i++)
+  {
+    if(acquirePreopenSlot())
+    {
+      probes.push_back(i);
+      opening.push_back(true);
+    }
+    else if(is_dir[i] == 0)
+    {
+      probes.push_back(i);
+      opening.push_back(false);
+    }
+  }
+
+  std::vector<struct statx> stats(ring->capacity());
+  std::vector<int> results(ring->capacity());
+  size_t start = 0;
+  for(; start < probes.size(); start += ring->capacity())
+  {
+    unsigned n = std::min((size_t)ring->capacity(), probes.size() - start);
+    for(unsigned k = 0; k < n; k++)
+    {
+      io_uring_sqe* sqe = ring->entry(k);
+      const std::string& name = listing.subdirs_[probes[start + k]];
+      sqe->fd = handle->fd();
+      sqe->addr = (uintptr_t)name.c_str();
+      sqe->user_data = k;
+      if(opening[start + k])
+      {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->open_flags = DIRECTORY_OPEN_FLAGS;
+      }
+      else
+      {
+        sqe->opcode = IORING_OP_STATX;
+        sqe->len = STATX_TYPE;
+        sqe->off = (uintptr_t)&stats[k];
+      }
+    }
+    if(!ring->run(n, results))
+      break;
+
+    for(unsigned k = 0; k < n; k++)
+    {
+      size_t i = probes[start + k];
+      int res = results[k];
+      if(opening[start + k] && res >= 0)
+      {
+        listing.handles_[i].reset(new DirectoryHandle(res, true));
+        is_dir[i] = 1;
+        continue;
+      }
+      if(opening[start + k])
+        releasePreopenSlot();
+      if(!opening[start + k] && res == 0)
+        is_dir[i] = S_ISDIR(stats[k].stx_mode) ? 1 : -1;
+      else if(res == -ENOTDIR || res == -ENOENT || res == -ELOOP)
+        is_dir[i] = -1;
+      // Anything else is left to the synchronous probe
+    }
+  }
+
+  // The ring broke down; give back the slots we didn't get to use
+  for(; start < probes.size(); start++)
+  {
+    if(opening[start])
+      releasePreopenSlot();
+  }
+}
+
+// Stamp files [first, last) with batches of statx calls, as far as the
+// ring allows; done[i - first] is set for the files that were settled
+// either way.
+static void
+statxFiles(const std::vector<std::string>& paths,
+           size_t first,
+           size_t last,
+           std::vector<FileStamp>& stamps,
+           std::vector<char>& ok,
+           std::vector<char>& done)
+{
+  IoUring* ring = threadRing();
+  if(!ring)
+    return;
+
+  const unsigned mask = STATX_INO | STATX_MTIME | STATX_SIZE;
+  std::vector<struct statx> stats(ring->capacity());
+  std::vector<int> results(ring->capacity());
+  for(size_t start = first; start < last; start += ring->capacity())
+  {
+    unsigned n = std::min((size_t)ring->capacity(), last - start);
+    for(unsigned k = 0; k < n; k++)
+    {
+      io_uring_sqe* sqe = ring->entry(k);
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t)paths[start + k].c_str();
+      sqe->len = mask;
+      sqe->off = (uintptr_t)&stats[k];
+      sqe->user_data = k;
+    }
+    if(!ring->run(n, results))
+      return;
+
+    for(unsigned k = 0; k < n; k++)
+    {
+      size_t i = start + k;
+      if(results[k] == 0 && (stats[k].stx_mask & mask) == mask)
+      {
+        stamps[i].ino_ = stats[k].stx_ino;
+        stamps[i].mtime_sec_ = stats[k].stx_mtime.tv_sec;
+        stamps[i].mtime_nsec_ = stats[k].stx_mtime.tv_nsec;
+        stamps[i].size_ = stats[k].stx_size;
+        ok[i] = true;
+        done[i - first] = true;
+      }
+      else if(results[k] == -ENOENT || results[k] == -ENOTDIR)
+        done[i - first] = true;
+      // Anything else is left to stat()
+    }
+  }
+}
+
+#endif
+
+void
+resolveSubdirs(const std::string& path,
+               const DirectoryHandlePtr& handle,
+               DirectoryListing& listing,
+               std::vector<std::string>&)
+{
+  // 1: a directory, -1: not one, 0: not known yet
+  std::vector<int> is_dir(listing.subdirs_.size());
+  for(size_t i = 0; i < listing.subdirs_.size(); i++)
+    is_dir[i] = listing.unresolved_[i] ? 0 : 1;
+  listing.handles_.assign(listing.subdirs_.size(), DirectoryHandlePtr());
+
+#if defined(ROSPACK_USE_IO_URING)
+  if(handle)
+    probeSubdirs(handle, listing, is_dir);
+#endif
+
+  size_t kept = 0;
+  for(size_t i = 0; i < listing.subdirs_.size(); i++)
+  {
+    if(is_dir[i] == 0)
+    {
+      struct stat s;
+      int ret;
+      if(handle)
+        ret = fstatat(handle->fd(), listing.subdirs_[i].c_str(), &s, 0);
+      else
+        ret = stat(joinPath(path, listing.subdirs_[i]).c_str(), &s);
+      // Dangling links are ignored, like anything else that isn't a
+      // directory
+      is_dir[i] = (ret == 0 && S_ISDIR(s.st_mode)) ? 1 : -1;
+    }
+    if(is_dir[i] < 0)
+      continue;
+    if(kept != i)
+    {
+      listing.subdirs_[kept].swap(listing.subdirs_[i]);
+      listing.handles_[kept].swap(listing.handles_[i]);
+    }
+    kept++;
+  }
+  listing.subdirs_.resize(kept);
+  listing.handles_.resize(kept);
+  listing.unresolved_.assign(kept, false);
+}
+
+#else
+
+bool
+listDirectory(const std::string& path,
+              const DirectoryHandlePtr& parent,
+              const std::string& name,
+              const DirectoryHandlePtr& preopened,
+              bool stamp,
+              DirectoryListing& listing,
+              DirectoryHandlePtr& handle,
+              std::vector<std::string>& warnings)
+{
+  try
+  {
+    if(!fs::is_directory(path))
+      return false;
+  }
+  catch(fs::filesystem_error& e)
+  {
+    warnings.push_back(std::string("error while looking at ") + path + ": " + e.what());
+    return false;
+  }
+
+  try
+  {
+    for(fs::directory_iterator dit = fs::directory_iterator(path);
+        dit != fs::directory_iterator();
+        ++dit)
+    {
+#if !defined(BOOST_FILESYSTEM_VERSION) || (BOOST_FILESYSTEM_VERSION == 2)
+      std::string ent_name = dit->path().filename();
+#else
+      // in boostfs3, filename() returns a path, which needs to be stringified
+      std::string ent_name = dit->path().filename().string();
+#endif
+      // Ignore directories starting with '.'
+      if(ent_name.size() == 0 || ent_name[0] == '.')
+        continue;
+
+      int flag = markerFlag(ent_name.c_str());
+      if(flag && fs::is_regular_file(dit->path()))
+        listing.flags_ |= flag;
+      else
+      {
+        listing.subdirs_.push_back(ent_name);
+        listing.unresolved_.push_back(true);
+      }
+    }
+  }
+  catch(fs::filesystem_error& e)
+  {
+    // suppress logging of error message if reading of directory failed
+    // due to missing permission
+    if(e.code().value() != EACCES)
+      warnings.push_back(std::string("error while crawling ") + path + ": " + e.what());
+  }
+  return true;
+}
+
+void
+resolveSubdirs(const std::string& path,
+               const DirectoryHandlePtr& handle,
+               DirectoryListing& listing,
+               std::vector<std::string>& warnings)
+{
+  size_t kept = 0;
+  for(size_t i = 0; i < listing.subdirs_.size(); i++)
+  {
+    try
+    {
+      if(listing.unresolved_[i] &&
+         !fs::is_directory(fs::path(path) / listing.subdirs_[i]))
+        continue;
+    }
+    catch(fs::filesystem_error& e)
+    {
+      warnings.push_back(std::string("error while crawling ") + path + ": " + e.what());
+      continue;
+    }
+    if(kept != i)
+      listing.subdirs_[kept].swap(listing.subdirs_[i]);
+    kept++;
+  }
+  listing.subdirs_.resize(kept);
+  listing.unresolved_.assign(kept, false);
+  listing.handles_.assign(kept, DirectoryHandlePtr());
+}
+
+#endif
+
+void
+releaseIoRing()
+{
+#if defined(ROSPACK_USE_IO_URING)
+  thread_ring.reset();
+#endif
+}
+
+// How many files each work item of stampFiles() covers
+static const size_t STAMP_BATCH_SIZE = 64;
+
+class FileStamper
+{
+  public:
+    FileStamper(const std::vector<std::string>& paths,
+                std::vector<FileStamp>& stamps,
+                std::vector<char>& ok) :
+            paths_(paths),
+            stamps_(stamps),
+            ok_(ok) {}
+    void operator()(const size_t& first,
+                    WorkQueue<size_t>&,
+                    size_t) const
+    {
+      size_t last = std::min(first + STAMP_BATCH_SIZE, paths_.size());
+      std::vector<char> done(last - first);
+#if defined(ROSPACK_USE_IO_URING)
+      statxFiles(paths_, first, last, stamps_, ok_, done);
+#endif
+      for(size_t i = first; i < last; i++)
+      {
+        if(!done[i - first])
+          ok_[i] = stampFile(paths_[i], stamps_[i]);
+      }
+    }
+  private:
+    const std::vector<std::string>& paths_;
+    std::vector<FileStamp>& stamps_;
+    std::vector<char>& ok_;
+};
+
+void
+stampFiles(const std::vector<std::string>& paths,
+           size_t num_threads,
+           std::vector<FileStamp>& stamps,
+           std::vector<char>& ok)
+{
+  stamps.assign(paths.size(), FileStamp());
+  ok.assign(paths.size(), false);
+  std::vector<size_t> batches;
+  for(size_t first = 0; first < paths.size(); first += STAMP_BATCH_SIZE)
+    batches.push_back(first);
+  num_threads = std::max((size_t)1, std::min(num_threads, batches.size()));
+  WorkQueue<size_t> queue(num_threads, FileStamper(paths, stamps, ok));
+  queue.run(batches);
+}
+
+const DirectoryIndex::Entry*
+DirectoryIndex::find(const std::string& path) const
+{
+  boost::unordered_map<std::string, Entry>::const_iterator it = entries_.find(path);
+  if(it == entries_.end())
+    return NULL;
+  return &it->second;
+}
+
+bool
+DirectoryIndex::unchanged(size_t num_threads) const
+{
+  std::vector<std::string> paths;
+  paths.reserve(entries_.size());
+  for(boost::unordered_map<std::string, Entry>::const_iterator it = entries_.begin();
+      it != entries_.end();
+      ++it)
+    paths.push_back(it->first);
+  std::vector<FileStamp> stamps;
+  std::vector<char> ok;
+  stampFiles(paths, num_threads, stamps, ok);
+  for(size_t i = 0; i < paths.size(); i++)
+  {
+    if(!ok[i] || stamps[i] != find(paths[i])->stamp_)
+      return false;
+  }
+  return true;
+}
+
+void
+DirectoryIndex::load(const std::string& filename)
+{
+  entries_.clear();
+  complete_ = false;
+  FILE* file = fopen(filename.c_str(), "r");
+  if(!file)
+    return;
+
+  char linebuf[30000];
+  bool ok = fgets(linebuf, sizeof(linebuf), file) &&
+          !strncmp(linebuf, DIRECTORY_INDEX_VERSION, strlen(DIRECTORY_INDEX_VERSION));
+  Entry* entry = NULL;
+  while(ok && fgets(linebuf, sizeof(linebuf), file))
+  {
+    char* newline_pos = strchr(linebuf, '\n');
+    if(!newline_pos)
+    {
+      ok = false;
+      break;
+    }
+    *newline_pos = 0;
+    if(!strncmp(linebuf, "D ", 2))
+    {
+      unsigned long long ino, size;
+      long long sec, nsec;
+      int flags, path_pos;
+      if(sscanf(linebuf + 2, "%llu %lld %lld %llu %d %n",
+                &ino, &sec, &nsec, &size, &flags, &path_pos) != 5)
+      {
+        ok = false;
+        break;
+      }
+      entry = &entries_[linebuf + 2 + path_pos];
+      entry->stamp_.ino_ = ino;
+      entry->stamp_.mtime_sec_ = sec;
+      entry->stamp_.mtime_nsec_ = nsec;
+      entry->stamp_.size_ = size;
+      entry->flags_ = flags;
+    }
+    else if(!strncmp(linebuf, "S ", 2) && entry)
+      entry->subdirs_.push_back(linebuf + 2);
+    else if(!strcmp(linebuf, "C"))
+      complete_ = true;
+    else
+      ok = false;
+  }
+  fclose(file);
+  // Better to crawl everything than to trust a damaged index
+  if(!ok)
+  {
+    entries_.clear();
+    complete_ = false;
+  }
+}
+
+bool
+DirectoryIndex::save(const std::string& filename) const
+{
+  std::string tmp_filename;
+  FILE* file = create_replacement_file(filename, tmp_filename);
+  if(!file)
+    return false;
+
+  fprintf(file, "%s\n", DIRECTORY_INDEX_VERSION);
+  bool complete = complete_;
+  for(boost::unordered_map<std::string, Entry>::const_iterator it = entries_.begin();
+      it != entries_.end();
+      ++it)
+  {
+    // Names with newlines in them can't be written; leave them out, and
+    // their directories will be read again next time.
+    bool writable = it->first.find('\n') == std::string::npos;
+    for(std::vector<std::string>::const_iterator sit = it->second.subdirs_.begin();
+        writable && sit != it->second.subdirs_.end();
+        ++sit)
+      writable = sit->find('\n') == std::string::npos;
+    if(!writable)
+    {
+      complete = false;
+      continue;
+    }
+
+    const FileStamp& stamp = it->second.stamp_;
+    fprintf(file, "D %llu %lld %lld %llu %d %s\n",
+            (unsigned long long)stamp.ino_, (long long)stamp.mtime_sec_,
+            (long long)stamp.mtime_nsec_, (unsigned long long)stamp.size_,
+            it->second.flags_, it->first.c_str());
+    for(std::vector<std::string>::const_iterator sit = it->second.subdirs_.begin();
+        sit != it->second.subdirs_.end();
+        ++sit)
+      fprintf(file, "S %s\n", sit->c_str());
+  }
+  if(complete)
+    fprintf(file, "C\n");
+
+  return replace_file(file, tmp_filename, filename);
+}
+
+}
@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ROSPACK_CRAWL_H
+#define ROSPACK_CRAWL_H
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <string>
+#include <vector>
+
+namespace rospack
+{
+
+/**
+ * @brief What we remember about a file or directory, to tell later on
+ * whether it has changed.
+ */
+class FileStamp
+{
+  public:
+    boost::uint64_t ino_;
+    boost::int64_t mtime_sec_;
+    boost::int64_t mtime_nsec_;
+    boost::uint64_t size_;
+
+    FileStamp() : ino_(0), mtime_sec_(0), mtime_nsec_(0), size_(0) {}
+    bool operator==(const FileStamp& other) const
+    {
+      return ino_ == other.ino_ && mtime_sec_ == other.mtime_sec_ &&
+              mtime_nsec_ == other.mtime_nsec_ && size_ == other.size_;
+    }
+    bool operator!=(const FileStamp& other) const { return !(*this == other); }
+    /**
+     * @brief Was the file last modified long enough before now that any
+     * later change is sure to show up in its mtime, even on filesystems
+     * with coarse timestamps?
+     */
+    bool settled(double now) const;
+};
+
+/**
+ * @brief Stamp a file (following symlinks).
+ * @return False if it can't be stat'd.
+ */
+bool stampFile(const std::string& path, FileStamp& stamp);
+
+/**
+ * @brief Stamp many files (following symlinks), spread over num_threads
+ * threads and, when built with USE_IO_URING, batched through io_uring.
+ * ok[i] says whether paths[i] could be stat'd.
+ */
+void stampFiles(const std::vector<std::string>& paths,
+                size_t num_threads,
+                std::vector<FileStamp>& stamps,
+                std::vector<char>& ok);
+
+/**
+ * @brief Let go of the calling thread's io_uring, if it has one, so that
+ * the next crawl on it sets up a new one.  A forked child mustn't go on
+ * using the ring it shares with its parent.
+ */
+void releaseIoRing();
+
+/**
+ * @brief An open directory.  Children that are still waiting to be listed
+ * hold on to their parent's handle, so that they can be opened relative to
+ * it instead of by absolute path.  The descriptor is closed when the last
+ * of them lets go.
+ */
+class DirectoryHandle
+{
+  public:
+    // A budgeted handle was opened ahead of time for a directory that
+    // hasn't been listed yet, and counts against a limit on how many of
+    // those may be open at once.
+    explicit DirectoryHandle(int fd, bool budgeted = false) :
+            fd_(fd), budgeted_(budgeted) {}
+    ~DirectoryHandle();
+    int fd() const { return fd_; }
+    // The directory is being listed; stop counting it against the budget
+    void unbudget();
+  private:
+    int fd_;
+    bool budgeted_;
+    DirectoryHandle(const DirectoryHandle&);
+    DirectoryHandle& operator=(const DirectoryHandle&);
+};
+typedef boost::shared_ptr<DirectoryHandle> DirectoryHandlePtr;
+
+/**
+ * @brief Everything the crawler needs to know about one directory, read
+ * from a single pass over its entries.
+ */
+class DirectoryListing
+{
+  public:
+    // Regular files (or links to them) that steer the crawl
+    enum
+    {
+      CATKIN_IGNORE_FILE = 1 << 0,
+      NOSUBDIRS_FILE = 1 << 1,
+      ROSPACK_MANIFEST_FILE = 1 << 2,
+      ROSSTACK_MANIFEST_FILE = 1 << 3,
+      PACKAGE_MANIFEST_FILE = 1 << 4
+    };
+    int flags_;
+    // Subdirectories not starting with '.', in the order the filesystem
+    // returned them.  Entries whose type isn't known yet (symlinks, or
+    // filesystems that don't fill in d_type) are kept in place and marked
+    // in unresolved_ until resolveSubdirs() is called.
+    std::vector<std::string> subdirs_;
+    std::vector<bool> unresolved_;
+    // After resolveSubdirs(), the subdirectories that were opened ahead of
+    // time have their handles here (the others are null).
+    std::vector<DirectoryHandlePtr> handles_;
+    // If asked for, the directory's stamp as of just before it was read.
+    // A listing is only stable if it has a stamp and no entries whose
+    // type can change without the directory changing (i.e., symlinks).
+    FileStamp stamp_;
+    bool stable_;
+
+    DirectoryListing() : flags_(0), stable_(false) {}
+    bool has(int flag) const { return (flags_ & flag) != 0; }
+};
+
+/**
+ * @brief Read a directory.
+ * @param path Absolute (or cwd-relative) path of the directory.
+ * @param parent If non-null, an open handle to the parent directory, in
+ * which case the directory is opened as parent/name.
+ * @param name The last component of path.
+ * @param preopened If non-null, the directory itself, already open.
+ * @param stamp Fill in listing.stamp_ and listing.stable_.
+ * @param listing The directory's contents are written here.
+ * @param handle If the directory has subdirectories, a handle for them to
+ * be opened relative to is written here.
+ * @param warnings Problems worth telling the user about are appended here.
+ * @return False if path is not a readable directory.
+ */
+bool listDirectory(const std::string& path,
+                   const DirectoryHandlePtr& parent,
+                   const std::string& name,
+                   const DirectoryHandlePtr& preopened,
+                   bool stamp,
+                   DirectoryListing& listing,
+                   DirectoryHandlePtr& handle,
+                   std::vector<std::string>& warnings);
+
+/**
+ * @brief Find out which of the listing's unresolved entries are
+ * directories, dropping the others.  Where io_uring is available, the
+ * probes for the whole directory are queued at once, and subdirectories
+ * are opened ahead of time along the way.
+ */
+void resolveSubdirs(const std::string& path,
+                    const DirectoryHandlePtr& handle,
+                    DirectoryListing& listing,
+                    std::vector<std::string>& warnings);
+
+/**
+ * @brief Stamp a directory, relative to its parent's handle if there is
+ * one.
+ * @return False if it's not a directory we can stat.
+ */
+bool stampDirectory(const std::string& path,
+                    const DirectoryHandlePtr& parent,
+                    const std::string& name,
+                    FileStamp& stamp);
+
+/**
+ * @brief The directories seen by the last crawl, with enough of their
+ * listings to crawl them again without reading them, as long as their
+ * stamps haven't changed.  Adding or removing an entry changes a
+ * directory's mtime, so an unchanged stamp means an unchanged listing.
+ */
+class DirectoryIndex
+{
+  public:
+    class Entry
+    {
+      public:
+        FileStamp stamp_;
+        // DirectoryListing flags
+        int flags_;
+        // The subdirectories, if the crawl descended into them
+        std::vector<std::string> subdirs_;
+        Entry() : flags_(0) {}
+    };
+
+    DirectoryIndex() : complete_(false) {}
+    const Entry* find(const std::string& path) const;
+    Entry& add(const std::string& path) { return entries_[path]; }
+    // \brief add the entries of another index (for other directories)
+    void insert(const DirectoryIndex& other)
+    {
+      entries_.insert(other.entries_.begin(), other.entries_.end());
+    }
+    size_t size() const { return entries_.size(); }
+    /**
+     * @brief Does the index hold every directory that its crawl read, so
+     * that as long as none of them has changed, a crawl would find the
+     * same stackages?
+     */
+    bool complete() const { return complete_; }
+    void setComplete(bool complete) { complete_ = complete; }
+    /**
+     * @brief Do all of the directories still have the stamps recorded for
+     * them?  They're stat'd on up to num_threads threads.
+     */
+    bool unchanged(size_t num_threads) const;
+    /**
+     * @brief Read the index from a file.  A missing or unreadable file
+     * gives an empty index.
+     */
+    void load(const std::string& filename);
+    /**
+     * @brief Replace the file with this index.
+     * @return False if that couldn't be done.
+     */
+    bool save(const std::string& filename) const;
+
+  private:
+    boost::unordered_map<std::string, Entry> entries_;
+    bool complete_;
+};
+
+}
+
+#endif
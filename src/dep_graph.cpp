@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "dep_graph.h"
+
+#include <algorithm>
+#include <assert.h>
+
+namespace rospack
+{
+
+DependencyGraph::DependencyGraph() :
+        next_mark_(0),
+        reverse_valid_(false),
+        components_valid_(false),
+        closure_nodes_(0),
+        closure_words_(0)
+{
+}
+
+void
+DependencyGraph::clear()
+{
+  nodes_.clear();
+  begun_.clear();
+  row_begin_.clear();
+  row_end_.clear();
+  edges_.clear();
+  open_.clear();
+  pending_.clear();
+  marks_.clear();
+  next_mark_ = 0;
+  reverse_valid_ = false;
+  reverse_offsets_.clear();
+  reverse_edges_.clear();
+  components_valid_ = false;
+  longest_paths_.clear();
+  component_nodes_.clear();
+  component_offsets_.clear();
+  closure_nodes_ = 0;
+  closure_words_ = 0;
+  closure_.clear();
+}
+
+int
+DependencyGraph::addNode(Stackage* stackage)
+{
+  nodes_.push_back(stackage);
+  begun_.push_back(0);
+  row_begin_.push_back(0);
+  row_end_.push_back(0);
+  marks_.push_back(0);
+  reverse_valid_ = false;
+  components_valid_ = false;
+  return (int)nodes_.size() - 1;
+}
+
+void
+DependencyGraph::beginEdges(int id)
+{
+  begun_[id] = 1;
+  OpenRow row;
+  row.id_ = id;
+  row.base_ = pending_.size();
+  // Each node's row is begun at most once, so marks can't run out; 0 is
+  // never handed out, so that unmarked targets never match
+  row.mark_ = ++next_mark_;
+  open_.push_back(row);
+}
+
+bool
+DependencyGraph::addEdge(int to)
+{
+  assert(!open_.empty());
+  unsigned mark = open_.back().mark_;
+  if(marks_[to] == mark)
+    return false;
+  pending_.push_back(std::make_pair(to, marks_[to]));
+  marks_[to] = mark;
+  return true;
+}
+
+void
+DependencyGraph::endEdges()
+{
+  assert(!open_.empty());
+  const OpenRow& row = open_.back();
+  // The closure can be extended to cover new nodes, but a node that it
+  // already covers getting its row changes what reaches what
+  if((size_t)row.id_ < closure_nodes_)
+    closure_nodes_ = 0;
+  row_begin_[row.id_] = edges_.size();
+  for(size_t i = row.base_; i < pending_.size(); i++)
+    edges_.push_back(pending_[i].first);
+  row_end_[row.id_] = edges_.size();
+  // Put the marks back in the reverse order they were taken
+  for(size_t i = pending_.size(); i > row.base_; i--)
+    marks_[pending_[i-1].first] = pending_[i-1].second;
+  pending_.resize(row.base_);
+  open_.pop_back();
+  reverse_valid_ = false;
+  components_valid_ = false;
+}
+
+size_t
+DependencyGraph::reverseBegin(int id)
+{
+  if(!reverse_valid_)
+    buildReverse();
+  return reverse_offsets_[id];
+}
+
+size_t
+DependencyGraph::reverseEnd(int id)
+{
+  if(!reverse_valid_)
+    buildReverse();
+  return reverse_offsets_[id + 1];
+}
+
+void
+DependencyGraph::buildReverse()
+{
+  // Counting sort of the forward edges by target; walking the sources in
+  // ID order leaves each reverse row sorted
+  size_t num_nodes = nodes_.size();
+  reverse_offsets_.assign(num_nodes + 1, 0);
+  for(size_t i = 0; i < edges_.size(); i++)
+    reverse_offsets_[edges_[i] + 1]++;
+  for(size_t i = 0; i < num_nodes; i++)
+    reverse_offsets_[i + 1] += reverse_offsets_[i];
+  reverse_edges_.resize(edges_.size());
+  std::vector<size_t> fill(reverse_offsets_.begin(), reverse_offsets_.end() - 1);
+  for(size_t from = 0; from < num_nodes; from++)
+  {
+    for(size_t i = row_begin_[from]; i < row_end_[from]; i++)
+      reverse_edges_[fill[edges_[i]]++] = (int)from;
+  }
+  reverse_valid_ = true;
+}
+
+int
+DependencyGraph::longestPath(int id)
+{
+  if(!components_valid_)
+    findComponents();
+  return longest_paths_[id];
+}
+
+void
+DependencyGraph::findComponents()
+{
+  // Tarjan's algorithm, with an explicit stack so that deep graphs can't
+  // overflow ours.  Components are completed in reverse topological order,
+  // so by the time one is, the longest paths from every component it has
+  // edges to are known.  A component with an edge inside it is a cycle.
+  size_t num_nodes = nodes_.size();
+  std::vector<int> index(num_nodes, -1);
+  std::vector<int> lowlink(num_nodes, 0);
+  std::vector<int> component(num_nodes, -1);
+  std::vector<int> members;
+  std::vector<std::pair<int, size_t> > stack;
+  int next_index = 0;
+  int num_components = 0;
+  longest_paths_.assign(num_nodes, 0);
+  component_nodes_.clear();
+  component_offsets_.assign(1, 0);
+  for(size_t root = 0; root < num_nodes; root++)
+  {
+    if(index[root] >= 0)
+      continue;
+    stack.push_back(std::make_pair((int)root, row_begin_[root]));
+    index[root] = lowlink[root] = next_index++;
+    members.push_back((int)root);
+    while(!stack.empty())
+    {
+      int id = stack.back().first;
+      size_t& next = stack.back().second;
+      if(next < row_end_[id])
+      {
+        int to = edges_[next++];
+        if(index[to] < 0)
+        {
+          stack.push_back(std::make_pair(to, row_begin_[to]));
+          index[to] = lowlink[to] = next_index++;
+          members.push_back(to);
+        }
+        else if(component[to] < 0 && index[to] < lowlink[id])
+          lowlink[id] = index[to];
+        continue;
+      }
+      stack.pop_back();
+      if(!stack.empty() && lowlink[id] < lowlink[stack.back().first])
+        lowlink[stack.back().first] = lowlink[id];
+      if(lowlink[id] != index[id])
+        continue;
+
+      // id is the first node of a component, whose members are id and
+      // everything above it in members
+      size_t first = members.size();
+      do
+        component[members[--first]] = num_components;
+      while(members[first] != id);
+      bool cyclic = false;
+      bool cycle_below = false;
+      int length = 0;
+      for(size_t m = first; m < members.size(); m++)
+      {
+        int from = members[m];
+        for(size_t i = row_begin_[from]; i < row_end_[from]; i++)
+        {
+          int to = edges_[i];
+          if(component[to] == num_components)
+            cyclic = true;
+          else if(longest_paths_[to] < 0)
+            cycle_below = true;
+          else if(longest_paths_[to] + 1 > length)
+            length = longest_paths_[to] + 1;
+        }
+      }
+      if(cyclic || cycle_below)
+        length = -1;
+      for(size_t m = first; m < members.size(); m++)
+      {
+        longest_paths_[members[m]] = length;
+        component_nodes_.push_back(members[m]);
+      }
+      component_offsets_.push_back(component_nodes_.size());
+      members.resize(first);
+      num_components++;
+    }
+  }
+  components_valid_ = true;
+}
+
+bool
+DependencyGraph::buildClosure()
+{
+  size_t num_nodes = nodes_.size();
+  if(num_nodes > MAX_CLOSURE_NODES)
+    return false;
+  if(closure_nodes_ == num_nodes)
+    return true;
+  if(!components_valid_)
+    findComponents();
+
+  // Make room for the new nodes, with some to spare in each row so that a
+  // graph that grows a little with each query isn't laid out again each
+  // time
+  size_t words = (num_nodes + 63) / 64;
+  if(words > closure_words_)
+  {
+    size_t new_words = std::min(std::max(words, 2 * closure_words_),
+                                (MAX_CLOSURE_NODES + 63) / 64);
+    std::vector<boost::uint64_t> closure(num_nodes * new_words, 0);
+    for(size_t n = 0; n < closure_nodes_; n++)
+      std::copy(closure_.begin() + n * closure_words_,
+                closure_.begin() + (n + 1) * closure_words_,
+                closure.begin() + n * new_words);
+    closure_.swap(closure);
+    closure_words_ = new_words;
+  }
+  else
+    closure_.resize(num_nodes * closure_words_, 0);
+
+  // Components come in reverse topological order, so the closures of
+  // everything a component has edges to, outside itself, are done by the
+  // time it's reached.  All of a component's members reach the same nodes:
+  // if there's more than one, each has an edge from another, so they all
+  // reach each other.  Nodes that the closure already covers have no edges
+  // to new ones, so a component is either all covered or all new.
+  std::vector<boost::uint64_t> bits(closure_words_);
+  for(size_t c = 0; c + 1 < component_offsets_.size(); c++)
+  {
+    size_t begin = component_offsets_[c];
+    size_t end = component_offsets_[c + 1];
+    if((size_t)component_nodes_[begin] < closure_nodes_)
+      continue;
+    std::fill(bits.begin(), bits.end(), 0);
+    for(size_t m = begin; m < end; m++)
+    {
+      int from = component_nodes_[m];
+      for(size_t i = row_begin_[from]; i < row_end_[from]; i++)
+      {
+        int to = edges_[i];
+        bits[to / 64] |= (boost::uint64_t)1 << (to % 64);
+        const boost::uint64_t* to_bits = &closure_[to * closure_words_];
+        for(size_t w = 0; w < closure_words_; w++)
+          bits[w] |= to_bits[w];
+      }
+    }
+    for(size_t m = begin; m < end; m++)
+      std::copy(bits.begin(), bits.end(),
+                closure_.begin() + component_nodes_[m] * closure_words_);
+  }
+  closure_nodes_ = num_nodes;
+  return true;
+}
+
+} // namespace rospack
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ROSPACK_DEP_GRAPH_H
+#define ROSPACK_DEP_GRAPH_H
+
+#include <boost/cstdint.hpp>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace rospack
+{
+
+class Stackage;
+
+/**
+ * @brief The dependency graph between stackages, with each stackage
+ * numbered densely from 0 and edges kept in compressed sparse row form:
+ * one flat array of target IDs, with each node's targets stored
+ * contiguously in manifest order.
+ *
+ * Dependencies are computed lazily, and computing a node's dependencies
+ * computes its dependencies' first, so rows are recorded between
+ * beginEdges() and endEdges(), which nest.  A row is appended to the edge
+ * array once it is complete.  The reverse edges and the strongly connected
+ * components that say where the cycles are are derived from the forward
+ * edges the first time they are asked for after a change.  So is the
+ * transitive closure, which is only extended to cover the nodes that have
+ * been added since it was last built, unless one of the nodes it already
+ * covered has had its row recorded since.
+ */
+class DependencyGraph
+{
+  public:
+    DependencyGraph();
+
+    /**
+     * @brief Forget all nodes and edges.
+     */
+    void clear();
+    size_t size() const { return nodes_.size(); }
+    /**
+     * @brief Number a new node.
+     * @return The node's ID.
+     */
+    int addNode(Stackage* stackage);
+    Stackage* node(int id) const { return nodes_[id]; }
+
+    /**
+     * @brief Has the node's row been begun (and so is either complete or
+     * being recorded)?
+     */
+    bool hasEdges(int id) const { return begun_[id] != 0; }
+    /**
+     * @brief Start recording the node's row, on top of any rows still being
+     * recorded.
+     */
+    void beginEdges(int id);
+    /**
+     * @brief Add an edge to the innermost row being recorded.
+     * @return False if the row already has that edge.
+     */
+    bool addEdge(int to);
+    /**
+     * @brief Finish the innermost row being recorded.
+     */
+    void endEdges();
+    /**
+     * @brief Is any row being recorded?
+     */
+    bool recording() const { return !open_.empty(); }
+
+    // Indices into the forward edge array of the node's row
+    size_t edgesBegin(int id) const { return row_begin_[id]; }
+    size_t edgesEnd(int id) const { return row_end_[id]; }
+    int edge(size_t i) const { return edges_[i]; }
+
+    // Indices into the reverse edge array of the nodes with an edge to the
+    // node, in increasing ID order
+    size_t reverseBegin(int id);
+    size_t reverseEnd(int id);
+    int reverseEdge(size_t i) const { return reverse_edges_[i]; }
+
+    /**
+     * @brief The length, in edges, of the longest path from the node, or -1
+     * if a cycle can be reached from it.
+     */
+    int longestPath(int id);
+
+    /**
+     * @brief Build the transitive closure, if it isn't up to date already:
+     * for each node, a bitset over node IDs of everything reachable from it.
+     * It takes size()^2 bits, so it isn't built for graphs of more than
+     * MAX_CLOSURE_NODES nodes.
+     * @return True if the closure is available.
+     */
+    bool buildClosure();
+    /**
+     * @brief Can to be reached from from (by at least one edge)?  Only call
+     * when buildClosure() has returned true.
+     */
+    bool reaches(int from, int to) const
+    {
+      return (closure_[from * closure_words_ + to / 64] >> (to % 64)) & 1;
+    }
+
+    static const size_t MAX_CLOSURE_NODES = 16384;
+
+  private:
+    std::vector<Stackage*> nodes_;
+    std::vector<char> begun_;
+    std::vector<size_t> row_begin_;
+    std::vector<size_t> row_end_;
+    std::vector<int> edges_;
+
+    // Rows being recorded: the node, where its edges start in pending_,
+    // and the mark that says a target is already in its row
+    struct OpenRow
+    {
+      int id_;
+      size_t base_;
+      unsigned mark_;
+    };
+    std::vector<OpenRow> open_;
+    // Edges of the open rows, with each target's previous mark, which is
+    // put back when the row is finished so that the enclosing row's marks
+    // are seen again
+    std::vector<std::pair<int, unsigned> > pending_;
+    std::vector<unsigned> marks_;
+    unsigned next_mark_;
+
+    bool reverse_valid_;
+    std::vector<size_t> reverse_offsets_;
+    std::vector<int> reverse_edges_;
+    void buildReverse();
+
+    bool components_valid_;
+    std::vector<int> longest_paths_;
+    // The nodes of each strongly connected component together, with the
+    // components in the order they were completed, which is reverse
+    // topological order
+    std::vector<int> component_nodes_;
+    std::vector<size_t> component_offsets_;
+    void findComponents();
+
+    // The closure covers the nodes numbered below closure_nodes_, with
+    // closure_words_ words to each node's row
+    size_t closure_nodes_;
+    size_t closure_words_;
+    std::vector<boost::uint64_t> closure_;
+};
+
+} // namespace rospack
+
+#endif
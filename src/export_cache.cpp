@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "export_cache.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace rospack
+{
+
+static const char* EXPORT_CACHE_VERSION = "#rospack export cache 1";
+
+void
+ExportCache::load(const std::string& filename, double max_age)
+{
+  filename_ = filename;
+  max_age_ = max_age;
+  entries_.clear();
+  dirty_ = false;
+  read(entries_);
+}
+
+bool
+ExportCache::fresh(const Entry& entry, time_t now) const
+{
+  double age = difftime(now, entry.time);
+  return age >= 0.0 && age < max_age_;
+}
+
+// Read a line of any length, newline included (if there is one)
+static bool
+readLine(FILE* file, std::string& line)
+{
+  line.clear();
+  char linebuf[16384];
+  while(fgets(linebuf, sizeof(linebuf), file))
+  {
+    line.append(linebuf);
+    if(line[line.size() - 1] == '\n')
+      break;
+  }
+  return !line.empty();
+}
+
+// Each line after the version holds a key, the time the expansion was
+// made and the expansion itself, separated by single spaces
+void
+ExportCache::read(Entries& entries) const
+{
+  FILE* file = fopen(filename_.c_str(), "r");
+  if(!file)
+    return;
+
+  Entries read_entries;
+  time_t now = time(NULL);
+  std::string line;
+  bool ok = readLine(file, line) &&
+          !line.compare(0, strlen(EXPORT_CACHE_VERSION), EXPORT_CACHE_VERSION);
+  while(ok && readLine(file, line))
+  {
+    size_t time_pos = line.find(' ');
+    size_t expansion_pos = time_pos == std::string::npos ?
+            std::string::npos : line.find(' ', time_pos + 1);
+    if(line[line.size() - 1] != '\n' || expansion_pos == std::string::npos)
+    {
+      ok = false;
+      break;
+    }
+    std::string time_str = line.substr(time_pos + 1, expansion_pos - time_pos - 1);
+    char* end;
+    Entry entry;
+    entry.time = (time_t)strtol(time_str.c_str(), &end, 10);
+    if(time_str.empty() || *end)
+    {
+      ok = false;
+      break;
+    }
+    entry.expansion = line.substr(expansion_pos + 1, line.size() - expansion_pos - 2);
+    if(fresh(entry, now))
+      read_entries[line.substr(0, time_pos)] = entry;
+  }
+  fclose(file);
+  if(ok)
+    entries.insert(read_entries.begin(), read_entries.end());
+}
+
+bool
+ExportCache::find(const std::string& key, std::string& expansion) const
+{
+  Entries::const_iterator it = entries_.find(key);
+  if(it == entries_.end() || !fresh(it->second, time(NULL)))
+    return false;
+  expansion = it->second.expansion;
+  return true;
+}
+
+void
+ExportCache::insert(const std::string& key, const std::string& expansion)
+{
+  Entry entry;
+  entry.time = time(NULL);
+  entry.expansion = expansion;
+  entries_[key] = entry;
+  dirty_ = true;
+}
+
+bool
+ExportCache::save()
+{
+  if(filename_.empty())
+    return false;
+
+  // Keep what other processes have found meanwhile, unless it's been
+  // found again here
+  Entries entries;
+  read(entries);
+  for(Entries::const_iterator it = entries_.begin(); it != entries_.end(); ++it)
+    entries[it->first] = it->second;
+
+  std::string tmp_filename;
+  FILE* file = create_replacement_file(filename_, tmp_filename);
+  if(!file)
+    return false;
+
+  fprintf(file, "%s\n", EXPORT_CACHE_VERSION);
+  time_t now = time(NULL);
+  for(Entries::const_iterator it = entries.begin(); it != entries.end(); ++it)
+  {
+    // An expansion with a newline in it couldn't be read back
+    if(!fresh(it->second, now) ||
+       it->second.expansion.find('\n') != std::string::npos)
+      continue;
+    fprintf(file, "%s %ld %s\n", it->first.c_str(),
+            (long)it->second.time, it->second.expansion.c_str());
+  }
+
+  if(!replace_file(file, tmp_filename, filename_))
+    return false;
+  dirty_ = false;
+  return true;
+}
+
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ROSPACK_EXPORT_CACHE_H
+#define ROSPACK_EXPORT_CACHE_H
+
+#include <boost/unordered_map.hpp>
+#include <string>
+#include <time.h>
+
+namespace rospack
+{
+
+/**
+ * @brief Expansions of the backquotes and $(...) in export strings, kept
+ * in a file so that later processes needn't run the same commands again.
+ * Each expansion is found by a key that stands for everything it was
+ * worked out from (the SHA-1 of the command, the package and the parts of
+ * the environment that may matter; see Rosstackage::expandExportString()),
+ * and is dropped once it's older than a given age.
+ */
+class ExportCache
+{
+  public:
+    ExportCache() : max_age_(0.0), dirty_(false) {}
+
+    /**
+     * @brief Read the expansions from a file, keeping those younger than
+     * max_age seconds.  A missing or unreadable file gives none.
+     */
+    void load(const std::string& filename, double max_age);
+    bool find(const std::string& key, std::string& expansion) const;
+    void insert(const std::string& key, const std::string& expansion);
+    // \brief have expansions been added since load()?
+    bool dirty() const { return dirty_; }
+    /**
+     * @brief Replace the file that load() read with these expansions,
+     * along with any that other processes have added to it since.
+     * @return False if that couldn't be done.
+     */
+    bool save();
+
+  private:
+    struct Entry
+    {
+      time_t time;
+      std::string expansion;
+    };
+    typedef boost::unordered_map<std::string, Entry> Entries;
+
+    std::string filename_;
+    double max_age_;
+    Entries entries_;
+    bool dirty_;
+
+    void read(Entries& entries) const;
+    bool fresh(const Entry& entry, time_t now) const;
+};
+
+}
+
+#endif
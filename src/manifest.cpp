@@ -0,0 +1,552 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "manifest.h"
+#include "tinyxml2.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace rospack
+{
+
+static const char* MANIFEST_TAG_EXPORT = "export";
+
+const char*
+ManifestElement::attribute(const std::string& name) const
+{
+  for(std::vector<std::pair<std::string, std::string> >::const_iterator it = attributes_.begin();
+      it != attributes_.end();
+      ++it)
+  {
+    if(it->first == name)
+      return it->second.c_str();
+  }
+  return NULL;
+}
+
+// Manifests are read straight from the file, without building a DOM, by a
+// scanner that understands the XML that manifests are written in: elements,
+// attributes, text, comments, CDATA, the five predefined entities and
+// character references, and an XML declaration up front.  It keeps the
+// same things that the DOM would have given us, as tinyxml2 (with
+// COLLAPSE_WHITESPACE) would have given them.  On anything else, including
+// anything that isn't well formed, it gives up, and the manifest is read
+// into a tinyxml2 DOM instead, so that tinyxml2 still has the last word on
+// what is a valid manifest.
+class ManifestScanner
+{
+  public:
+    ManifestScanner(const char* begin, const char* end) :
+            p_(begin), end_(end) {}
+    bool scan(std::vector<ManifestElement>& elements);
+
+  private:
+    const char* p_;
+    const char* end_;
+
+    bool startsWith(const char* prefix) const
+    {
+      size_t len = strlen(prefix);
+      return (size_t)(end_ - p_) >= len && !memcmp(p_, prefix, len);
+    }
+    void skipWhitespace();
+    bool skipPast(const char* terminator, const char** found = NULL);
+    bool scanName(std::string& name);
+    bool scanElement(ManifestElement& element,
+                     int depth,
+                     std::vector<ManifestElement>* top);
+    bool scanAttributes(ManifestElement& element, bool& empty);
+};
+
+// As tinyxml2 sees them: ASCII whitespace, and name characters that are
+// ASCII letters, digits and punctuation, or any byte of a UTF-8 sequence
+static bool
+isWhitespace(char c)
+{
+  return (unsigned char)c < 128 && isspace((unsigned char)c);
+}
+
+static bool
+isNameStartChar(char c)
+{
+  return (unsigned char)c >= 128 || isalpha((unsigned char)c) ||
+          c == ':' || c == '_';
+}
+
+static bool
+isNameChar(char c)
+{
+  return isNameStartChar(c) || isdigit((unsigned char)c) ||
+          c == '.' || c == '-';
+}
+
+static void
+appendUTF8(unsigned long c, std::string& out)
+{
+  if(c < 0x80)
+    out.push_back((char)c);
+  else if(c < 0x800)
+  {
+    out.push_back((char)(0xc0 | (c >> 6)));
+    out.push_back((char)(0x80 | (c & 0x3f)));
+  }
+  else if(c < 0x10000)
+  {
+    out.push_back((char)(0xe0 | (c >> 12)));
+    out.push_back((char)(0x80 | ((c >> 6) & 0x3f)));
+    out.push_back((char)(0x80 | (c & 0x3f)));
+  }
+  else
+  {
+    out.push_back((char)(0xf0 | (c >> 18)));
+    out.push_back((char)(0x80 | ((c >> 12) & 0x3f)));
+    out.push_back((char)(0x80 | ((c >> 6) & 0x3f)));
+    out.push_back((char)(0x80 | (c & 0x3f)));
+  }
+}
+
+// Decode the entity reference at p (just past its '&'), moving p past its
+// ';'.  Returns false for anything but a predefined entity or a valid
+// character reference.
+static bool
+decodeEntity(const char*& p, const char* end, std::string& out)
+{
+  static const struct
+  {
+    const char* name;
+    char value;
+  } entities[] =
+  {
+    {"quot;", '"'},
+    {"amp;", '&'},
+    {"apos;", '\''},
+    {"lt;", '<'},
+    {"gt;", '>'}
+  };
+  for(size_t i = 0; i < sizeof(entities) / sizeof(entities[0]); i++)
+  {
+    size_t len = strlen(entities[i].name);
+    if((size_t)(end - p) >= len && !memcmp(p, entities[i].name, len))
+    {
+      out.push_back(entities[i].value);
+      p += len;
+      return true;
+    }
+  }
+  if(p == end || *p != '#')
+    return false;
+  ++p;
+  bool hex = (p != end && *p == 'x');
+  if(hex)
+    ++p;
+  unsigned long c = 0;
+  const char* digits = p;
+  for(; p != end && *p != ';'; ++p)
+  {
+    int digit;
+    if(isdigit((unsigned char)*p))
+      digit = *p - '0';
+    else if(hex && isxdigit((unsigned char)*p))
+      digit = tolower((unsigned char)*p) - 'a' + 10;
+    else
+      return false;
+    c = c * (hex ? 16 : 10) + digit;
+    if(c > 0x10ffff)
+      return false;
+  }
+  if(p == end || p == digits || c == 0)
+    return false;
+  ++p;
+  appendUTF8(c, out);
+  return true;
+}
+
+// Decode the text or attribute value in [begin, end): line endings become
+// "\n" and, if asked for, entities are decoded and whitespace is collapsed
+// as tinyxml2 does it (the result is trimmed, and each run of whitespace
+// inside it becomes a single space).
+static bool
+decodeText(const char* begin, const char* end,
+           bool entities, bool collapse,
+           std::string& out)
+{
+  std::string decoded;
+  decoded.reserve(end - begin);
+  for(const char* p = begin; p != end; )
+  {
+    if(*p == '\r' || *p == '\n')
+    {
+      // CR LF, LF CR, and lone CRs and LFs
+      char other = (*p == '\r') ? '\n' : '\r';
+      ++p;
+      if(p != end && *p == other)
+        ++p;
+      decoded.push_back('\n');
+    }
+    else if(*p == '&' && entities)
+    {
+      ++p;
+      if(!decodeEntity(p, end, decoded))
+        return false;
+    }
+    else
+      decoded.push_back(*p++);
+  }
+  if(!collapse)
+  {
+    out.swap(decoded);
+    return true;
+  }
+
+  out.clear();
+  out.reserve(decoded.size());
+  const char* p = decoded.c_str();
+  while(isWhitespace(*p))
+    ++p;
+  while(*p)
+  {
+    if(isWhitespace(*p))
+    {
+      while(isWhitespace(*p))
+        ++p;
+      if(!*p)
+        break;
+      out.push_back(' ');
+    }
+    out.push_back(*p++);
+  }
+  return true;
+}
+
+void
+ManifestScanner::skipWhitespace()
+{
+  while(p_ != end_ && isWhitespace(*p_))
+    ++p_;
+}
+
+// Move past the next occurrence of terminator, remembering where it starts
+bool
+ManifestScanner::skipPast(const char* terminator, const char** found)
+{
+  size_t len = strlen(terminator);
+  for(const char* p = p_; (size_t)(end_ - p) >= len; ++p)
+  {
+    if(!memcmp(p, terminator, len))
+    {
+      if(found)
+        *found = p;
+      p_ = p + len;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+ManifestScanner::scanName(std::string& name)
+{
+  const char* begin = p_;
+  if(p_ == end_ || !isNameStartChar(*p_))
+    return false;
+  while(p_ != end_ && isNameChar(*p_))
+    ++p_;
+  name.assign(begin, p_);
+  return true;
+}
+
+// Read the attributes of the element whose name we've just read, and the
+// end of its start tag.  empty is set if it's an empty-element tag.
+bool
+ManifestScanner::scanAttributes(ManifestElement& element, bool& empty)
+{
+  for(;;)
+  {
+    const char* before = p_;
+    skipWhitespace();
+    if(p_ == end_)
+      return false;
+    if(*p_ == '>')
+    {
+      ++p_;
+      empty = false;
+      return true;
+    }
+    if(startsWith("/>"))
+    {
+      p_ += 2;
+      empty = true;
+      return true;
+    }
+    // Attributes have to be separated by whitespace
+    if(p_ == before)
+      return false;
+    std::string name;
+    if(!scanName(name))
+      return false;
+    skipWhitespace();
+    if(p_ == end_ || *p_ != '=')
+      return false;
+    ++p_;
+    skipWhitespace();
+    if(p_ == end_ || (*p_ != '"' && *p_ != '\''))
+      return false;
+    char quote = *p_++;
+    const char* value = p_;
+    const char* value_end = static_cast<const char*>(memchr(p_, quote, end_ - p_));
+    if(!value_end)
+      return false;
+    p_ = value_end + 1;
+    if(element.attribute(name))
+      return false;
+    element.attributes_.push_back(std::make_pair(name, std::string()));
+    if(!decodeText(value, value_end, true, false, element.attributes_.back().second))
+      return false;
+  }
+}
+
+// Read the element that starts at p_ (at its '<'), up to and including its
+// end tag.  The children of the root (depth 0) go into top, and those of
+// the root's export elements into theirs; the rest are read only to get
+// past them.
+bool
+ManifestScanner::scanElement(ManifestElement& element,
+                             int depth,
+                             std::vector<ManifestElement>* top)
+{
+  ++p_;
+  bool empty;
+  if(!scanName(element.tag_) || !scanAttributes(element, empty))
+    return false;
+  if(empty)
+    return true;
+
+  std::vector<ManifestElement>* children = NULL;
+  if(depth == 0)
+    children = top;
+  else if(depth == 1 && element.tag_ == MANIFEST_TAG_EXPORT)
+    children = &element.children_;
+
+  // Like GetText(), the element's text is that of its first child, if
+  // that's text (which doesn't count if it's all whitespace)
+  bool first = true;
+  for(;;)
+  {
+    const char* text = p_;
+    const char* lt = static_cast<const char*>(memchr(p_, '<', end_ - p_));
+    if(!lt)
+      return false;
+    p_ = lt;
+    const char* c = text;
+    while(c != lt && isWhitespace(*c))
+      ++c;
+    if(c != lt)
+    {
+      std::string decoded;
+      if(!decodeText(text, lt, true, true, decoded))
+        return false;
+      if(first)
+      {
+        element.has_text_ = true;
+        element.text_.swap(decoded);
+      }
+      first = false;
+    }
+
+    if(startsWith("</"))
+    {
+      p_ += 2;
+      std::string name;
+      if(!scanName(name) || name != element.tag_)
+        return false;
+      skipWhitespace();
+      if(p_ == end_ || *p_ != '>')
+        return false;
+      ++p_;
+      return true;
+    }
+    else if(startsWith("<!--"))
+    {
+      if(!skipPast("-->"))
+        return false;
+    }
+    else if(startsWith("<![CDATA["))
+    {
+      p_ += 9;
+      const char* cdata = p_;
+      const char* cdata_end;
+      if(!skipPast("]]>", &cdata_end))
+        return false;
+      if(first)
+      {
+        element.has_text_ = true;
+        if(!decodeText(cdata, cdata_end, false, false, element.text_))
+          return false;
+      }
+    }
+    else if(startsWith("<!") || startsWith("<?"))
+      return false;
+    else if(children)
+    {
+      children->push_back(ManifestElement());
+      if(!scanElement(children->back(), depth + 1, top))
+        return false;
+    }
+    else
+    {
+      ManifestElement ignored;
+      if(!scanElement(ignored, depth + 1, top))
+        return false;
+    }
+    first = false;
+  }
+}
+
+bool
+ManifestScanner::scan(std::vector<ManifestElement>& elements)
+{
+  elements.clear();
+  if(startsWith("\xef\xbb\xbf"))
+    p_ += 3;
+
+  // Before the root element, there may be XML declarations and then
+  // comments
+  bool declarations_allowed = true;
+  for(;;)
+  {
+    skipWhitespace();
+    if(startsWith("<?") && declarations_allowed)
+    {
+      if(!skipPast("?>"))
+        return false;
+    }
+    else if(startsWith("<!--"))
+    {
+      declarations_allowed = false;
+      if(!skipPast("-->"))
+        return false;
+    }
+    else if(startsWith("<") && p_ + 1 != end_ && isNameStartChar(p_[1]))
+      break;
+    else
+      return false;
+  }
+
+  ManifestElement root;
+  if(!scanElement(root, 0, &elements))
+    return false;
+
+  // After it, only comments
+  for(;;)
+  {
+    skipWhitespace();
+    if(p_ == end_)
+      return true;
+    if(!startsWith("<!--") || !skipPast("-->"))
+      return false;
+  }
+}
+
+// Read the whole file at path into contents
+static bool
+readFile(const std::string& path, std::vector<char>& contents)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if(!file)
+    return false;
+  contents.clear();
+  char buf[8192];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), file)) > 0)
+    contents.insert(contents.end(), buf, buf + n);
+  bool ok = !ferror(file);
+  fclose(file);
+  return ok;
+}
+
+static void
+copyElement(const tinyxml2::XMLElement* xml, ManifestElement& element)
+{
+  element.tag_ = xml->Name();
+  const char* text = xml->GetText();
+  element.has_text_ = (text != NULL);
+  if(text)
+    element.text_ = text;
+  for(const tinyxml2::XMLAttribute* att = xml->FirstAttribute();
+      att;
+      att = att->Next())
+    element.attributes_.push_back(std::make_pair(std::string(att->Name()),
+                                                 std::string(att->Value())));
+}
+
+bool
+parseManifest(const std::string& path,
+              std::vector<ManifestElement>& elements)
+{
+  std::vector<char> contents;
+  if(readFile(path, contents) && !contents.empty() &&
+     // tinyxml2 stops at a NUL
+     !memchr(&contents[0], '\0', contents.size()))
+  {
+    ManifestScanner scanner(&contents[0], &contents[0] + contents.size());
+    if(scanner.scan(elements))
+      return true;
+  }
+
+  tinyxml2::XMLDocument manifest(true, tinyxml2::COLLAPSE_WHITESPACE);
+  if(manifest.LoadFile(path.c_str()) != tinyxml2::XML_SUCCESS)
+    return false;
+  const tinyxml2::XMLElement* root = manifest.RootElement();
+  if(!root)
+    return false;
+
+  elements.clear();
+  for(const tinyxml2::XMLElement* ele = root->FirstChildElement();
+      ele;
+      ele = ele->NextSiblingElement())
+  {
+    elements.push_back(ManifestElement());
+    ManifestElement& element = elements.back();
+    copyElement(ele, element);
+    // Exports are the only place that rospack looks below the top level
+    if(element.tag_ == MANIFEST_TAG_EXPORT)
+    {
+      for(const tinyxml2::XMLElement* ele2 = ele->FirstChildElement();
+          ele2;
+          ele2 = ele2->NextSiblingElement())
+      {
+        element.children_.push_back(ManifestElement());
+        copyElement(ele2, element.children_.back());
+      }
+    }
+  }
+  return true;
+}
+
+}
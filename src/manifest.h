@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ROSPACK_MANIFEST_H
+#define ROSPACK_MANIFEST_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace rospack
+{
+
+/**
+ * @brief One element of a manifest, with what rospack's queries look at:
+ * its tag, its text, and its attributes.  Only the children of export
+ * elements are kept.
+ */
+class ManifestElement
+{
+  public:
+    std::string tag_;
+    // \brief the element's text, if its first child is text (like
+    // tinyxml2's GetText())
+    bool has_text_;
+    std::string text_;
+    std::vector<std::pair<std::string, std::string> > attributes_;
+    std::vector<ManifestElement> children_;
+
+    ManifestElement() : has_text_(false) {}
+    // \brief the element's text, or NULL if it has none
+    const char* text() const { return has_text_ ? text_.c_str() : NULL; }
+    // \brief the value of the named attribute, or NULL if it has none
+    const char* attribute(const std::string& name) const;
+};
+
+/**
+ * @brief Read a manifest into the elements under its root.
+ * @return False if it can't be read or parsed, or has no root element.
+ */
+bool parseManifest(const std::string& path,
+                   std::vector<ManifestElement>& elements);
+
+}
+
+#endif
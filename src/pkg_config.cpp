@@ -0,0 +1,683 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pkg_config.h"
+#include "crawl.h"
+#include "export_cache.h"
+#include "utils.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if !defined(_WIN32)
+  #include <unistd.h>
+#endif
+
+#if !defined(_WIN32)
+extern char** environ;
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace rospack
+{
+
+// Characters that pkg-config prints as they are and that split into
+// arguments as they are; anything else it may quote or escape
+static bool
+isPlainFlagChar(char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || strchr(",-./:=@^_~", c) != NULL;
+}
+
+static bool
+isSpace(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+         c == '\f' || c == '\v';
+}
+
+static std::string
+trim(const std::string& str)
+{
+  size_t begin = 0;
+  size_t end = str.size();
+  while(begin < end && isSpace(str[begin]))
+    begin++;
+  while(end > begin && isSpace(str[end-1]))
+    end--;
+  return str.substr(begin, end - begin);
+}
+
+// Split a Cflags or Libs value into arguments, if it's plain enough for
+// pkg-config to split it the same way
+static bool
+splitFlags(const std::string& value, std::vector<std::string>& args)
+{
+  for(size_t i = 0; i < value.size(); i++)
+  {
+    if(!isPlainFlagChar(value[i]) && value[i] != ' ' && value[i] != '\t')
+      return false;
+  }
+  std::vector<std::string> tokens;
+  boost::split(tokens, value, boost::is_any_of(" \t"),
+               boost::token_compress_on);
+  for(size_t i = 0; i < tokens.size(); i++)
+  {
+    if(!tokens[i].empty())
+      args.push_back(tokens[i]);
+  }
+  return true;
+}
+
+// Split a Requires value into package names, if none of them comes with
+// a version constraint
+static bool
+splitRequires(const std::string& value, std::vector<std::string>& names)
+{
+  std::vector<std::string> tokens;
+  boost::split(tokens, value, boost::is_any_of(", \t"),
+               boost::token_compress_on);
+  for(size_t i = 0; i < tokens.size(); i++)
+  {
+    const std::string& token = tokens[i];
+    if(token.empty())
+      continue;
+    if(token[0] >= '0' && token[0] <= '9')
+      return false;
+    for(size_t j = 0; j < token.size(); j++)
+    {
+      char c = token[j];
+      if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || strchr("_.+-", c) != NULL))
+        return false;
+    }
+    names.push_back(token);
+  }
+  return true;
+}
+
+// Directories that pkg-config may have been built to treat as system
+// library directories, which it leaves out of -L flags
+static bool
+mayBeSystemLibraryDir(const std::string& dir)
+{
+  static const char* dirs[] = {"/usr/lib", "/lib", "/usr/lib64", "/lib64",
+                               "/usr/lib32", "/lib32", NULL};
+  for(int i = 0; dirs[i]; i++)
+  {
+    if(dir == dirs[i])
+      return true;
+    // multiarch directories, such as /usr/lib/x86_64-linux-gnu
+    std::string prefix = std::string(dirs[i]) + "/";
+    if(boost::starts_with(dir, prefix) &&
+       dir.find('/', prefix.size()) == std::string::npos &&
+       dir.find('-', prefix.size()) != std::string::npos)
+      return true;
+  }
+  return false;
+}
+
+// The same for include directories, which are left out of -I flags.
+// /usr/include always is; a multiarch one might be.
+static bool
+mayBeSystemIncludeDir(const std::string& dir, bool& is_system_dir)
+{
+  is_system_dir = (dir == "/usr/include");
+  std::string prefix = "/usr/include/";
+  return is_system_dir ||
+         (boost::starts_with(dir, prefix) &&
+          dir.find('/', prefix.size()) == std::string::npos &&
+          dir.find("-linux-", prefix.size()) != std::string::npos);
+}
+
+// Read the next line of a .pc file as pkg-config does: '#' starts a
+// comment, '\#' is a '#', and a backslash at the end of a line joins it
+// with the next one
+static bool
+readLine(const std::string& contents, size_t& pos, std::string& line)
+{
+  line.clear();
+  if(pos >= contents.size())
+    return false;
+  bool quoted = false;
+  bool comment = false;
+  while(pos < contents.size())
+  {
+    char c = contents[pos++];
+    if(quoted)
+    {
+      quoted = false;
+      if(c == '#')
+        line += '#';
+      else if(c == '\r' || c == '\n')
+      {
+        if(pos < contents.size() &&
+           ((c == '\r' && contents[pos] == '\n') ||
+            (c == '\n' && contents[pos] == '\r')))
+          pos++;
+      }
+      else
+      {
+        line += '\\';
+        line += c;
+      }
+    }
+    else if(c == '#')
+      comment = true;
+    else if(c == '\\')
+    {
+      if(!comment)
+        quoted = true;
+    }
+    else if(c == '\n')
+    {
+      if(pos < contents.size() && contents[pos] == '\r')
+        pos++;
+      return true;
+    }
+    else if(!comment)
+      line += c;
+  }
+  if(quoted)
+    line += '\\';
+  return true;
+}
+
+PkgConfig::PkgConfig(const std::vector<std::string>& search_path,
+                     bool search_path_complete,
+                     const std::string& pkg_config,
+                     ExportCache* cache) :
+        search_path_(search_path),
+        search_path_complete_(search_path_complete),
+        pkg_config_(pkg_config),
+        cache_(cache)
+{
+}
+
+bool
+PkgConfig::searchPathFromEnvironment(std::vector<std::string>& search_path,
+                                     bool& search_path_complete,
+                                     std::string& pkg_config)
+{
+#if defined(_WIN32)
+  // pkg-config works out a prefix for each package on Windows
+  return false;
+#else
+  // PKG_CONFIG_PATH and PKG_CONFIG_LIBDIR only choose where .pc files
+  // are found; the other PKG_CONFIG_ variables change what is printed,
+  // and so do the include paths that pkg-config leaves out of -I flags
+  for(char** env = environ; env && *env; env++)
+  {
+    if(boost::starts_with(*env, "PKG_CONFIG_") &&
+       !boost::starts_with(*env, "PKG_CONFIG_PATH=") &&
+       !boost::starts_with(*env, "PKG_CONFIG_LIBDIR="))
+      return false;
+  }
+  if(getenv("C_INCLUDE_PATH") || getenv("CPLUS_INCLUDE_PATH"))
+    return false;
+
+  // Which pkg-config would be run
+  const char* path = getenv("PATH");
+  if(!path)
+    return false;
+  std::vector<std::string> path_dirs;
+  boost::split(path_dirs, path, boost::is_any_of(":"));
+  pkg_config.clear();
+  for(size_t i = 0; i < path_dirs.size() && pkg_config.empty(); i++)
+  {
+    std::string candidate =
+      (fs::path(path_dirs[i].empty() ? "." : path_dirs[i]) /
+       "pkg-config").string();
+    if(access(candidate.c_str(), X_OK) == 0)
+      pkg_config = candidate;
+  }
+  if(pkg_config.empty())
+    return false;
+  try
+  {
+    std::string real_name =
+      fs::canonical(pkg_config).filename().string();
+    if(real_name != "pkg-config" &&
+       !boost::ends_with(real_name, "-pkg-config"))
+      return false;
+  }
+  catch(fs::filesystem_error& e)
+  {
+    return false;
+  }
+
+  search_path.clear();
+  const char* env = getenv("PKG_CONFIG_PATH");
+  std::vector<std::string> dirs;
+  if(env)
+    boost::split(dirs, env, boost::is_any_of(":"));
+  env = getenv("PKG_CONFIG_LIBDIR");
+  search_path_complete = (env != NULL);
+  if(env)
+  {
+    std::vector<std::string> libdirs;
+    boost::split(libdirs, env, boost::is_any_of(":"));
+    dirs.insert(dirs.end(), libdirs.begin(), libdirs.end());
+  }
+  for(size_t i = 0; i < dirs.size(); i++)
+  {
+    if(!dirs[i].empty())
+      search_path.push_back(dirs[i]);
+  }
+  return true;
+#endif
+}
+
+bool
+PkgConfig::query(const std::string& option, const std::string& name,
+                 std::string& output)
+{
+  FlagType type;
+  if(option == "--cflags-only-I")
+    type = CFLAGS_I;
+  else if(option == "--cflags-only-other")
+    type = CFLAGS_OTHER;
+  else if(option == "--libs-only-L")
+    type = LIBS_L;
+  else if(option == "--libs-only-l")
+    type = LIBS_l;
+  else if(option == "--libs-only-other")
+    type = LIBS_OTHER;
+  else
+    return false;
+
+  Package* root = load(name);
+  if(!root)
+    return false;
+  // pkg-config reads every package that is required, privately or not,
+  // whatever it's asked for
+  boost::unordered_map<std::string, bool> visited;
+  std::vector<Package*> expanded;
+  if(!fillList(root, true, visited, expanded))
+    return false;
+  bool cflags = (type == CFLAGS_I || type == CFLAGS_OTHER);
+  if(!cflags)
+  {
+    visited.clear();
+    expanded.clear();
+    fillList(root, false, visited, expanded);
+  }
+  // fillList() lists each package after those it requires
+  std::reverse(expanded.begin(), expanded.end());
+  if(type == CFLAGS_I || type == LIBS_L)
+  {
+    std::vector<std::pair<size_t, size_t> > order;
+    for(size_t i = 0; i < expanded.size(); i++)
+      order.push_back(std::make_pair(expanded[i]->path_position, i));
+    std::stable_sort(order.begin(), order.end());
+    std::vector<Package*> sorted;
+    for(size_t i = 0; i < order.size(); i++)
+      sorted.push_back(expanded[order[i].second]);
+    expanded.swap(sorted);
+  }
+
+  std::vector<std::string> args;
+  for(std::vector<Package*>::const_iterator it = expanded.begin();
+      it != expanded.end();
+      ++it)
+  {
+    const std::vector<Flag>& flags = cflags ? (*it)->cflags : (*it)->libs;
+    for(std::vector<Flag>::const_iterator fit = flags.begin();
+        fit != flags.end();
+        ++fit)
+    {
+      if(fit->type != type)
+        continue;
+      if(type == CFLAGS_I)
+      {
+        bool is_system_dir;
+        if(mayBeSystemIncludeDir(fit->arg.substr(2), is_system_dir))
+        {
+          if(!is_system_dir)
+            return false;
+          continue;
+        }
+      }
+      else if(type == LIBS_L && mayBeSystemLibraryDir(fit->arg.substr(2)))
+        return false;
+      // pkg-config only drops a flag that repeats the one before it
+      if(args.empty() || args.back() != fit->arg)
+        args.push_back(fit->arg);
+    }
+  }
+  output = boost::join(args, " ");
+  return true;
+}
+
+// As pkg-config's recursive_fill_list(): each package is added after the
+// packages it requires, which are taken last to first
+bool
+PkgConfig::fillList(Package* pkg, bool include_private,
+                    boost::unordered_map<std::string, bool>& visited,
+                    std::vector<Package*>& expanded)
+{
+  if(visited.find(pkg->name) != visited.end())
+    return true;
+  visited[pkg->name] = true;
+  // pkg-config puts the private requirements first
+  std::vector<std::string> required;
+  if(include_private)
+    required = pkg->required_private;
+  required.insert(required.end(), pkg->required.begin(), pkg->required.end());
+  for(std::vector<std::string>::reverse_iterator it = required.rbegin();
+      it != required.rend();
+      ++it)
+  {
+    Package* req = load(*it);
+    if(!req || !fillList(req, include_private, visited, expanded))
+      return false;
+  }
+  expanded.push_back(pkg);
+  return true;
+}
+
+PkgConfig::Package*
+PkgConfig::load(const std::string& name)
+{
+  boost::unordered_map<std::string, boost::shared_ptr<Package> >::const_iterator it =
+    packages_.find(name);
+  if(it != packages_.end())
+    return it->second.get();
+
+  boost::shared_ptr<Package> pkg;
+  std::string path;
+  size_t path_position;
+  if(locate(name, path, path_position))
+  {
+    pkg.reset(new Package());
+    pkg->name = name;
+    pkg->path_position = path_position;
+    if(!parse(path, *pkg))
+      pkg.reset();
+  }
+  packages_[name] = pkg;
+  return pkg.get();
+}
+
+bool
+PkgConfig::locate(const std::string& name, std::string& path,
+                  size_t& path_position)
+{
+  // Names that pkg-config takes for paths to .pc files
+  if(name.empty() || name.find('/') != std::string::npos ||
+     boost::ends_with(name, ".pc"))
+    return false;
+  if(!search_path_complete_ && !loadDefaultSearchPath())
+    return false;
+  // pkg-config prefers name-uninstalled.pc from anywhere in the path
+  boost::system::error_code ec;
+  for(size_t i = 0; i < search_path_.size(); i++)
+  {
+    if(fs::exists(fs::path(search_path_[i]) / (name + "-uninstalled.pc"), ec))
+      return false;
+  }
+  for(size_t i = 0; i < search_path_.size(); i++)
+  {
+    fs::path candidate = fs::path(search_path_[i]) / (name + ".pc");
+    if(fs::is_regular_file(candidate, ec))
+    {
+      path = candidate.string();
+      path_position = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Ask pkg-config for the directories it searches after PKG_CONFIG_PATH,
+// which it was built with, unless it's been asked already
+bool
+PkgConfig::loadDefaultSearchPath()
+{
+#if defined(_WIN32)
+  return false;
+#else
+  std::string key;
+  std::string pc_path;
+  FileStamp stamp;
+  if(cache_ && stampFile(pkg_config_, stamp))
+  {
+    char stamp_str[128];
+    snprintf(stamp_str, sizeof(stamp_str), "%llu %lld %lld %llu",
+             (unsigned long long)stamp.ino_, (long long)stamp.mtime_sec_,
+             (long long)stamp.mtime_nsec_, (unsigned long long)stamp.size_);
+    key = sha1_hex(pkg_config_ + " --variable=pc_path pkg-config\n" +
+                   stamp_str + "\n");
+  }
+  if(key.empty() || !cache_->find(key, pc_path))
+  {
+    // pkg_config_, quoted for the shell
+    std::string cmd = "'";
+    for(size_t i = 0; i < pkg_config_.size(); i++)
+    {
+      if(pkg_config_[i] == '\'')
+        cmd += "'\\''";
+      else
+        cmd += pkg_config_[i];
+    }
+    cmd += "' --variable=pc_path pkg-config 2>/dev/null";
+    FILE* p = popen(cmd.c_str(), "r");
+    if(!p)
+      return false;
+    char buf[4096];
+    size_t n;
+    do
+    {
+      clearerr(p);
+      while((n = fread(buf, 1, sizeof(buf), p)) > 0)
+        pc_path.append(buf, n);
+    } while(ferror(p) && errno == EINTR);
+    if(pclose(p) != 0)
+      return false;
+    boost::trim_right_if(pc_path, boost::is_any_of("\n"));
+    if(!key.empty())
+      cache_->insert(key, pc_path);
+  }
+  std::vector<std::string> dirs;
+  boost::split(dirs, pc_path, boost::is_any_of(":\n"));
+  for(size_t i = 0; i < dirs.size(); i++)
+  {
+    if(!dirs[i].empty())
+      search_path_.push_back(dirs[i]);
+  }
+  search_path_complete_ = true;
+  return true;
+#endif
+}
+
+bool
+PkgConfig::parse(const std::string& path, Package& pkg)
+{
+  FILE* f = fopen(path.c_str(), "rb");
+  if(!f)
+    return false;
+  std::string contents;
+  char buf[8192];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    contents.append(buf, n);
+  bool read_ok = !ferror(f);
+  fclose(f);
+  if(!read_ok)
+    return false;
+
+  // pcfiledir is predefined; pc_sysrootdir and pc_top_builddir are
+  // global, and so win over the package's own definitions
+  boost::unordered_map<std::string, std::string> vars;
+  std::string pcfiledir = fs::path(path).parent_path().string();
+  vars["pcfiledir"] = pcfiledir.empty() ? "." : pcfiledir;
+  boost::unordered_map<std::string, std::string> globals;
+  globals["pc_sysrootdir"] = "/";
+  globals["pc_top_builddir"] = "$(top_builddir)";
+
+  boost::unordered_map<std::string, bool> seen_fields;
+  std::string line;
+  size_t pos = 0;
+  while(readLine(contents, pos, line))
+  {
+    std::string str = trim(line);
+    if(str.empty())
+      continue;
+    size_t p = 0;
+    while(p < str.size() &&
+          ((str[p] >= 'A' && str[p] <= 'Z') ||
+           (str[p] >= 'a' && str[p] <= 'z') ||
+           (str[p] >= '0' && str[p] <= '9') ||
+           str[p] == '_' || str[p] == '.'))
+      p++;
+    std::string tag = str.substr(0, p);
+    while(p < str.size() && isSpace(str[p]))
+      p++;
+    if(p == str.size() || (str[p] != ':' && str[p] != '='))
+      continue;
+    if(tag.empty())
+      return false;
+    bool is_field = (str[p] == ':');
+    if(is_field && tag == "CFlags")
+      tag = "Cflags";
+    if(is_field && tag != "Name" && tag != "Description" &&
+       tag != "Version" && tag != "URL" && tag != "Requires" &&
+       tag != "Requires.private" && tag != "Cflags" && tag != "Libs" &&
+       tag != "Libs.private" && tag != "Conflicts")
+      continue;
+
+    // Substitute ${var} and $$ as pkg-config's trim_and_sub() does
+    std::string raw = trim(str.substr(p + 1));
+    std::string value;
+    for(size_t i = 0; i < raw.size();)
+    {
+      if(raw[i] == '$' && i + 1 < raw.size() && raw[i+1] == '$')
+      {
+        value += '$';
+        i += 2;
+      }
+      else if(raw[i] == '$' && i + 1 < raw.size() && raw[i+1] == '{')
+      {
+        size_t close = raw.find('}', i + 2);
+        if(close == std::string::npos)
+          return false;
+        std::string var = raw.substr(i + 2, close - i - 2);
+        boost::unordered_map<std::string, std::string>::const_iterator vit =
+          globals.find(var);
+        if(vit == globals.end())
+        {
+          vit = vars.find(var);
+          if(vit == vars.end())
+            return false;
+        }
+        value += vit->second;
+        i = close + 1;
+      }
+      else
+        value += raw[i++];
+    }
+
+    if(!is_field)
+    {
+      if(vars.find(tag) != vars.end())
+        return false;
+      vars[tag] = value;
+      continue;
+    }
+
+    if(seen_fields.find(tag) != seen_fields.end())
+      return false;
+    seen_fields[tag] = true;
+    if(tag == "Requires")
+    {
+      if(!splitRequires(value, pkg.required))
+        return false;
+    }
+    else if(tag == "Requires.private")
+    {
+      if(!splitRequires(value, pkg.required_private))
+        return false;
+    }
+    else if(tag == "Conflicts")
+    {
+      if(!value.empty())
+        return false;
+    }
+    else if(tag == "Cflags")
+    {
+      std::vector<std::string> args;
+      if(!splitFlags(value, args))
+        return false;
+      for(size_t i = 0; i < args.size(); i++)
+      {
+        if(args[i] == "-I" || args[i] == "-isystem" ||
+           args[i] == "-idirafter")
+          return false;
+        Flag flag;
+        flag.type = boost::starts_with(args[i], "-I") ? CFLAGS_I : CFLAGS_OTHER;
+        flag.arg = args[i];
+        pkg.cflags.push_back(flag);
+      }
+    }
+    else if(tag == "Libs" || tag == "Libs.private")
+    {
+      std::vector<std::string> args;
+      if(!splitFlags(value, args))
+        return false;
+      if(tag == "Libs.private")
+        continue;
+      for(size_t i = 0; i < args.size(); i++)
+      {
+        if(args[i] == "-l" || args[i] == "-L" ||
+           boost::starts_with(args[i], "-lib:") ||
+           args[i] == "-framework" || args[i] == "-Wl,-framework")
+          return false;
+        Flag flag;
+        if(boost::starts_with(args[i], "-l"))
+          flag.type = LIBS_l;
+        else if(boost::starts_with(args[i], "-L"))
+          flag.type = LIBS_L;
+        else
+          flag.type = LIBS_OTHER;
+        flag.arg = args[i];
+        pkg.libs.push_back(flag);
+      }
+    }
+  }
+  // pkg-config refuses packages without these
+  return seen_fields.find("Name") != seen_fields.end() &&
+         seen_fields.find("Description") != seen_fields.end() &&
+         seen_fields.find("Version") != seen_fields.end();
+}
+
+}
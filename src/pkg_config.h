@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ROSPACK_PKG_CONFIG_H
+#define ROSPACK_PKG_CONFIG_H
+
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <string>
+#include <vector>
+
+namespace rospack
+{
+
+class ExportCache;
+
+/**
+ * @brief What 'pkg-config <option> <package>' prints, worked out from the
+ * .pc files instead of by running pkg-config, for the options that
+ * cpp_exports() asks about.  It follows pkg-config 0.29 from
+ * freedesktop.org: the packages reached through Requires (and, for
+ * cflags, Requires.private) in the order that it lists them, sorted by
+ * search path position for -I and -L, with repeated neighbouring flags
+ * dropped.
+ *
+ * Only what is sure to come out the same is answered; for anything else
+ * query() returns false and the caller should run pkg-config after all.
+ * That covers version constraints and Conflicts, -uninstalled packages,
+ * flags that pkg-config would quote or pair up with the next one, and
+ * directories that it might leave out as system directories.
+ */
+class PkgConfig
+{
+  public:
+    /**
+     * @brief Look for .pc files in search_path, in order.  If
+     * search_path_complete is false, pkg_config is asked for its default
+     * search path when a package isn't found in search_path.  That's
+     * built into pkg_config, so if cache is given, the answer is kept
+     * there for as long as pkg_config's stamp stays the same.
+     */
+    PkgConfig(const std::vector<std::string>& search_path,
+              bool search_path_complete,
+              const std::string& pkg_config = "pkg-config",
+              ExportCache* cache = NULL);
+
+    /**
+     * @brief The search path that pkg-config would use, if it's one that
+     * query() can stand in for: pkg-config is freedesktop.org's (not
+     * pkgconf, which orders flags differently) and no environment
+     * variable changes what it prints.
+     * @param search_path_complete Set to false if the search path ends
+     * with pkg-config's default one, which isn't included.
+     * @param pkg_config Set to the path of the pkg-config that would be
+     * run.
+     */
+    static bool searchPathFromEnvironment(std::vector<std::string>& search_path,
+                                          bool& search_path_complete,
+                                          std::string& pkg_config);
+
+    /**
+     * @brief Work out what 'pkg-config option name' prints, without
+     * surrounding white space.  Packages are only read once per object.
+     * @param option One of --cflags-only-I, --cflags-only-other,
+     * --libs-only-L, --libs-only-l or --libs-only-other.
+     * @return False if the answer isn't sure.
+     */
+    bool query(const std::string& option, const std::string& name,
+               std::string& output);
+
+  private:
+    enum FlagType
+    {
+      CFLAGS_I = 1 << 0,
+      CFLAGS_OTHER = 1 << 1,
+      LIBS_L = 1 << 2,
+      LIBS_l = 1 << 3,
+      LIBS_OTHER = 1 << 4
+    };
+    struct Flag
+    {
+      FlagType type;
+      std::string arg;
+    };
+    struct Package
+    {
+      std::string name;
+      // where in the search path the .pc file was found
+      size_t path_position;
+      std::vector<std::string> required;
+      std::vector<std::string> required_private;
+      std::vector<Flag> cflags;
+      std::vector<Flag> libs;
+    };
+
+    std::vector<std::string> search_path_;
+    bool search_path_complete_;
+    std::string pkg_config_;
+    ExportCache* cache_;
+    // packages by name, NULL for those that couldn't be read
+    boost::unordered_map<std::string, boost::shared_ptr<Package> > packages_;
+
+    Package* load(const std::string& name);
+    bool locate(const std::string& name, std::string& path,
+                size_t& path_position);
+    bool loadDefaultSearchPath();
+    bool parse(const std::string& path, Package& pkg);
+    bool fillList(Package* pkg, bool include_private,
+                  boost::unordered_map<std::string, bool>& visited,
+                  std::vector<Package*>& expanded);
+};
+
+}
+
+#endif
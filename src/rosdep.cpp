@@ -0,0 +1,525 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rosdep.h"
+#include "utils.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/unordered_map.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace fs = boost::filesystem;
+
+namespace rospack
+{
+
+static const char* SYS_DEPENDENCY_CACHE_VERSION = "#rospack rosdep cache 1";
+
+static bool
+readFile(const std::string& path, std::string& contents)
+{
+  FILE* f = fopen(path.c_str(), "rb");
+  if(!f)
+    return false;
+  contents.clear();
+  char buf[65536];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    contents.append(buf, n);
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+namespace
+{
+
+// What the pickle reader keeps of an object on its stack: strings, so
+// that they can become keys, and dicts, so that the outermost one can be
+// told apart
+struct PickleValue
+{
+  enum Kind { MARK, STRING, DICT, OTHER };
+  Kind kind;
+  const char* str;
+  size_t len;
+  int dict;
+  PickleValue(Kind k=OTHER) : kind(k), str(NULL), len(0), dict(-1) {}
+};
+
+}
+
+// Read the keys of the dict that a pickle holds, as written by rosdep
+// (protocol 2, or 4 with framing), without building the values.  Only the
+// opcodes that plain data (dicts, lists, strings, numbers, booleans and
+// None) pickle to are understood; anything else is refused.
+static bool
+readPickleKeys(const std::string& pickle, std::vector<std::string>& keys)
+{
+  const unsigned char* p = (const unsigned char*)pickle.data();
+  const unsigned char* end = p + pickle.size();
+  std::vector<PickleValue> stack;
+  boost::unordered_map<boost::uint32_t, PickleValue> memo;
+  int num_dicts = 0;
+
+#define NEED(n) if((size_t)(end - p) < (size_t)(n)) return false
+#define UINT(n, v) \
+  do { NEED(n); v = 0; \
+       for(int b_ = (n) - 1; b_ >= 0; b_--) v = (v << 8) | p[b_]; \
+       p += (n); } while(0)
+
+  while(p < end)
+  {
+    unsigned char op = *p++;
+    boost::uint64_t n;
+    switch(op)
+    {
+      case 0x80: // PROTO
+        NEED(1);
+        p++;
+        break;
+      case 0x95: // FRAME
+        NEED(8);
+        p += 8;
+        break;
+      case '}': // EMPTY_DICT
+        {
+          PickleValue v(PickleValue::DICT);
+          v.dict = num_dicts++;
+          stack.push_back(v);
+        }
+        break;
+      case ']': // EMPTY_LIST
+      case ')': // EMPTY_TUPLE
+      case 'N': // NONE
+      case 0x88: // NEWTRUE
+      case 0x89: // NEWFALSE
+        stack.push_back(PickleValue());
+        break;
+      case '(': // MARK
+        stack.push_back(PickleValue(PickleValue::MARK));
+        break;
+      case 'K': // BININT1
+        NEED(1);
+        p += 1;
+        stack.push_back(PickleValue());
+        break;
+      case 'M': // BININT2
+        NEED(2);
+        p += 2;
+        stack.push_back(PickleValue());
+        break;
+      case 'J': // BININT
+        NEED(4);
+        p += 4;
+        stack.push_back(PickleValue());
+        break;
+      case 'G': // BINFLOAT
+        NEED(8);
+        p += 8;
+        stack.push_back(PickleValue());
+        break;
+      case 0x8a: // LONG1
+        UINT(1, n);
+        NEED(n);
+        p += n;
+        stack.push_back(PickleValue());
+        break;
+      case 'X': // BINUNICODE
+      case 'T': // BINSTRING
+      case 0x8c: // SHORT_BINUNICODE
+      case 'U': // SHORT_BINSTRING
+      case 0x8d: // BINUNICODE8
+        if(op == 'X' || op == 'T')
+          UINT(4, n);
+        else if(op == 0x8d)
+          UINT(8, n);
+        else
+          UINT(1, n);
+        NEED(n);
+        {
+          PickleValue v(PickleValue::STRING);
+          v.str = (const char*)p;
+          v.len = (size_t)n;
+          stack.push_back(v);
+        }
+        p += n;
+        break;
+      case 'q': // BINPUT
+      case 'r': // LONG_BINPUT
+        if(op == 'q')
+          UINT(1, n);
+        else
+          UINT(4, n);
+        if(stack.empty() || stack.back().kind == PickleValue::MARK)
+          return false;
+        memo[(boost::uint32_t)n] = stack.back();
+        break;
+      case 0x94: // MEMOIZE
+        if(stack.empty() || stack.back().kind == PickleValue::MARK)
+          return false;
+        n = memo.size();
+        memo[(boost::uint32_t)n] = stack.back();
+        break;
+      case 'h': // BINGET
+      case 'j': // LONG_BINGET
+        {
+          if(op == 'h')
+            UINT(1, n);
+          else
+            UINT(4, n);
+          boost::unordered_map<boost::uint32_t, PickleValue>::const_iterator it =
+            memo.find((boost::uint32_t)n);
+          if(it == memo.end())
+            return false;
+          stack.push_back(it->second);
+        }
+        break;
+      case 'a': // APPEND
+        if(stack.size() < 2)
+          return false;
+        stack.pop_back();
+        break;
+      case 0x85: // TUPLE1
+      case 0x86: // TUPLE2
+      case 0x87: // TUPLE3
+        n = op - 0x84;
+        if(stack.size() < n)
+          return false;
+        stack.resize(stack.size() - n);
+        stack.push_back(PickleValue());
+        break;
+      case 's': // SETITEM
+      case 'e': // APPENDS
+      case 'u': // SETITEMS
+      case 't': // TUPLE
+      case 'l': // LIST
+        {
+          size_t first;
+          if(op == 's')
+          {
+            if(stack.size() < 3)
+              return false;
+            first = stack.size() - 2;
+          }
+          else
+          {
+            size_t mark = stack.size();
+            while(mark > 0 && stack[mark-1].kind != PickleValue::MARK)
+              mark--;
+            if(mark == 0)
+              return false;
+            first = mark;
+          }
+          if(op == 's' || op == 'u')
+          {
+            size_t target = (op == 's') ? first - 1 : first - 2;
+            if((op == 'u' && first < 2) ||
+               stack[target].kind != PickleValue::DICT ||
+               (stack.size() - first) % 2)
+              return false;
+            if(stack[target].dict == 0)
+            {
+              for(size_t i = first; i < stack.size(); i += 2)
+              {
+                if(stack[i].kind == PickleValue::STRING)
+                  keys.push_back(std::string(stack[i].str, stack[i].len));
+              }
+            }
+          }
+          stack.resize(op == 's' ? first : first - 1);
+          if(op == 't' || op == 'l')
+            stack.push_back(PickleValue());
+        }
+        break;
+      case '.': // STOP
+        return stack.size() == 1 &&
+               stack[0].kind == PickleValue::DICT &&
+               stack[0].dict == 0;
+      default:
+        return false;
+    }
+  }
+  return false;
+
+#undef UINT
+#undef NEED
+}
+
+bool
+RosdepView::load(const std::string& sources_cache_dir,
+                 const std::string& ros_distro)
+{
+  keys_.clear();
+  undecided_keys_.clear();
+  files_.clear();
+
+  std::string index_path = (fs::path(sources_cache_dir) / "index").string();
+  std::string index;
+  if(!readFile(index_path, index))
+    return false;
+  files_.push_back(index_path);
+
+  // One source per line: its type, URL and tags, separated by single
+  // spaces, as rosdep splits them
+  std::vector<std::string> lines;
+  boost::split(lines, index, boost::is_any_of("\n"));
+  for(std::vector<std::string>::iterator line = lines.begin();
+      line != lines.end();
+      ++line)
+  {
+    boost::trim(*line);
+    if(line->empty() || (*line)[0] == '#')
+      continue;
+    std::vector<std::string> fields;
+    boost::split(fields, *line, boost::is_any_of(" "));
+    if(fields.size() < 2 || fields[0] != "yaml")
+      return false;
+
+    bool matches = true;
+    bool decided = true;
+    for(size_t i = 2; i < fields.size(); i++)
+    {
+      if(fields[i].empty())
+        matches = false;
+      else if(fields[i] != ros_distro)
+        decided = false;
+    }
+    if(!matches)
+      continue;
+
+    // rosdep names each source's file after the SHA-1 of its URL
+    fs::path source_path = fs::path(sources_cache_dir) / sha1_hex(fields[1]);
+    std::string pickle_path = source_path.string() + ".pickle";
+    std::string pickle;
+    if(!readFile(pickle_path, pickle))
+    {
+      // The source's data may be kept as YAML instead, which isn't read
+      // here; if there's neither, rosdep takes the source to be empty
+      if(fs::exists(source_path) || fs::exists(pickle_path))
+        return false;
+      continue;
+    }
+    files_.push_back(pickle_path);
+    std::vector<std::string> keys;
+    if(!readPickleKeys(pickle, keys))
+      return false;
+    boost::unordered_set<std::string>& into =
+      decided ? keys_ : undecided_keys_;
+    into.insert(keys.begin(), keys.end());
+  }
+
+  // Whether the view is empty then depends on the OS
+  if(keys_.empty() && !undecided_keys_.empty())
+    return false;
+  return true;
+}
+
+RosdepView::Answer
+RosdepView::isSystemDependency(const std::string& name) const
+{
+  if(keys_.count(name))
+    return SYSTEM_DEPENDENCY;
+  if(undecided_keys_.count(name))
+    return UNDECIDED;
+  return NOT_SYSTEM_DEPENDENCY;
+}
+
+static void
+printStamp(FILE* file, const char* label, const FileStamp& stamp)
+{
+  fprintf(file, "#%s=%llu %lld %lld %llu\n", label,
+          (unsigned long long)stamp.ino_, (long long)stamp.mtime_sec_,
+          (long long)stamp.mtime_nsec_, (unsigned long long)stamp.size_);
+}
+
+static bool
+scanStamp(const char* line, const char* label, FileStamp& stamp)
+{
+  size_t len = strlen(label);
+  if(line[0] != '#' || strncmp(line + 1, label, len) || line[len + 1] != '=')
+    return false;
+  unsigned long long ino, size;
+  long long sec, nsec;
+  if(sscanf(line + len + 2, "%llu %lld %lld %llu",
+            &ino, &sec, &nsec, &size) != 4)
+    return false;
+  stamp.ino_ = ino;
+  stamp.mtime_sec_ = sec;
+  stamp.mtime_nsec_ = nsec;
+  stamp.size_ = size;
+  return true;
+}
+
+void
+SysDependencyCache::load(const std::string& filename,
+                         const std::string& sources_cache_dir,
+                         const std::string& ros_distro)
+{
+  filename_ = filename;
+  sources_cache_dir_ = sources_cache_dir;
+  ros_distro_ = ros_distro;
+  answers_.clear();
+  dirty_ = false;
+  // Stamped before any answers are worked out, so that answers that come
+  // from a sources cache that's being replaced don't outlive it.  A
+  // missing sources cache stamps as zeroes.
+  dir_stamp_ = FileStamp();
+  index_stamp_ = FileStamp();
+  stampFile(sources_cache_dir, dir_stamp_);
+  stampFile((fs::path(sources_cache_dir) / "index").string(), index_stamp_);
+
+  FILE* file = fopen(filename.c_str(), "r");
+  if(!file)
+    return;
+
+  char linebuf[30000];
+  bool ok = fgets(linebuf, sizeof(linebuf), file) &&
+          !strncmp(linebuf, SYS_DEPENDENCY_CACHE_VERSION, strlen(SYS_DEPENDENCY_CACHE_VERSION));
+  bool sources_ok = false;
+  bool distro_ok = false;
+  bool dir_ok = false;
+  bool index_ok = false;
+  while(ok && fgets(linebuf, sizeof(linebuf), file))
+  {
+    char* newline_pos = strchr(linebuf, '\n');
+    if(!newline_pos)
+    {
+      ok = false;
+      break;
+    }
+    *newline_pos = 0;
+    FileStamp stamp;
+    if(!strncmp(linebuf, "#ROSDEP_SOURCES_CACHE=", 22))
+      sources_ok = (sources_cache_dir == linebuf + 22);
+    else if(!strncmp(linebuf, "#ROS_DISTRO=", 12))
+      distro_ok = (ros_distro == linebuf + 12);
+    else if(scanStamp(linebuf, "DIR", stamp))
+      dir_ok = (stamp == dir_stamp_);
+    else if(scanStamp(linebuf, "INDEX", stamp))
+      index_ok = (stamp == index_stamp_);
+    else if(linebuf[0] == '#')
+      ok = false;
+    else
+    {
+      // Out of the header; the answers hold only if all of it matched
+      ok = sources_ok && distro_ok && dir_ok && index_ok;
+      char* space_pos = strrchr(linebuf, ' ');
+      if(!ok || !space_pos || strlen(space_pos) != 2 ||
+         (space_pos[1] != '0' && space_pos[1] != '1'))
+      {
+        ok = false;
+        break;
+      }
+      answers_[std::string(linebuf, space_pos)] = (space_pos[1] == '1');
+    }
+  }
+  fclose(file);
+  if(!ok)
+    answers_.clear();
+}
+
+bool
+SysDependencyCache::find(const std::string& name, bool& is_sys_package) const
+{
+  boost::unordered_map<std::string, bool>::const_iterator it =
+    answers_.find(name);
+  if(it == answers_.end())
+    return false;
+  is_sys_package = it->second;
+  return true;
+}
+
+void
+SysDependencyCache::insert(const std::string& name, bool is_sys_package)
+{
+  answers_[name] = is_sys_package;
+  dirty_ = true;
+}
+
+bool
+SysDependencyCache::save()
+{
+  // Settings with newlines in them can't be written, and so can't be
+  // checked when the file is read again
+  if(filename_.empty() ||
+     sources_cache_dir_.find('\n') != std::string::npos ||
+     ros_distro_.find('\n') != std::string::npos)
+    return false;
+
+  std::string tmp_filename;
+  FILE* file = create_replacement_file(filename_, tmp_filename);
+  if(!file)
+    return false;
+
+  fprintf(file, "%s\n", SYS_DEPENDENCY_CACHE_VERSION);
+  fprintf(file, "#ROSDEP_SOURCES_CACHE=%s\n", sources_cache_dir_.c_str());
+  fprintf(file, "#ROS_DISTRO=%s\n", ros_distro_.c_str());
+  printStamp(file, "DIR", dir_stamp_);
+  printStamp(file, "INDEX", index_stamp_);
+  for(boost::unordered_map<std::string, bool>::const_iterator it = answers_.begin();
+      it != answers_.end();
+      ++it)
+  {
+    if(it->first.find('\n') != std::string::npos)
+      continue;
+    fprintf(file, "%s %d\n", it->first.c_str(), it->second ? 1 : 0);
+  }
+
+  if(!replace_file(file, tmp_filename, filename_))
+    return false;
+  dirty_ = false;
+  return true;
+}
+
+std::string
+RosdepView::defaultSourcesCacheDir()
+{
+  // As rospkg finds ROS_HOME
+  fs::path ros_home;
+  const char* env = getenv("ROS_HOME");
+  if(env)
+    ros_home = env;
+  else
+  {
+#if defined(_WIN32)
+    env = getenv("USERPROFILE");
+#else
+    env = getenv("HOME");
+#endif
+    if(!env)
+      return std::string();
+    ros_home = fs::path(env) / ".ros";
+  }
+  return (ros_home / "rosdep" / "sources.cache").string();
+}
+
+}
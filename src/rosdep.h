@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ROSPACK_ROSDEP_H
+#define ROSPACK_ROSDEP_H
+
+#include "crawl.h"
+
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <string>
+#include <vector>
+
+namespace rospack
+{
+
+/**
+ * @brief The rosdep keys that rosdep's default view would hold, read
+ * straight from the sources cache that 'rosdep update' writes
+ * (ROS_HOME/rosdep/sources.cache), so that asking whether a name is a
+ * system dependency needn't start Python.
+ *
+ * The cache has an index listing the sources, each with its tags, and a
+ * pickle for each source mapping rosdep keys to their rules.  rosdep only
+ * uses the sources whose tags all match the ROS distro and the OS; the
+ * ROS distro is known here, the OS isn't, so the keys of sources tagged
+ * for anything else are set aside as undecided, and questions about them
+ * are left to rosdep itself.
+ */
+class RosdepView
+{
+  public:
+    enum Answer
+    {
+      NOT_SYSTEM_DEPENDENCY,
+      SYSTEM_DEPENDENCY,
+      // \brief only rosdep can tell
+      UNDECIDED
+    };
+
+    /**
+     * @brief Read the sources cache in the given directory, keeping the
+     * sources that apply to ros_distro (which may be empty).
+     * @return False if the cache can't be read here: it's missing, it
+     * holds something other than pickles of plain data, or whether the
+     * view is empty depends on the OS.
+     */
+    bool load(const std::string& sources_cache_dir,
+              const std::string& ros_distro);
+    bool empty() const { return keys_.empty(); }
+    Answer isSystemDependency(const std::string& name) const;
+    // \brief the files that load() read
+    const std::vector<std::string>& files() const { return files_; }
+
+    // \brief where rosdep keeps its sources cache
+    static std::string defaultSourcesCacheDir();
+
+  private:
+    boost::unordered_set<std::string> keys_;
+    boost::unordered_set<std::string> undecided_keys_;
+    std::vector<std::string> files_;
+};
+
+/**
+ * @brief Answers to whether names are system dependencies, kept in a file
+ * so that each process needn't ask rosdep again.  The answers hold for as
+ * long as rosdep's sources cache is the one they came from: 'rosdep
+ * update' replaces the index and the pickles, which changes the stamps of
+ * the index and of the directory they're in.  They're also only good for
+ * the ROS distro they were given for.
+ */
+class SysDependencyCache
+{
+  public:
+    SysDependencyCache() : dirty_(false) {}
+
+    /**
+     * @brief Read the answers from a file, keeping them only if they were
+     * given for the sources cache as it is now and for ros_distro.  A
+     * missing or unreadable file gives no answers.
+     */
+    void load(const std::string& filename,
+              const std::string& sources_cache_dir,
+              const std::string& ros_distro);
+    bool find(const std::string& name, bool& is_sys_package) const;
+    void insert(const std::string& name, bool is_sys_package);
+    // \brief have answers been added since load()?
+    bool dirty() const { return dirty_; }
+    /**
+     * @brief Replace the file that load() read with these answers.
+     * @return False if that couldn't be done.
+     */
+    bool save();
+
+  private:
+    std::string filename_;
+    std::string sources_cache_dir_;
+    std::string ros_distro_;
+    // stamps of the sources cache directory and its index, when loaded
+    FileStamp dir_stamp_;
+    FileStamp index_stamp_;
+    boost::unordered_map<std::string, bool> answers_;
+    bool dirty_;
+};
+
+}
+
+#endif
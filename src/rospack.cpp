@@ -28,11 +28,20 @@
 #include <Python.h>
 #include "rospack/rospack.h"
 #include "utils.h"
-#include "tinyxml2.h"
+#include "binary_cache.h"
+#include "crawl.h"
+#include "dep_graph.h"
+#include "export_cache.h"
+#include "manifest.h"
+#include "pkg_config.h"
+#include "rosdep.h"
+#include "work_queue.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/functional/hash.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
 #include <stdexcept>
 
 #if defined(WIN32)
@@ -69,6 +78,7 @@
 #include <time.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
 
 /* re-define some String functions for python 2.x */
 #if PY_VERSION_HEX < 0x03000000
@@ -96,8 +106,8 @@ static const char* ROSPACKAGE_MANIFEST_NAME = "package.xml";
 static const char* ROSSTACK_MANIFEST_NAME = "stack.xml";
 static const char* ROSPACK_CACHE_PREFIX = "rospack_cache";
 static const char* ROSSTACK_CACHE_PREFIX = "rosstack_cache";
-static const char* ROSPACK_NOSUBDIRS = "rospack_nosubdirs";
-static const char* CATKIN_IGNORE = "CATKIN_IGNORE";
+static const char* DIRECTORY_INDEX_SUFFIX = ".dirindex";
+static const char* BINARY_CACHE_SUFFIX = ".bin";
 static const char* DOTROS_NAME = ".ros";
 static const char* MSG_GEN_GENERATED_DIR = "msg_gen";
 static const char* MSG_GEN_GENERATED_FILE = "generated";
@@ -113,9 +123,18 @@ static const char* MANIFEST_PREFIX = "${prefix}";
 static const int MAX_CRAWL_DEPTH = 1000;
 static const int MAX_DEPENDENCY_DEPTH = 1000;
 static const double DEFAULT_MAX_CACHE_AGE = 60.0;
-
-tinyxml2::XMLElement* get_manifest_root(Stackage* stackage);
+// How long to wait for another process to finish rebuilding the cache
+// before giving up and crawling anyway
+static const double CACHE_LOCK_TIMEOUT = 30.0;
+static const char* CACHE_LOCK_SUFFIX = ".lock";
+static const size_t MAX_DEFAULT_CRAWL_THREADS = 8;
+static const size_t MAX_DEFAULT_EXPORT_THREADS = 8;
+
+const std::vector<ManifestElement>& get_manifest_elements(Stackage* stackage);
 double time_since_epoch();
+static double cacheMaxAge();
+static void throwDepthExceeded(const DependencyGraph& graph,
+                               const std::vector<int>& dep_chain);
 
 #ifdef __APPLE__
   static const std::string g_ros_os = "osx";
@@ -150,10 +169,20 @@ class Stackage
     std::vector<std::string> licenses_;
     // \brief have we already loaded the manifest?
     bool manifest_loaded_;
-    // \brief TinyXML structure, filled in during parsing
-    tinyxml2::XMLDocument manifest_;
-    std::vector<Stackage*> deps_;
-    bool deps_computed_;
+    // \brief the manifest's stamp when it was loaded (or when the binary
+    // cache record it will be loaded from was written), if it can be
+    // trusted to tell whether the manifest has changed since
+    FileStamp manifest_stamp_;
+    bool manifest_stamped_;
+    // \brief the manifest's top-level elements, filled in during parsing
+    std::vector<ManifestElement> elements_;
+    // \brief the binary cache record to load the manifest from instead of
+    // parsing it, if there is one
+    BinaryCachePtr cache_;
+    size_t cache_index_;
+    // \brief the stackage's ID in the dependency graph, or -1 if it hasn't
+    // been given one
+    int id_;
     bool is_wet_package_;
     bool is_metapackage_;
 
@@ -166,8 +195,9 @@ class Stackage
             manifest_path_(manifest_path),
             manifest_name_(manifest_name),
             manifest_loaded_(false),
-            manifest_(true, tinyxml2::COLLAPSE_WHITESPACE),
-            deps_computed_(false),
+            manifest_stamped_(false),
+            cache_index_(0),
+            id_(-1),
             is_metapackage_(false)
     {
       is_wet_package_ = manifest_name_ == ROSPACKAGE_MANIFEST_NAME;
@@ -178,25 +208,33 @@ class Stackage
       assert(is_wet_package_);
       assert(manifest_loaded_);
       // get name from package.xml instead of folder name
-      tinyxml2::XMLElement* root = get_manifest_root(this);
-      for(tinyxml2::XMLElement* el = root->FirstChildElement("name"); el; el = el->NextSiblingElement("name"))
+      const std::vector<ManifestElement>& elements = get_manifest_elements(this);
+      for(std::vector<ManifestElement>::const_iterator el = elements.begin(); el != elements.end(); ++el)
       {
-        name_ = el->GetText();
+        if(el->tag_ != "name")
+          continue;
+        name_ = el->text();
         break;
       }
       // Get license texts, where there may be multiple elements for.
       std::string tagname_license = "license";
-      for(tinyxml2::XMLElement* el = root->FirstChildElement(tagname_license.c_str()); el; el = el->NextSiblingElement(tagname_license.c_str()))
+      for(std::vector<ManifestElement>::const_iterator el = elements.begin(); el != elements.end(); ++el)
       {
-        licenses_.push_back(el->GetText());
+        if(el->tag_ == tagname_license)
+          licenses_.push_back(el->text());
       }
       // check if package is a metapackage
-      for(tinyxml2::XMLElement* el = root->FirstChildElement("export"); el; el = el->NextSiblingElement("export"))
+      for(std::vector<ManifestElement>::const_iterator el = elements.begin(); el != elements.end() && !is_metapackage_; ++el)
       {
-        if(el->FirstChildElement("metapackage"))
+        if(el->tag_ != "export")
+          continue;
+        for(std::vector<ManifestElement>::const_iterator el2 = el->children_.begin(); el2 != el->children_.end(); ++el2)
         {
-          is_metapackage_ = true;
-          break;
+          if(el2->tag_ == "metapackage")
+          {
+            is_metapackage_ = true;
+            break;
+          }
         }
       }
     }
@@ -236,6 +274,76 @@ bool cmpDirectoryCrawlRecord(DirectoryCrawlRecord* i,
   return (i->crawl_time_ < j->crawl_time_);
 }
 
+// One directory visited during a crawl.  Worker threads fill these in;
+// afterward they're walked depth-first, in directory order, to register
+// stackages exactly as a single-threaded recursive crawl would.
+class CrawlNode
+{
+  public:
+    std::string path_;
+    int depth_;
+    // \brief the parent directory, open until this node has been listed
+    DirectoryHandlePtr parent_;
+    // \brief the last component of path_
+    std::string name_;
+    // \brief the directory itself, if it was opened ahead of time
+    DirectoryHandlePtr preopened_;
+    // \brief the directory contains a manifest; stop here
+    bool is_stackage_;
+    // \brief if is_stackage_, the name of the manifest that was found
+    std::string manifest_name_;
+    // \brief if the manifest is a package.xml, it's parsed as soon as it's
+    // found, unless the last crawl's stackage can be used again; parsed_
+    // says whether that was done (and succeeded)
+    bool parsed_;
+    std::vector<ManifestElement> elements_;
+    FileStamp manifest_stamp_;
+    bool manifest_stamped_;
+    // \brief the directory's stamp and DirectoryListing flags, and whether
+    // they (and children_) may go into the directory index
+    FileStamp stamp_;
+    int flags_;
+    bool indexable_;
+    // \brief the listing came from the directory index
+    bool from_index_;
+    // \brief the directory was read (or found unchanged in the index)
+    bool listed_;
+    // \brief the directory's subdirectories were listed into children_
+    bool descended_;
+    // \brief time spent looking at this directory (not its children)
+    double crawl_time_;
+    // \brief warnings to be logged when the node is committed
+    std::vector<std::string> warnings_;
+    std::vector<CrawlNode*> children_;
+
+    CrawlNode(const std::string& path,
+              int depth,
+              const DirectoryHandlePtr& parent = DirectoryHandlePtr(),
+              const std::string& name = std::string(),
+              const DirectoryHandlePtr& preopened = DirectoryHandlePtr()) :
+            path_(path),
+            depth_(depth),
+            parent_(parent),
+            name_(name),
+            preopened_(preopened),
+            is_stackage_(false),
+            parsed_(false),
+            manifest_stamped_(false),
+            flags_(0),
+            indexable_(false),
+            from_index_(false),
+            listed_(false),
+            descended_(false),
+            crawl_time_(0.0) {}
+    ~CrawlNode()
+    {
+      for(std::vector<CrawlNode*>::const_iterator it = children_.begin();
+          it != children_.end();
+          ++it)
+        delete *it;
+    }
+};
+
 /////////////////////////////////////////////////////////////
 // Rosstackage methods (public/protected)
 /////////////////////////////////////////////////////////////
@@ -247,17 +355,24 @@ Rosstackage::Rosstackage(const std::string& manifest_name,
         cache_prefix_(cache_prefix),
         crawled_(false),
         name_(name),
-        tag_(tag)
+        tag_(tag),
+        graph_(new DependencyGraph()),
+        rosdep_view_loaded_(false)
 {
 }
 
 Rosstackage::~Rosstackage()
 {
   clearStackages();
+  if(sys_packages_ && sys_packages_->dirty())
+    sys_packages_->save();
+  if(export_cache_ && export_cache_->dirty())
+    export_cache_->save();
 }
 
 void Rosstackage::clearStackages()
 {
+  clearGraph();
   for(boost::unordered_map<std::string, Stackage*>::const_iterator it = stackages_.begin();
       it != stackages_.end();
       ++it)
@@ -266,6 +381,74 @@ void Rosstackage::clearStackages()
   }
   stackages_.clear();
   dups_.clear();
+  for(boost::unordered_map<std::string, Stackage*>::const_iterator it = reusable_.begin();
+      it != reusable_.end();
+      ++it)
+  {
+    delete it->second;
+  }
+  reusable_.clear();
+}
+
+// Clear internal storage, except that stackages whose manifests have been
+// parsed are set aside for addStackage() and addShardStackages() to pick up
+// again if their manifests haven't changed
+void Rosstackage::setAsideStackages()
+{
+  clearGraph();
+  for(boost::unordered_map<std::string, Stackage*>::const_iterator it = stackages_.begin();
+      it != stackages_.end();
+      ++it)
+  {
+    Stackage* stackage = it->second;
+    if(stackage->manifest_stamped_ && !reusable_.count(stackage->path_))
+      reusable_[stackage->path_] = stackage;
+    else
+      delete stackage;
+  }
+  stackages_.clear();
+  dups_.clear();
+}
+
+void Rosstackage::clearReusable()
+{
+  for(boost::unordered_map<std::string, Stackage*>::const_iterator it = reusable_.begin();
+      it != reusable_.end();
+      ++it)
+  {
+    delete it->second;
+  }
+  reusable_.clear();
+}
+
+void Rosstackage::forgetCrawl()
+{
+  setAsideStackages();
+  search_paths_.clear();
+  crawled_ = false;
+}
+
+// Dependencies point at other stackages, which may not survive, so the graph
+// is dropped whenever the set of stackages changes
+void Rosstackage::clearGraph()
+{
+  for(size_t i = 0; i < graph_->size(); i++)
+  {
+    Stackage* stackage = graph_->node((int)i);
+    // Stand-ins for missing dependencies belong to the graph
+    if(stackage->path_.empty())
+      delete stackage;
+    else
+      stackage->id_ = -1;
+  }
+  graph_->clear();
+}
+
+int Rosstackage::graphId(Stackage* stackage)
+{
+  if(stackage->id_ < 0)
+    stackage->id_ = graph_->addNode(stackage);
+  return stackage->id_;
 }
 
 void
@@ -315,8 +498,13 @@ Rosstackage::setQuiet(bool quiet)
   quiet_ = quiet;
 }
 
-bool
-Rosstackage::isStackage(const std::string& path)
+// Does the directory at path contain a manifest_name or package.xml
+// file?  Problems are appended to warnings rather than logged, so that
+// this can be called from crawler threads.
+static bool
+containsManifest(const std::string& path,
+                 const std::string& manifest_name,
+                 std::vector<std::string>& warnings)
 {
   try
   {
@@ -325,7 +513,7 @@ Rosstackage::isStackage(const std::string& path)
   }
   catch(fs::filesystem_error& e)
   {
-    logWarn(std::string("error while looking at ") + path + ": " + e.what());
+    warnings.push_back(std::string("error while looking at ") + path + ": " + e.what());
     return false;
   }
 
@@ -338,7 +526,7 @@ Rosstackage::isStackage(const std::string& path)
       if(!fs::is_regular_file(dit->path()))
         continue;
 
-      if(dit->path().filename() == manifest_name_)
+      if(dit->path().filename() == manifest_name)
         return true;
 
       // finding a package.xml is acceptable
@@ -352,22 +540,51 @@ Rosstackage::isStackage(const std::string& path)
     // due to missing permission
     if(e.code().value() != EACCES)
     {
-      logWarn(std::string("error while crawling ") + path + ": " + e.what() + ";  " + e.code().message());
+      warnings.push_back(std::string("error while crawling ") + path + ": " + e.what() + ";  " + e.code().message());
     }
   }
   return false;
 }
 
+bool
+Rosstackage::isStackage(const std::string& path)
+{
+  std::vector<std::string> warnings;
+  bool found = containsManifest(path, manifest_name_, warnings);
+  for(std::vector<std::string>::const_iterator it = warnings.begin();
+      it != warnings.end();
+      ++it)
+    logWarn(*it);
+  return found;
+}
+
+// A stackage whose manifest will be loaded from a binary cache record,
+// which must be stamped
+static Stackage*
+newCachedStackage(const BinaryCachePtr& cache, size_t i)
+{
+  Stackage* stackage = new Stackage(cache->name(i), cache->path(i),
+                                    cache->manifestPath(i),
+                                    cache->manifestName(i));
+  stackage->is_metapackage_ = (cache->flags(i) & BinaryCache::METAPACKAGE) != 0;
+  stackage->manifest_stamp_ = cache->manifestStamp(i);
+  stackage->manifest_stamped_ = true;
+  stackage->cache_ = cache;
+  stackage->cache_index_ = i;
+  return stackage;
+}
+
 void
 Rosstackage::crawl(std::vector<std::string> search_path,
                    bool force)
 {
+  boost::scoped_ptr<FileLock> cache_lock;
   if(!force)
   {
     bool same_search_paths = (search_path == search_paths_);
 
     // if search paths differ, try to reading the cache corresponding to the new paths
-    if(!same_search_paths && readCache())
+    if(!same_search_paths && readCache(search_path))
     {
       // If the cache was valid, then the paths in the cache match the ones
       // we've been asked to crawl.  Store them, so that later, methods
@@ -378,19 +595,53 @@ Rosstackage::crawl(std::vector<std::string> search_path,
 
     if(crawled_ && same_search_paths)
       return;
+
+    // The cache is out of date.  If another process is already rebuilding
+    // it (e.g., when a parallel build starts many of us at once), wait for
+    // that and read what it wrote instead of crawling as well.  Even if
+    // the lock is free, the cache is read again once we have it, since
+    // whoever held it may have written the cache since we looked.  We hold
+    // on to the lock while we crawl and write the cache ourselves.
+    std::string cache_path = getCachePath();
+    if(!same_search_paths && cache_path.size() && cacheMaxAge() != 0.0)
+    {
+      cache_lock.reset(new FileLock(cache_path + CACHE_LOCK_SUFFIX));
+      if((cache_lock->tryLock() || cache_lock->lock(CACHE_LOCK_TIMEOUT)) &&
+         readCache(search_path))
+      {
+        search_paths_ = search_path;
+        return;
+      }
+    }
   }
 
   // We're about to crawl, so clear internal storage (in case this is the second
-  // run in this process).
-  clearStackages();
+  // run in this process).  Stackages whose manifests we've already parsed
+  // are set aside, to be picked up again if the crawl finds them unchanged.
+  setAsideStackages();
   search_paths_ = search_path;
 
+  // So can those in the cache's shards, even if they're too old to say
+  // which stackages there are
+  for(std::vector<std::string>::const_iterator it = search_path.begin();
+      it != search_path.end();
+      ++it)
+  {
+    BinaryCachePtr shard(new BinaryCache());
+    if(!shard->open(getShardPath(*it) + BINARY_CACHE_SUFFIX))
+      continue;
+    for(size_t i = 0; i < shard->size(); i++)
+    {
+      if((shard->flags(i) & BinaryCache::STAMPED) &&
+         !reusable_.count(shard->path(i)))
+        reusable_[shard->path(i)] = newCachedStackage(shard, i);
+    }
+  }
+
   std::vector<DirectoryCrawlRecord*> dummy;
   boost::unordered_set<std::string> dummy2;
-  for(std::vector<std::string>::const_iterator p = search_paths_.begin();
-      p != search_paths_.end();
-      ++p)
-    crawlDetail(*p, force, 1, false, dummy, dummy2);
+  crawlDetail(search_paths_, force, 1, false, dummy, dummy2);
+  clearReusable();
 
   crawled_ = true;
 
@@ -591,6 +842,43 @@ Rosstackage::depsOn(const std::string& name, bool direct,
   return true;
 }
 
+bool
+Rosstackage::dependsOn(const std::string& name, const std::string& dep,
+                       bool& depends)
+{
+  Stackage* stackage = findWithRecrawl(name);
+  if(!stackage)
+    return false;
+  Stackage* dep_stackage = findWithRecrawl(dep);
+  if(!dep_stackage)
+    return false;
+  try
+  {
+    computeDeps(stackage);
+    int id = graphId(stackage);
+    // Fail just as deps() would
+    checkDepsDepth(id, 0, false);
+    if(graph_->buildClosure())
+    {
+      // Numbering dep now would change the graph, and it can't be reached
+      // anyway if it hasn't been numbered
+      depends = dep_stackage->id_ >= 0 && graph_->reaches(id, dep_stackage->id_);
+    }
+    else
+    {
+      std::vector<Stackage*> deps_vec;
+      gatherDeps(stackage, false, POSTORDER, deps_vec);
+      depends = std::find(deps_vec.begin(), deps_vec.end(), dep_stackage) != deps_vec.end();
+    }
+  }
+  catch(Exception& e)
+  {
+    logError(e.what());
+    return false;
+  }
+  return true;
+}
+
 bool
 Rosstackage::depsIndent(const std::string& name, bool direct,
                         std::vector<std::string>& deps)
@@ -602,9 +890,8 @@ Rosstackage::depsIndent(const std::string& name, bool direct,
   {
     computeDeps(stackage);
     std::vector<Stackage*> deps_vec;
-    boost::unordered_set<Stackage*> deps_hash;
     std::vector<std::string> indented_deps;
-    gatherDepsFull(stackage, direct, POSTORDER, 0, deps_hash, deps_vec, true, indented_deps);
+    gatherDepsFull(stackage, direct, POSTORDER, 0, deps_vec, true, indented_deps);
     for(std::vector<std::string>::const_iterator it = indented_deps.begin();
         it != indented_deps.end();
         ++it)
@@ -618,10 +905,86 @@ Rosstackage::depsIndent(const std::string& name, bool direct,
   return true;
 }
 
+static void
+_appendDepsChain(const DependencyGraph& graph, const std::vector<int>& chain,
+                 std::string& output)
+{
+  output.append("* ");
+  for(std::vector<int>::const_iterator it = chain.begin();
+      it != chain.end();
+      ++it)
+  {
+    if(it != chain.begin())
+      output.append("-> ");
+    output.append(graph.node(*it)->name_ + " ");
+  }
+  output.append("\n");
+}
+
+// Append the chains from the end of chain to to, in depth-first order,
+// stepping only on stackages that lead to to, until paths_left (if not
+// negative) runs out.  Each step leads to at least one chain, so the work
+// done is proportional to the length of the output.
+static void
+_depsWhyChains(const DependencyGraph& graph, int to,
+               const std::vector<char>& leads_to,
+               std::vector<int>& chain, int& paths_left,
+               std::string& output)
+{
+  int id = chain.back();
+  for(size_t i = graph.edgesBegin(id); i != graph.edgesEnd(id) && paths_left != 0; ++i)
+  {
+    int dep_id = graph.edge(i);
+    if(dep_id != to && !leads_to[dep_id])
+      continue;
+    chain.push_back(dep_id);
+    if(dep_id == to)
+    {
+      _appendDepsChain(graph, chain, output);
+      if(paths_left > 0)
+        paths_left--;
+    }
+    else
+      _depsWhyChains(graph, to, leads_to, chain, paths_left, output);
+    chain.pop_back();
+  }
+}
+
+// Count the chains from id to to, remembering each stackage's count in
+// counts once counted is set
+static boost::uint64_t
+_depsWhyCount(const DependencyGraph& graph, int id, int to,
+              const std::vector<char>& leads_to,
+              std::vector<char>& counted,
+              std::vector<boost::uint64_t>& counts)
+{
+  if(counted[id])
+    return counts[id];
+  const boost::uint64_t max_count = ~(boost::uint64_t)0;
+  boost::uint64_t count = 0;
+  for(size_t i = graph.edgesBegin(id); i != graph.edgesEnd(id); ++i)
+  {
+    int dep_id = graph.edge(i);
+    boost::uint64_t dep_count;
+    if(dep_id == to)
+      dep_count = 1;
+    else if(leads_to[dep_id])
+      dep_count = _depsWhyCount(graph, dep_id, to, leads_to, counted, counts);
+    else
+      continue;
+    count = dep_count > max_count - count ? max_count : count + dep_count;
+  }
+  counted[id] = 1;
+  counts[id] = count;
+  return count;
+}
+
 bool
 Rosstackage::depsWhy(const std::string& from,
                      const std::string& to,
-                     std::string& output)
+                     std::string& output,
+                     bool shortest,
+                     int max_paths)
 {
   Stackage* from_s = findWithRecrawl(from);
   if(!from_s)
@@ -630,32 +993,82 @@ Rosstackage::depsWhy(const std::string& from,
   if(!to_s)
     return false;
 
-  std::list<std::list<Stackage*> > acc_list;
+  std::vector<char> leads_to;
+  int from_id;
   try
   {
-    depsWhyDetail(from_s, to_s, acc_list);
+    from_id = depsWhyDetail(from_s, to_s, leads_to);
   }
   catch(Exception& e)
   {
     logError(e.what());
-    return true;
+    return false;
   }
   output.append(std::string("Dependency chains from ") +
                 from + " to " + to + ":\n");
-  for(std::list<std::list<Stackage*> >::const_iterator it = acc_list.begin();
-      it != acc_list.end();
-      ++it)
+  std::vector<int> chain(1, from_id);
+  if(shortest)
   {
-    output.append("* ");
-    for(std::list<Stackage*>::const_iterator iit = it->begin();
-        iit != it->end();
-        ++iit)
+    // Breadth-first, remembering how each stackage was reached, until the
+    // first edge to to
+    std::vector<int> parents(graph_->size(), -1);
+    std::vector<int> queue(1, from_id);
+    parents[from_id] = from_id;
+    for(size_t q = 0; q < queue.size(); q++)
     {
-      if(iit != it->begin())
-        output.append("-> ");
-      output.append((*iit)->name_ + " ");
+      int id = queue[q];
+      for(size_t i = graph_->edgesBegin(id); i != graph_->edgesEnd(id); ++i)
+      {
+        int dep_id = graph_->edge(i);
+        if(dep_id == to_s->id_)
+        {
+          chain.clear();
+          chain.push_back(dep_id);
+          for(; id != from_id; id = parents[id])
+            chain.push_back(id);
+          chain.push_back(from_id);
+          std::reverse(chain.begin(), chain.end());
+          _appendDepsChain(*graph_, chain, output);
+          return true;
+        }
+        if(leads_to[dep_id] && parents[dep_id] < 0)
+        {
+          parents[dep_id] = id;
+          queue.push_back(dep_id);
+        }
+      }
     }
-    output.append("\n");
+    return true;
+  }
+  _depsWhyChains(*graph_, to_s->id_, leads_to, chain, max_paths, output);
+  return true;
+}
+
+bool
+Rosstackage::depsWhyCount(const std::string& from,
+                          const std::string& to,
+                          boost::uint64_t& count)
+{
+  Stackage* from_s = findWithRecrawl(from);
+  if(!from_s)
+    return false;
+  Stackage* to_s = findWithRecrawl(to);
+  if(!to_s)
+    return false;
+
+  try
+  {
+    std::vector<char> leads_to;
+    int from_id = depsWhyDetail(from_s, to_s, leads_to);
+    std::vector<char> counted(graph_->size(), 0);
+    std::vector<boost::uint64_t> counts(graph_->size(), 0);
+    count = _depsWhyCount(*graph_, from_id, to_s->id_, leads_to, counted,
+                          counts);
+  }
+  catch(Exception& e)
+  {
+    logError(e.what());
+    return false;
   }
   return true;
 }
@@ -700,27 +1113,29 @@ Rosstackage::rosdeps(const std::string& name, bool direct,
     deps_vec.push_back(stackage);
     if(!direct)
       gatherDeps(stackage, direct, POSTORDER, deps_vec);
-    for(std::vector<Stackage*>::const_iterator it = deps_vec.begin();
-        it != deps_vec.end();
-        ++it)
+    if (!stackage->is_wet_package_)
     {
-      if (!stackage->is_wet_package_)
-      {
+      for(std::vector<Stackage*>::const_iterator it = deps_vec.begin();
+          it != deps_vec.end();
+          ++it)
         _rosdeps(*it, rosdeps, MANIFEST_TAG_ROSDEP);
-      }
-      else
+    }
+    else
+    {
+      // Read each manifest once for all of the dependency tags, and then
+      // ask about all of the names at once
+      std::vector<std::string> pkgnames;
+      for(std::vector<Stackage*>::const_iterator it = deps_vec.begin();
+          it != deps_vec.end();
+          ++it)
+        _wetRosdeps(*it, rosdeps, pkgnames);
+      lookupSysPackages(pkgnames);
+      for(std::vector<std::string>::const_iterator it = pkgnames.begin();
+          it != pkgnames.end();
+          ++it)
       {
-        // package format 1 tags
-        _rosdeps(*it, rosdeps, "build_depend");
-        _rosdeps(*it, rosdeps, "buildtool_depend");
-        _rosdeps(*it, rosdeps, "run_depend");
-        // package format 2 tags
-        _rosdeps(*it, rosdeps, "build_export_depend");
-        _rosdeps(*it, rosdeps, "buildtool_export_depend");
-        _rosdeps(*it, rosdeps, "exec_depend");
-        _rosdeps(*it, rosdeps, "depend");
-        _rosdeps(*it, rosdeps, "doc_depend");
-        _rosdeps(*it, rosdeps, "test_depend");
+        if(isSysPackage(*it))
+          rosdeps.insert(std::string("name: ") + *it);
       }
     }
   }
@@ -735,22 +1150,24 @@ Rosstackage::rosdeps(const std::string& name, bool direct,
 void
 Rosstackage::_rosdeps(Stackage* stackage, std::set<std::string>& rosdeps, const char* tag_name)
 {
-  tinyxml2::XMLElement* root = get_manifest_root(stackage);
-  for(tinyxml2::XMLElement* ele = root->FirstChildElement(tag_name);
-      ele;
-      ele = ele->NextSiblingElement(tag_name))
+  const std::vector<ManifestElement>& elements = get_manifest_elements(stackage);
+  for(std::vector<ManifestElement>::const_iterator ele = elements.begin();
+      ele != elements.end();
+      ++ele)
   {
+    if(ele->tag_ != tag_name)
+      continue;
     if(!stackage->is_wet_package_)
     {
       const char *att_str;
-      if((att_str = ele->Attribute(MANIFEST_ATTR_NAME)))
+      if((att_str = ele->attribute(MANIFEST_ATTR_NAME)))
       {
         rosdeps.insert(std::string("name: ") + att_str);
       }
     }
     else
     {
-      const char* dep_pkgname = ele->GetText();
+      const char* dep_pkgname = ele->text();
       if(isSysPackage(dep_pkgname))
       {
         rosdeps.insert(std::string("name: ") + dep_pkgname);
@@ -759,6 +1176,54 @@ Rosstackage::_rosdeps(Stackage* stackage, std::set<std::string>& rosdeps, const
   }
 }
 
+// The tags that rosdeps of wet packages come from
+static const char* WET_ROSDEP_TAGS[] =
+{
+  // package format 1 tags
+  "build_depend",
+  "buildtool_depend",
+  "run_depend",
+  // package format 2 tags
+  "build_export_depend",
+  "buildtool_export_depend",
+  "exec_depend",
+  "depend",
+  "doc_depend",
+  "test_depend"
+};
+
+// What _rosdeps() would find under each of WET_ROSDEP_TAGS, in one pass
+// over the manifest, except that the names from wet manifests are added to
+// pkgnames to be looked up instead of being looked up here
+void
+Rosstackage::_wetRosdeps(Stackage* stackage, std::set<std::string>& rosdeps,
+                         std::vector<std::string>& pkgnames)
+{
+  const std::vector<ManifestElement>& elements = get_manifest_elements(stackage);
+  const char** tags_end = WET_ROSDEP_TAGS +
+    sizeof(WET_ROSDEP_TAGS) / sizeof(WET_ROSDEP_TAGS[0]);
+  for(std::vector<ManifestElement>::const_iterator ele = elements.begin();
+      ele != elements.end();
+      ++ele)
+  {
+    bool is_rosdep_tag = false;
+    for(const char** tag = WET_ROSDEP_TAGS; tag != tags_end && !is_rosdep_tag; ++tag)
+      is_rosdep_tag = (ele->tag_ == *tag);
+    if(!is_rosdep_tag)
+      continue;
+    if(!stackage->is_wet_package_)
+    {
+      const char *att_str;
+      if((att_str = ele->attribute(MANIFEST_ATTR_NAME)))
+      {
+        rosdeps.insert(std::string("name: ") + att_str);
+      }
+    }
+    else if(const char* dep_pkgname = ele->text())
+      pkgnames.push_back(dep_pkgname);
+  }
+}
+
 bool
 Rosstackage::vcs(const std::string& name, bool direct,
                  std::vector<std::string>& vcs)
@@ -778,19 +1243,21 @@ Rosstackage::vcs(const std::string& name, bool direct,
         it != deps_vec.end();
         ++it)
     {
-      tinyxml2::XMLElement* root = get_manifest_root(*it);
-      for(tinyxml2::XMLElement* ele = root->FirstChildElement(MANIFEST_TAG_VERSIONCONTROL);
-          ele;
-          ele = ele->NextSiblingElement(MANIFEST_TAG_VERSIONCONTROL))
+      const std::vector<ManifestElement>& elements = get_manifest_elements(*it);
+      for(std::vector<ManifestElement>::const_iterator ele = elements.begin();
+          ele != elements.end();
+          ++ele)
       {
+        if(ele->tag_ != MANIFEST_TAG_VERSIONCONTROL)
+          continue;
         std::string result;
         const char *att_str;
-        if((att_str = ele->Attribute(MANIFEST_ATTR_TYPE)))
+        if((att_str = ele->attribute(MANIFEST_ATTR_TYPE)))
         {
           result.append("type: ");
           result.append(att_str);
         }
-        if((att_str = ele->Attribute(MANIFEST_ATTR_URL)))
+        if((att_str = ele->attribute(MANIFEST_ATTR_URL)))
         {
           result.append("\turl: ");
           result.append(att_str);
@@ -807,6 +1274,29 @@ Rosstackage::vcs(const std::string& name, bool direct,
   return true;
 }
 
+// How running the command of an export string, or a call to pkg-config,
+// went
+enum ExportCommandStatus
+{
+  EXPORT_COMMAND_OK,
+  EXPORT_COMMAND_NOT_STARTED,
+  EXPORT_COMMAND_FAILED
+};
+
+// Forgets what prefetchExports() ran for a query once the query is done
+class PrefetchScope
+{
+  public:
+    PrefetchScope(boost::unordered_map<std::string, std::pair<int, std::string> >& expansions) :
+            expansions_(expansions) {}
+    ~PrefetchScope()
+    {
+      expansions_.clear();
+    }
+  private:
+    boost::unordered_map<std::string, std::pair<int, std::string> >& expansions_;
+};
+
 bool
 Rosstackage::cpp_exports(const std::string& name, const std::string& type,
                      const std::string& attrib, bool deps_only,
@@ -822,6 +1312,11 @@ Rosstackage::cpp_exports(const std::string& name, const std::string& type,
   static PyObject* pDict;
   static PyObject* pFunc;
 
+  // Wet packages' flags are worked out from their .pc files where that
+  // gives what pkg-config would print, reading each file once per query
+  boost::scoped_ptr<PkgConfig> pkg_config;
+  bool pkg_config_checked = false;
+
   try
   {
     computeDeps(stackage);
@@ -829,6 +1324,49 @@ Rosstackage::cpp_exports(const std::string& name, const std::string& type,
     if(!deps_only)
       deps_vec.push_back(stackage);
     gatherDeps(stackage, false, PREORDER, deps_vec, true);
+
+    // Work out what can be worked out in process first, and then run
+    // everything that takes a shell or pkg-config together
+    std::vector<std::pair<Stackage*, std::string> > strings;
+    std::vector<std::string> pkg_config_names;
+    boost::unordered_map<std::string, std::pair<int, std::string> > pkg_config_flags;
+    for(std::vector<Stackage*>::const_iterator it = deps_vec.begin();
+        it != deps_vec.end();
+        ++it)
+    {
+      if(!(*it)->is_wet_package_)
+      {
+        std::vector<std::string> dry_strings;
+        exportStrings(*it, "cpp", attrib, dry_strings, false);
+        for(std::vector<std::string>::const_iterator it2 = dry_strings.begin();
+            it2 != dry_strings.end();
+            ++it2)
+          strings.push_back(std::make_pair(*it, *it2));
+        continue;
+      }
+      if(!pkg_config_checked)
+      {
+        pkg_config_checked = true;
+        std::vector<std::string> search_path;
+        bool search_path_complete;
+        std::string pkg_config_path;
+        if(PkgConfig::searchPathFromEnvironment(search_path,
+                                                search_path_complete,
+                                                pkg_config_path))
+          pkg_config.reset(new PkgConfig(search_path,
+                                         search_path_complete,
+                                         pkg_config_path,
+                                         getExportCache()));
+      }
+      std::string pc_flags;
+      if(pkg_config && pkg_config->query(type, (*it)->name_, pc_flags))
+        pkg_config_flags[(*it)->name_] = std::make_pair(EXPORT_COMMAND_OK, pc_flags);
+      else
+        pkg_config_names.push_back((*it)->name_);
+    }
+    PrefetchScope prefetched(expansions_);
+    prefetchExports(strings, type, pkg_config_names, pkg_config_flags);
+
     for(std::vector<Stackage*>::const_iterator it = deps_vec.begin();
         it != deps_vec.end();
         ++it)
@@ -847,6 +1385,17 @@ Rosstackage::cpp_exports(const std::string& name, const std::string& type,
       }
       else
       {
+        std::string pc_failed = "python function 'rosdep2.rospack.call_pkg_config' could not call 'pkg-config " + type + " " + (*it)->name_ + "' without errors";
+        boost::unordered_map<std::string, std::pair<int, std::string> >::const_iterator pc_flags =
+                pkg_config_flags.find((*it)->name_);
+        if(pc_flags != pkg_config_flags.end())
+        {
+          if(pc_flags->second.first != EXPORT_COMMAND_OK)
+            throw Exception(pc_failed);
+          flags.push_back(std::pair<std::string, bool>(pc_flags->second.second, true));
+          continue;
+        }
+
         initPython();
         PyGILState_STATE gstate = PyGILState_Ensure();
 
@@ -892,8 +1441,7 @@ Rosstackage::cpp_exports(const std::string& name, const std::string& type,
         if(pValue == Py_None)
         {
           Py_DECREF(pValue);
-          std::string errmsg = "python function 'rosdep2.rospack.call_pkg_config' could not call 'pkg-config " + type + " " + (*it)->name_ + "' without errors";
-          throw Exception(errmsg);
+          throw Exception(pc_failed);
         }
 
         flags.push_back(std::pair<std::string, bool>(PyBytes_AsString(pValue), true));
@@ -920,6 +1468,18 @@ Rosstackage::cpp_exports(const std::string& name, const std::string& type,
 
 bool
 Rosstackage::reorder_paths(const std::string& paths, std::string& reordered)
+{
+  // ROS_REORDER_PATHS=python leaves the ordering to catkin_pkg, as before
+  const char* impl = getenv("ROS_REORDER_PATHS");
+  if(!(impl && !strcmp(impl, "python")) &&
+     reorder_paths_by_workspace(paths, reordered))
+    return true;
+  return reorderPathsPython(paths, reordered);
+}
+
+bool
+Rosstackage::reorderPathsPython(const std::string& paths,
+                                std::string& reordered)
 {
   static bool init_py = false;
   static PyObject* pName;
@@ -997,6 +1557,22 @@ Rosstackage::exports(const std::string& name, const std::string& lang,
     if(!deps_only)
       deps_vec.push_back(stackage);
     gatherDeps(stackage, false, PREORDER, deps_vec);
+    std::vector<std::pair<Stackage*, std::string> > strings;
+    for(std::vector<Stackage*>::const_iterator it = deps_vec.begin();
+        it != deps_vec.end();
+        ++it)
+    {
+      std::vector<std::string> dry_strings;
+      exportStrings(*it, lang, attrib, dry_strings, false);
+      for(std::vector<std::string>::const_iterator it2 = dry_strings.begin();
+          it2 != dry_strings.end();
+          ++it2)
+        strings.push_back(std::make_pair(*it, *it2));
+    }
+    PrefetchScope prefetched(expansions_);
+    boost::unordered_map<std::string, std::pair<int, std::string> > pkg_config_flags;
+    prefetchExports(strings, std::string(), std::vector<std::string>(),
+                    pkg_config_flags);
     for(std::vector<Stackage*>::const_iterator it = deps_vec.begin();
         it != deps_vec.end();
         ++it)
@@ -1015,32 +1591,41 @@ Rosstackage::exports(const std::string& name, const std::string& lang,
   return true;
 }
 
-bool
-Rosstackage::exports_dry_package(Stackage* stackage, const std::string& lang,
-                     const std::string& attrib,
-                     std::vector<std::string>& flags)
+// The attrib attribute of the lang tag in each export block of stackage:
+// the one for this OS if there is one, otherwise the first.
+void
+Rosstackage::exportStrings(Stackage* stackage, const std::string& lang,
+                           const std::string& attrib,
+                           std::vector<std::string>& strings, bool warn)
 {
-  tinyxml2::XMLElement* root = get_manifest_root(stackage);
-  for(tinyxml2::XMLElement* ele = root->FirstChildElement(MANIFEST_TAG_EXPORT);
-      ele;
-      ele = ele->NextSiblingElement(MANIFEST_TAG_EXPORT))
+  const std::vector<ManifestElement>& elements = get_manifest_elements(stackage);
+  for(std::vector<ManifestElement>::const_iterator ele = elements.begin();
+      ele != elements.end();
+      ++ele)
   {
+    if(ele->tag_ != MANIFEST_TAG_EXPORT)
+      continue;
     bool os_match = false;
     const char *best_match = NULL;
-    for(tinyxml2::XMLElement* ele2 = ele->FirstChildElement(lang.c_str());
-        ele2;
-        ele2 = ele2->NextSiblingElement(lang.c_str()))
+    for(std::vector<ManifestElement>::const_iterator ele2 = ele->children_.begin();
+        ele2 != ele->children_.end();
+        ++ele2)
     {
+      if(ele2->tag_ != lang)
+        continue;
       const char *os_str;
-      if ((os_str = ele2->Attribute("os")))
+      if ((os_str = ele2->attribute("os")))
       {
         if(g_ros_os == std::string(os_str))
         {
           if(os_match)
-            logWarn(std::string("ignoring duplicate ") + lang + " tag with os=" + os_str + " in export block");
+          {
+            if(warn)
+              logWarn(std::string("ignoring duplicate ") + lang + " tag with os=" + os_str + " in export block");
+          }
           else
           {
-            best_match = ele2->Attribute(attrib.c_str());
+            best_match = ele2->attribute(attrib);
             os_match = true;
           }
         }
@@ -1048,19 +1633,32 @@ Rosstackage::exports_dry_package(Stackage* stackage, const std::string& lang,
       if(!os_match)
       {
         if(!best_match)
-          best_match = ele2->Attribute(attrib.c_str());
-        else
+          best_match = ele2->attribute(attrib);
+        else if(warn)
           logWarn(std::string("ignoring duplicate ") + lang + " tag in export block");
       }
 
     }
     if(best_match)
-    {
-      std::string expanded_str;
-      if(!expandExportString(stackage, best_match, expanded_str))
-        return false;
-      flags.push_back(expanded_str);
-    }
+      strings.push_back(best_match);
+  }
+}
+
+bool
+Rosstackage::exports_dry_package(Stackage* stackage, const std::string& lang,
+                     const std::string& attrib,
+                     std::vector<std::string>& flags)
+{
+  std::vector<std::string> strings;
+  exportStrings(stackage, lang, attrib, strings, true);
+  for(std::vector<std::string>::const_iterator it = strings.begin();
+      it != strings.end();
+      ++it)
+  {
+    std::string expanded_str;
+    if(!expandExportString(stackage, *it, expanded_str))
+      return false;
+    flags.push_back(expanded_str);
   }
   // We automatically point to msg_gen and msg_srv directories if
   // certain files are present.
@@ -1122,30 +1720,44 @@ Rosstackage::plugins(const std::string& name, const std::string& attrib,
     }
   }
   // Now go looking for the manifest data
+  std::vector<std::pair<Stackage*, std::string> > strings;
   for(std::vector<Stackage*>::const_iterator it = stackages.begin();
       it != stackages.end();
       ++it)
   {
-    tinyxml2::XMLElement* root = get_manifest_root(*it);
-    for(tinyxml2::XMLElement* ele = root->FirstChildElement(MANIFEST_TAG_EXPORT);
-        ele;
-        ele = ele->NextSiblingElement(MANIFEST_TAG_EXPORT))
+    const std::vector<ManifestElement>& elements = get_manifest_elements(*it);
+    for(std::vector<ManifestElement>::const_iterator ele = elements.begin();
+        ele != elements.end();
+        ++ele)
     {
-      for(tinyxml2::XMLElement* ele2 = ele->FirstChildElement(name.c_str());
-          ele2;
-          ele2 = ele2->NextSiblingElement(name.c_str()))
+      if(ele->tag_ != MANIFEST_TAG_EXPORT)
+        continue;
+      for(std::vector<ManifestElement>::const_iterator ele2 = ele->children_.begin();
+          ele2 != ele->children_.end();
+          ++ele2)
       {
+        if(ele2->tag_ != name)
+          continue;
         const char *att_str;
-        if((att_str = ele2->Attribute(attrib.c_str())))
-        {
-          std::string expanded_str;
-          if(!expandExportString(*it, att_str, expanded_str))
-            return false;
-          flags.push_back((*it)->name_ + " " + expanded_str);
-        }
+        if((att_str = ele2->attribute(attrib)))
+          strings.push_back(std::make_pair(*it, std::string(att_str)));
       }
     }
   }
+  // and expand it, running the commands in it together
+  PrefetchScope prefetched(expansions_);
+  boost::unordered_map<std::string, std::pair<int, std::string> > pkg_config_flags;
+  prefetchExports(strings, std::string(), std::vector<std::string>(),
+                  pkg_config_flags);
+  for(std::vector<std::pair<Stackage*, std::string> >::const_iterator it = strings.begin();
+      it != strings.end();
+      ++it)
+  {
+    std::string expanded_str;
+    if(!expandExportString(it->first, it->second, expanded_str))
+      return false;
+    flags.push_back(it->first->name_ + " " + expanded_str);
+  }
   return true;
 }
 
@@ -1251,36 +1863,68 @@ Rosstackage::depsDetail(const std::string& name, bool direct,
   return true;
 }
 
-void
+static const char VISIT_ON_CHAIN = 1;
+static const char VISIT_DONE = 2;
+
+// Throw the error for a cycle that the chains from the end of chain to to
+// would go round.  Cycles past to, or through stackages that don't lead to
+// to, don't matter, since the chains never step on them.
+static void
+_checkDepsWhyCycles(const DependencyGraph& graph, int to,
+                    const std::vector<char>& leads_to,
+                    std::vector<char>& visits,
+                    std::vector<int>& chain)
+{
+  int id = chain.back();
+  visits[id] = VISIT_ON_CHAIN;
+  for(size_t i = graph.edgesBegin(id); i != graph.edgesEnd(id); ++i)
+  {
+    int dep_id = graph.edge(i);
+    if(dep_id == to || !leads_to[dep_id] || visits[dep_id] == VISIT_DONE)
+      continue;
+    chain.push_back(dep_id);
+    if(visits[dep_id] == VISIT_ON_CHAIN)
+      throwDepthExceeded(graph, chain);
+    _checkDepsWhyCycles(graph, to, leads_to, visits, chain);
+    chain.pop_back();
+  }
+  visits[id] = VISIT_DONE;
+}
+
+// Work out which stackages have a chain of dependencies to to, after
+// computing from's dependencies.  Returns from's ID.
+int
 Rosstackage::depsWhyDetail(Stackage* from,
                            Stackage* to,
-                           std::list<std::list<Stackage*> >& acc_list)
+                           std::vector<char>& leads_to)
 {
   computeDeps(from);
-  for(std::vector<Stackage*>::const_iterator it = from->deps_.begin();
-      it != from->deps_.end();
-      ++it)
+  int from_id = graphId(from);
+  leads_to.assign(graph_->size(), 0);
+  if(to->id_ < 0)
+    return from_id;
+  std::vector<int> queue(1, to->id_);
+  for(size_t q = 0; q < queue.size(); q++)
   {
-    if((*it)->name_ == to->name_)
-    {
-      std::list<Stackage*> acc;
-      acc.push_back(from);
-      acc.push_back(to);
-      acc_list.push_back(acc);
-    }
-    else
+    for(size_t i = graph_->reverseBegin(queue[q]); i != graph_->reverseEnd(queue[q]); ++i)
     {
-      std::list<std::list<Stackage*> > l;
-      depsWhyDetail(*it, to, l);
-      for(std::list<std::list<Stackage*> >::iterator iit = l.begin();
-          iit != l.end();
-          ++iit)
+      int dep_id = graph_->reverseEdge(i);
+      if(!leads_to[dep_id])
       {
-        iit->push_front(from);
-        acc_list.push_back(*iit);
+        leads_to[dep_id] = 1;
+        queue.push_back(dep_id);
       }
     }
   }
+  // Chains can't be followed round a cycle, but only one that they would
+  // step on is an error
+  if(graph_->longestPath(from_id) < 0)
+  {
+    std::vector<char> visits(graph_->size(), 0);
+    std::vector<int> chain(1, from_id);
+    _checkDepsWhyCycles(*graph_, to->id_, leads_to, visits, chain);
+  }
+  return from_id;
 }
 
 bool
@@ -1296,24 +1940,68 @@ Rosstackage::depsOnDetail(const std::string& name, bool direct,
   }
   try
   {
+    if(!ignore_missing)
+    {
+      std::vector<Stackage*> roots;
+      for(boost::unordered_map<std::string, Stackage*>::const_iterator it = stackages_.begin();
+          it != stackages_.end();
+          ++it)
+        roots.push_back(it->second);
+      prefetchSysPackages(roots);
+    }
     for(boost::unordered_map<std::string, Stackage*>::const_iterator it = stackages_.begin();
         it != stackages_.end();
         ++it)
-    {
       computeDeps(it->second, true, ignore_missing);
-      std::vector<Stackage*> deps_vec;
-      gatherDeps(it->second, direct, POSTORDER, deps_vec);
-      for(std::vector<Stackage*>::const_iterator iit = deps_vec.begin();
-          iit != deps_vec.end();
-          ++iit)
+    int id = graphId(stackages_[name]);
+    // Mark the stackages that reach name along the reverse edges: one step
+    // of them, or all of them
+    std::vector<char> is_dep(graph_->size(), 0);
+    if(direct)
+    {
+      for(size_t i = graph_->reverseBegin(id); i != graph_->reverseEnd(id); ++i)
+        is_dep[graph_->reverseEdge(i)] = 1;
+    }
+    else
+    {
+      // Asking each stackage for all of its dependencies would fail on any
+      // whose dependencies run too deep, circular ones included, so report
+      // the first of those as usual
+      for(boost::unordered_map<std::string, Stackage*>::const_iterator it = stackages_.begin();
+          it != stackages_.end();
+          ++it)
+        checkDepsDepth(it->second->id_, 0, false);
+      if(graph_->buildClosure())
+      {
+        for(size_t i = 0; i < graph_->size(); i++)
+          is_dep[i] = graph_->reaches((int)i, id);
+      }
+      else
       {
-        if((*iit)->name_ == name)
+        std::vector<int> queue(1, id);
+        for(size_t q = 0; q < queue.size(); q++)
         {
-          deps.push_back(it->second);
-          break;
+          for(size_t i = graph_->reverseBegin(queue[q]); i != graph_->reverseEnd(queue[q]); ++i)
+          {
+            int from = graph_->reverseEdge(i);
+            if(!is_dep[from])
+            {
+              is_dep[from] = 1;
+              queue.push_back(from);
+            }
+          }
         }
       }
     }
+    // Report them in the order we'd have found them by checking each
+    // stackage's dependencies in turn
+    for(boost::unordered_map<std::string, Stackage*>::const_iterator it = stackages_.begin();
+        it != stackages_.end();
+        ++it)
+    {
+      if(is_dep[it->second->id_])
+        deps.push_back(it->second);
+    }
   }
   catch(Exception& e)
   {
@@ -1332,12 +2020,7 @@ Rosstackage::profile(const std::vector<std::string>& search_path,
   double start = time_since_epoch();
   std::vector<DirectoryCrawlRecord*> dcrs;
   boost::unordered_set<std::string> dcrs_hash;
-  for(std::vector<std::string>::const_iterator p = search_path.begin();
-      p != search_path.end();
-      ++p)
-  {
-    crawlDetail(*p, true, 1, true, dcrs, dcrs_hash);
-  }
+  crawlDetail(search_path, true, 1, true, dcrs, dcrs_hash);
   if(!zombie_only)
   {
     double total = time_since_epoch() - start;
@@ -1385,6 +2068,17 @@ Rosstackage::profile(const std::vector<std::string>& search_path,
 
 void
 Rosstackage::addStackage(const std::string& path)
+{
+  if(fs::is_regular_file(fs::path(path) / manifest_name_))
+    addStackage(path, manifest_name_);
+  else if(fs::is_regular_file(fs::path(path) / ROSPACKAGE_MANIFEST_NAME))
+    addStackage(path, ROSPACKAGE_MANIFEST_NAME);
+}
+
+void
+Rosstackage::addStackage(const std::string& path,
+                         const std::string& manifest_name,
+                         CrawlNode* crawled)
 {
 #if !defined(BOOST_FILESYSTEM_VERSION) || (BOOST_FILESYSTEM_VERSION == 2)
   std::string name = fs::path(path).filename();
@@ -1393,24 +2087,48 @@ Rosstackage::addStackage(const std::string& path)
   std::string name = fs::path(path).filename().string();
 #endif
 
-  Stackage* stackage = 0;
-  fs::path dry_manifest_path = fs::path(path) / manifest_name_;
-  fs::path wet_manifest_path = fs::path(path) / ROSPACKAGE_MANIFEST_NAME;
-  if(fs::is_regular_file(dry_manifest_path))
-  {
-    stackage = new Stackage(name, path, dry_manifest_path.string(), manifest_name_);
-  }
-  else if(fs::is_regular_file(wet_manifest_path))
+  // A stackage left over from the last crawl can be used again if its
+  // manifest hasn't changed
+  Stackage* stackage = NULL;
+  boost::unordered_map<std::string, Stackage*>::iterator reuse = reusable_.find(path);
+  if(reuse != reusable_.end())
   {
-    stackage = new Stackage(name, path, wet_manifest_path.string(), ROSPACKAGE_MANIFEST_NAME);
-    loadManifest(stackage);
-    stackage->update_wet_information();
+    FileStamp stamp;
+    if(reuse->second->manifest_name_ == manifest_name &&
+       stampFile(reuse->second->manifest_path_, stamp) &&
+       stamp == reuse->second->manifest_stamp_)
+      stackage = reuse->second;
+    else
+      delete reuse->second;
+    reusable_.erase(reuse);
   }
-  else
+
+  if(!stackage)
   {
-    return;
+    fs::path manifest_path = fs::path(path) / manifest_name;
+    stackage = new Stackage(name, path, manifest_path.string(), manifest_name);
+    if(stackage->is_wet_package_)
+    {
+      // The crawl may have parsed it already
+      if(crawled && crawled->parsed_)
+      {
+        stackage->elements_.swap(crawled->elements_);
+        stackage->manifest_loaded_ = true;
+        stackage->manifest_stamp_ = crawled->manifest_stamp_;
+        stackage->manifest_stamped_ = crawled->manifest_stamped_;
+      }
+      else
+        loadManifest(stackage);
+      stackage->update_wet_information();
+    }
   }
 
+  registerStackage(stackage);
+}
+
+void
+Rosstackage::registerStackage(Stackage* stackage)
+{
   // skip the stackage if it is not of correct type
   if( (stackage->is_wet_package_ &&
        (manifest_name_ == ROSPACKAGE_MANIFEST_NAME)) ||
@@ -1438,125 +2156,354 @@ Rosstackage::addStackage(const std::string& path)
   stackages_[stackage->name_] = stackage;
 }
 
-void
-Rosstackage::crawlDetail(const std::string& path,
-                         bool force,
-                         int depth,
-                         bool collect_profile_data,
-                         std::vector<DirectoryCrawlRecord*>& profile_data,
-                         boost::unordered_set<std::string>& profile_hash)
+// Parse the package.xml that the crawl just found at node, so that the
+// crawl's threads parse manifests while others wait on the filesystem.
+// addStackage() has to parse every package.xml as it registers it, but
+// not one whose stackage from the last crawl (in reusable) can be used
+// again.  Failures are left for addStackage() to run into and report.
+static void
+parseCrawledManifest(CrawlNode* node,
+                     const boost::unordered_map<std::string, Stackage*>* reusable)
 {
-  if(depth > MAX_CRAWL_DEPTH)
-    throw Exception("maximum depth exceeded during crawl");
-
-  try
+  std::string manifest_path = (fs::path(node->path_) / node->manifest_name_).string();
+  if(reusable)
   {
-    if(!fs::is_directory(path))
+    boost::unordered_map<std::string, Stackage*>::const_iterator it = reusable->find(node->path_);
+    FileStamp stamp;
+    if(it != reusable->end() &&
+       it->second->manifest_name_ == node->manifest_name_ &&
+       stampFile(manifest_path, stamp) &&
+       stamp == it->second->manifest_stamp_)
       return;
   }
-  catch(fs::filesystem_error& e)
-  {
-    logWarn(std::string("error while looking at ") + path + ": " + e.what());
+  // As in loadManifest(), stamp it before reading it
+  bool stamped = stampFile(manifest_path, node->manifest_stamp_);
+  node->parsed_ = parseManifest(manifest_path, node->elements_);
+  node->manifest_stamped_ = stamped && node->manifest_stamp_.settled(time_since_epoch());
+}
+
+// Look at one directory on behalf of crawlDetail(), possibly on a worker
+// thread.  Only the node is modified; stackages are registered later, by
+// commitCrawl().
+static void
+crawlDirectory(CrawlNode* const& node,
+               WorkQueue<CrawlNode*>& queue,
+               size_t worker,
+               const std::string& manifest_name,
+               const DirectoryIndex* index,
+               const boost::unordered_map<std::string, Stackage*>* reusable)
+{
+  double start = time_since_epoch();
+  const std::string& path = node->path_;
+
+  // Reported (in order) by commitCrawl()
+  if(node->depth_ > MAX_CRAWL_DEPTH)
     return;
-  }
 
-  fs::path catkin_ignore = fs::path(path) / CATKIN_IGNORE;
-  try
+  // One pass over the directory tells us everything the checks below
+  // need, without probing for each marker file by name.  Better yet, if
+  // the directory hasn't changed since the index was written, the index
+  // has what we'd find.
+  DirectoryListing listing;
+  DirectoryHandlePtr handle;
+  const DirectoryIndex::Entry* entry = index ? index->find(path) : NULL;
+  if(entry &&
+     stampDirectory(path, node->parent_, node->name_, node->stamp_) &&
+     node->stamp_ == entry->stamp_)
   {
-    if(fs::is_regular_file(catkin_ignore))
-      return;
+    listing.flags_ = entry->flags_;
+    listing.subdirs_ = entry->subdirs_;
+    listing.unresolved_.assign(listing.subdirs_.size(), false);
+    node->indexable_ = true;
+    node->from_index_ = true;
   }
-  catch(fs::filesystem_error& e)
+  else
   {
-    logWarn(std::string("error while looking for ") + catkin_ignore.string() + ": " + e.what());
+    bool listed = listDirectory(path, node->parent_, node->name_,
+                                node->preopened_, index != NULL,
+                                listing, handle, node->warnings_);
+    if(!listed)
+      return;
+    node->stamp_ = listing.stamp_;
+    node->indexable_ = listing.stable_;
   }
+  node->listed_ = true;
+  node->parent_.reset();
+  node->preopened_.reset();
+  node->flags_ = listing.flags_;
 
-  if(isStackage(path))
-  {
-    addStackage(path);
+  if(listing.has(DirectoryListing::CATKIN_IGNORE_FILE))
     return;
-  }
 
-  fs::path nosubdirs = fs::path(path) / ROSPACK_NOSUBDIRS;
-  try
+  int manifest_flag = (manifest_name == ROSSTACK_MANIFEST_NAME) ?
+          DirectoryListing::ROSSTACK_MANIFEST_FILE :
+          DirectoryListing::ROSPACK_MANIFEST_FILE;
+  if(listing.has(manifest_flag))
   {
-    if(fs::is_regular_file(nosubdirs))
-      return;
+    node->is_stackage_ = true;
+    node->manifest_name_ = manifest_name;
+    return;
   }
-  catch(fs::filesystem_error& e)
+  // finding a package.xml is acceptable
+  if(listing.has(DirectoryListing::PACKAGE_MANIFEST_FILE))
   {
-    logWarn(std::string("error while looking for ") + nosubdirs.string() + ": " + e.what());
+    node->is_stackage_ = true;
+    node->manifest_name_ = ROSPACKAGE_MANIFEST_NAME;
+    parseCrawledManifest(node, reusable);
+    return;
   }
 
+  if(listing.has(DirectoryListing::NOSUBDIRS_FILE))
+    return;
+
   // We've already checked above whether CWD contains the kind of manifest
   // we're looking for.  Don't recurse if we encounter a rospack manifest,
   // to avoid having rosstack finding stacks inside packages, #3816.
-  fs::path rospack_manifest = fs::path(path) / ROSPACK_MANIFEST_NAME;
-  try
+  if(listing.has(DirectoryListing::ROSPACK_MANIFEST_FILE))
+    return;
+
+  node->descended_ = true;
+  resolveSubdirs(path, handle, listing, node->warnings_);
+  for(size_t i = 0; i < listing.subdirs_.size(); i++)
   {
-    if(fs::is_regular_file(rospack_manifest))
-      return;
+    node->children_.push_back(new CrawlNode((fs::path(path) / listing.subdirs_[i]).string(),
+                                            node->depth_ + 1,
+                                            handle,
+                                            listing.subdirs_[i],
+                                            listing.handles_[i]));
   }
-  catch(fs::filesystem_error& e)
+
+  // Push in reverse so that a lone worker pops them in directory order.
+  for(std::vector<CrawlNode*>::reverse_iterator it = node->children_.rbegin();
+      it != node->children_.rend();
+      ++it)
+    queue.push(*it, worker);
+
+  node->crawl_time_ = time_since_epoch() - start;
+}
+
+class DirectoryCrawler
+{
+  public:
+    DirectoryCrawler(const std::string& manifest_name,
+                     const DirectoryIndex* index,
+                     const boost::unordered_map<std::string, Stackage*>* reusable) :
+            manifest_name_(manifest_name),
+            index_(index),
+            reusable_(reusable) {}
+    void operator()(CrawlNode* const& node,
+                    WorkQueue<CrawlNode*>& queue,
+                    size_t worker) const
+    {
+      crawlDirectory(node, queue, worker, manifest_name_, index_, reusable_);
+    }
+  private:
+    std::string manifest_name_;
+    const DirectoryIndex* index_;
+    // Only read while the crawl is running
+    const boost::unordered_map<std::string, Stackage*>* reusable_;
+};
+
+// How many threads to crawl with: ROS_CRAWL_THREADS if set, otherwise the
+// number of cores (up to a limit).  1 gives the plain serial crawl.
+static size_t
+crawlThreadCount()
+{
+  const char* threads_str = getenv("ROS_CRAWL_THREADS");
+  if(threads_str)
   {
-    logWarn(std::string("error while looking for ") + rospack_manifest.string() + ": " + e.what());
+    int threads = atoi(threads_str);
+    if(threads > 0)
+      return threads;
   }
+  size_t threads = boost::thread::hardware_concurrency();
+  if(threads < 1)
+    threads = 1;
+  return std::min(threads, MAX_DEFAULT_CRAWL_THREADS);
+}
 
-  DirectoryCrawlRecord* dcr = NULL;
-  if(collect_profile_data)
+// Add what the crawl saw of node and everything below it to index.
+// Returns true if any of it wasn't already in the old index.
+static bool
+indexCrawl(const CrawlNode* node, double crawl_start, DirectoryIndex& index,
+           bool& complete)
+{
+  bool changed = false;
+  // Leave out directories that changed too recently to be sure that their
+  // next change will show up in their stamp
+  if(!node->indexable_ || !node->stamp_.settled(crawl_start))
+    complete = false;
+  else
+  {
+    DirectoryIndex::Entry& entry = index.add(node->path_);
+    entry.stamp_ = node->stamp_;
+    entry.flags_ = node->flags_;
+    for(std::vector<CrawlNode*>::const_iterator it = node->children_.begin();
+        it != node->children_.end();
+        ++it)
+      entry.subdirs_.push_back((*it)->name_);
+    changed = !node->from_index_;
+  }
+  for(std::vector<CrawlNode*>::const_iterator it = node->children_.begin();
+      it != node->children_.end();
+      ++it)
+    changed = indexCrawl(*it, crawl_start, index, complete) || changed;
+  return changed;
+}
+
+// The stackages that the crawl found at or below node, in the order that
+// commitCrawl() adds them
+static void
+collectStackages(CrawlNode* node, std::vector<CrawlNode*>& found)
+{
+  if(node->depth_ > MAX_CRAWL_DEPTH)
+    return;
+  if(node->is_stackage_)
+    found.push_back(node);
+  for(std::vector<CrawlNode*>::const_iterator it = node->children_.begin();
+      it != node->children_.end();
+      ++it)
+    collectStackages(*it, found);
+}
+
+void
+Rosstackage::crawlDetail(const std::vector<std::string>& paths,
+                         bool force,
+                         int depth,
+                         bool collect_profile_data,
+                         std::vector<DirectoryCrawlRecord*>& profile_data,
+                         boost::unordered_set<std::string>& profile_hash)
+{
+  // Walk all of the trees at once, then register what we found one tree
+  // at a time, so that the first stackage found in search path order
+  // still wins.  Trees with a prebuilt index that still matches them are
+  // taken from that and, unless we're forced to crawl everything, so are
+  // trees whose shards of the cache are still good.  Profiling is meant to
+  // time a real crawl, so it uses neither.
+  std::vector<CrawlNode*> roots;
+  std::vector<BinaryCachePtr> shards(paths.size());
+  std::vector<DirectoryIndex> root_indexes(paths.size());
+  std::vector<CrawlNode*> crawled_roots;
+  // Directories that haven't changed since the last crawl don't need to be
+  // read again
+  DirectoryIndex index;
+  double crawl_start = time_since_epoch();
+  for(size_t i = 0; i < paths.size(); i++)
   {
-    if(profile_hash.find(path) == profile_hash.end())
+    roots.push_back(new CrawlNode(paths[i], depth));
+    if(!collect_profile_data)
+      shards[i] = openSystemIndex(paths[i]);
+    if(!collect_profile_data && !force && !shards[i])
+      shards[i] = openShard(paths[i]);
+    if(shards[i])
+      continue;
+    if(!collect_profile_data)
     {
-      dcr = new DirectoryCrawlRecord(path,
-                                     time_since_epoch(),
-                                     stackages_.size());
-      profile_data.push_back(dcr);
-      profile_hash.insert(path);
+      root_indexes[i].load(getShardPath(paths[i]) + DIRECTORY_INDEX_SUFFIX);
+      index.insert(root_indexes[i]);
     }
+    crawled_roots.push_back(roots[i]);
   }
 
   try
   {
-    for(fs::directory_iterator dit = fs::directory_iterator(path);
-        dit != fs::directory_iterator();
-        ++dit)
+    WorkQueue<CrawlNode*> queue(crawlThreadCount(),
+                                DirectoryCrawler(manifest_name_,
+                                                 collect_profile_data ? NULL : &index,
+                                                 &reusable_));
+    queue.run(crawled_roots);
+    for(size_t i = 0; i < paths.size(); i++)
     {
-      if(fs::is_directory(dit->path()))
-      {
-#if !defined(BOOST_FILESYSTEM_VERSION) || (BOOST_FILESYSTEM_VERSION == 2)
-        std::string name = dit->path().filename();
-#else
-        // in boostfs3, filename() returns a path, which needs to be stringified
-        std::string name = dit->path().filename().string();
-#endif
-        // Ignore directories starting with '.'
-        if(name.size() == 0 || name[0] == '.')
-          continue;
+      if(shards[i])
+        addShardStackages(shards[i]);
+      else
+        commitCrawl(roots[i], collect_profile_data, profile_data, profile_hash);
+    }
 
-        crawlDetail(dit->path().string(), force, depth+1,
-                    collect_profile_data, profile_data, profile_hash);
-      }
+    for(size_t i = 0; i < paths.size() && !collect_profile_data; i++)
+    {
+      if(shards[i])
+        continue;
+      DirectoryIndex new_index;
+      bool complete = true;
+      bool changed = indexCrawl(roots[i], crawl_start, new_index, complete);
+      new_index.setComplete(complete);
+      // The index and the shards are only an optimization, so failing to
+      // write them isn't worth a warning
+      if(changed || new_index.size() != root_indexes[i].size() ||
+         new_index.complete() != root_indexes[i].complete())
+        new_index.save(getShardPath(paths[i]) + DIRECTORY_INDEX_SUFFIX);
+      std::vector<CrawlNode*> found;
+      collectStackages(roots[i], found);
+      writeShard(paths[i], found);
     }
   }
-  catch(fs::filesystem_error& e)
+  catch(...)
   {
-    // suppress logging of error message if reading of directory failed
-    // due to missing permission
-    if(e.code().value() != EACCES)
+    for(std::vector<CrawlNode*>::const_iterator it = roots.begin();
+        it != roots.end();
+        ++it)
+      delete *it;
+    throw;
+  }
+  for(std::vector<CrawlNode*>::const_iterator it = roots.begin();
+      it != roots.end();
+      ++it)
+    delete *it;
+}
+
+double
+Rosstackage::commitCrawl(CrawlNode* node,
+                         bool collect_profile_data,
+                         std::vector<DirectoryCrawlRecord*>& profile_data,
+                         boost::unordered_set<std::string>& profile_hash)
+{
+  if(node->depth_ > MAX_CRAWL_DEPTH)
+    throw Exception("maximum depth exceeded during crawl");
+
+  for(std::vector<std::string>::const_iterator it = node->warnings_.begin();
+      it != node->warnings_.end();
+      ++it)
+    logWarn(*it);
+
+  if(node->is_stackage_)
+  {
+    addStackage(node->path_, node->manifest_name_, node);
+    return node->crawl_time_;
+  }
+  if(!node->descended_)
+    return node->crawl_time_;
+
+  DirectoryCrawlRecord* dcr = NULL;
+  if(collect_profile_data)
+  {
+    if(profile_hash.find(node->path_) == profile_hash.end())
     {
-      logWarn(std::string("error while crawling ") + path + ": " + e.what());
+      dcr = new DirectoryCrawlRecord(node->path_,
+                                     0.0,
+                                     stackages_.size());
+      profile_data.push_back(dcr);
+      profile_hash.insert(node->path_);
     }
   }
 
+  double crawl_time = node->crawl_time_;
+  for(std::vector<CrawlNode*>::const_iterator it = node->children_.begin();
+      it != node->children_.end();
+      ++it)
+    crawl_time += commitCrawl(*it, collect_profile_data, profile_data, profile_hash);
+
   if(collect_profile_data && dcr != NULL)
   {
-    // Measure the elapsed time
-    dcr->crawl_time_ = time_since_epoch() - dcr->start_time_;
+    // The time spent on this directory and everything below it, summed
+    // across threads
+    dcr->crawl_time_ = crawl_time;
     // If the number of packages didn't change while crawling,
     // then this directory is a zombie
     if(stackages_.size() == dcr->start_num_pkgs_)
       dcr->zombie_ = true;
   }
+  return crawl_time;
 }
 
 void
@@ -1565,67 +2512,110 @@ Rosstackage::loadManifest(Stackage* stackage)
   if(stackage->manifest_loaded_)
     return;
 
-  if(stackage->manifest_.LoadFile(stackage->manifest_path_.c_str()) != tinyxml2::XML_SUCCESS)
+  // The binary cache holds the manifest's elements as they were when it
+  // was written, which readBinaryCache() checked is still how they are
+  if(stackage->cache_)
+  {
+    BinaryCachePtr cache = stackage->cache_;
+    size_t i = stackage->cache_index_;
+    stackage->cache_.reset();
+    if(!(cache->flags(i) & BinaryCache::PARSE_ERROR) &&
+       cache->elements(i, stackage->elements_))
+    {
+      stackage->manifest_loaded_ = true;
+      stackage->manifest_stamp_ = cache->manifestStamp(i);
+      stackage->manifest_stamped_ = true;
+      if(stackage->is_wet_package_)
+        stackage->update_wet_information();
+      return;
+    }
+    // Otherwise parse it again, which reports the error
+    stackage->elements_.clear();
+  }
+
+  // Stamp the manifest first, so that an edit made while we're parsing it
+  // isn't mistaken for what we parsed
+  FileStamp stamp;
+  bool stamped = stampFile(stackage->manifest_path_, stamp);
+  if(!parseManifest(stackage->manifest_path_, stackage->elements_))
   {
     std::string errmsg = std::string("error parsing manifest of package ") +
             stackage->name_ + " at " + stackage->manifest_path_;
     throw Exception(errmsg);
   }
   stackage->manifest_loaded_ = true;
+  stackage->manifest_stamp_ = stamp;
+  stackage->manifest_stamped_ = stamped && stamp.settled(time_since_epoch());
 }
 
 void
 Rosstackage::computeDeps(Stackage* stackage, bool ignore_errors, bool ignore_missing)
 {
-  if(stackage->deps_computed_)
+  int id = graphId(stackage);
+  if(graph_->hasEdges(id))
     return;
+  if(!ignore_missing && !graph_->recording())
+    prefetchSysPackages(std::vector<Stackage*>(1, stackage));
 
-  stackage->deps_computed_ = true;
+  // Whatever happens below, the row is finished, so that the graph is
+  // left consistent
+  graph_->beginEdges(id);
 
   try
   {
     loadManifest(stackage);
-    get_manifest_root(stackage);
+    get_manifest_elements(stackage);
   }
   catch(Exception& e)
   {
+    graph_->endEdges();
     if(ignore_errors)
       return;
     else
       throw e;
   }
-  if (!stackage->is_wet_package_)
+  try
   {
-    computeDepsInternal(stackage, ignore_errors, "depend", ignore_missing);
+    if (!stackage->is_wet_package_)
+    {
+      computeDepsInternal(stackage, ignore_errors, "depend", ignore_missing);
+    }
+    else
+    {
+      // package format 1 tags
+      computeDepsInternal(stackage, ignore_errors, "run_depend", ignore_missing);
+      // package format 2 tags
+      computeDepsInternal(stackage, ignore_errors, "exec_depend", ignore_missing);
+      computeDepsInternal(stackage, ignore_errors, "depend", ignore_missing);
+    }
   }
-  else
+  catch(Exception& e)
   {
-    // package format 1 tags
-    computeDepsInternal(stackage, ignore_errors, "run_depend", ignore_missing);
-    // package format 2 tags
-    computeDepsInternal(stackage, ignore_errors, "exec_depend", ignore_missing);
-    computeDepsInternal(stackage, ignore_errors, "depend", ignore_missing);
+    graph_->endEdges();
+    throw e;
   }
+  graph_->endEdges();
 }
 
 void
 Rosstackage::computeDepsInternal(Stackage* stackage, bool ignore_errors, const std::string& depend_tag, bool ignore_missing)
 {
-  tinyxml2::XMLElement* root;
-  root = get_manifest_root(stackage);
+  const std::vector<ManifestElement>& elements = get_manifest_elements(stackage);
 
   const char* dep_pkgname;
-  for(tinyxml2::XMLElement *dep_ele = root->FirstChildElement(depend_tag.c_str());
-      dep_ele;
-      dep_ele = dep_ele->NextSiblingElement(depend_tag.c_str()))
+  for(std::vector<ManifestElement>::const_iterator dep_ele = elements.begin();
+      dep_ele != elements.end();
+      ++dep_ele)
   {
+    if(dep_ele->tag_ != depend_tag)
+      continue;
     if (!stackage->is_wet_package_)
     {
-      dep_pkgname = dep_ele->Attribute(tag_.c_str());
+      dep_pkgname = dep_ele->attribute(tag_);
     }
     else
     {
-      dep_pkgname = dep_ele->GetText();
+      dep_pkgname = dep_ele->text();
     }
     if(!dep_pkgname)
     {
@@ -1652,7 +2642,7 @@ Rosstackage::computeDepsInternal(Stackage* stackage, bool ignore_errors, const s
       if(ignore_errors)
       {
         Stackage* dep =  new Stackage(dep_pkgname, "", "", "");
-        stackage->deps_.push_back(dep);
+        graph_->addEdge(graphId(dep));
       }
       else
       {
@@ -1663,15 +2653,16 @@ Rosstackage::computeDepsInternal(Stackage* stackage, bool ignore_errors, const s
     else
     {
       Stackage* dep = stackages_[dep_pkgname];
-      if (std::find(stackage->deps_.begin(), stackage->deps_.end(), dep) == stackage->deps_.end())
-      {
-        stackage->deps_.push_back(dep);
+      if (graph_->addEdge(graphId(dep)))
         computeDeps(dep, ignore_errors, ignore_missing);
-      }
     }
   }
 }
 
+// The thread that started Python, which holds the GIL from then on (but
+// for while prefetchExports() runs)
+static boost::thread::id python_thread;
+
 void
 Rosstackage::initPython()
 {
@@ -1679,19 +2670,179 @@ Rosstackage::initPython()
   if(!initialized)
   {
     initialized = true;
-    Py_InitializeEx(0);
+    if(!Py_IsInitialized())
+    {
+      Py_InitializeEx(0);
+      python_thread = boost::this_thread::get_id();
+    }
   }
 }
 
+// The ROS distro that rosdep picks its sources for
+static std::string
+getRosDistro()
+{
+  const char* ros_distro = getenv("ROS_DISTRO");
+  return ros_distro ? ros_distro : "";
+}
+
 bool
 Rosstackage::isSysPackage(const std::string& pkgname)
 {
-  static std::map<std::string, bool> cache;
-  if(cache.find(pkgname) != cache.end())
+  std::vector<std::string> pkgnames(1, pkgname);
+  lookupSysPackages(pkgnames);
+  bool value = false;
+  sys_packages_->find(pkgname, value);
+  return value;
+}
+
+// Look up whether each name is a system dependency, taking what the table
+// and rosdep's sources cache can't answer to rosdep in one go
+void
+Rosstackage::lookupSysPackages(const std::vector<std::string>& pkgnames)
+{
+  if(!sys_packages_)
+  {
+    sys_packages_.reset(new SysDependencyCache());
+    sys_packages_->load(getSysPackageCachePath(),
+                        RosdepView::defaultSourcesCacheDir(),
+                        getRosDistro());
+  }
+  std::vector<std::string> undecided;
+  boost::unordered_set<std::string> undecided_hash;
+  for(std::vector<std::string>::const_iterator it = pkgnames.begin();
+      it != pkgnames.end();
+      ++it)
+  {
+    bool value;
+    if(sys_packages_->find(*it, value))
+      continue;
+    if(lookupRosdepView(*it, value))
+      sys_packages_->insert(*it, value);
+    else if(undecided_hash.insert(*it).second)
+      undecided.push_back(*it);
+  }
+  if(undecided.empty())
+    return;
+  // Once rosdep has failed, it fails the same way for the rest of the
+  // names
+  if(!sys_packages_error_.empty())
+    throw Exception(sys_packages_error_);
+  std::vector<bool> values;
+  try
+  {
+    isSysPackagesPython(undecided, values);
+  }
+  catch(Exception& e)
+  {
+    sys_packages_error_ = e.what();
+    throw;
+  }
+  for(size_t i = 0; i < undecided.size(); i++)
+    sys_packages_->insert(undecided[i], values[i]);
+}
+
+// Before the dependencies of roots are computed, look up all at once the
+// names that computeDepsInternal() would otherwise ask isSysPackage()
+// about one at a time along the way: those that the wet packages it would
+// reach depend on, but that aren't stackages.  Anything that goes wrong is
+// left for computeDeps() to report where it always has.
+void
+Rosstackage::prefetchSysPackages(const std::vector<Stackage*>& roots)
+{
+  std::vector<Stackage*> stack(roots.rbegin(), roots.rend());
+  boost::unordered_set<Stackage*> visited;
+  std::vector<std::string> pkgnames;
+  while(!stack.empty())
+  {
+    Stackage* stackage = stack.back();
+    stack.pop_back();
+    if(!visited.insert(stackage).second ||
+       (stackage->id_ >= 0 && graph_->hasEdges(stackage->id_)))
+      continue;
+    try
+    {
+      loadManifest(stackage);
+      get_manifest_elements(stackage);
+    }
+    // Swallowed on purpose: computeDeps() raises it again when it gets here
+    catch(Exception&)
+    {
+      continue;
+    }
+    const std::vector<ManifestElement>& elements = get_manifest_elements(stackage);
+    for(std::vector<ManifestElement>::const_iterator ele = elements.begin();
+        ele != elements.end();
+        ++ele)
+    {
+      const char* dep_pkgname;
+      if(!stackage->is_wet_package_)
+      {
+        if(ele->tag_ != "depend")
+          continue;
+        dep_pkgname = ele->attribute(tag_);
+      }
+      else
+      {
+        if(ele->tag_ != "run_depend" && ele->tag_ != "exec_depend" &&
+           ele->tag_ != "depend")
+          continue;
+        dep_pkgname = ele->text();
+      }
+      if(!dep_pkgname || dep_pkgname == stackage->name_)
+        continue;
+      boost::unordered_map<std::string, Stackage*>::const_iterator dep =
+        stackages_.find(dep_pkgname);
+      if(dep != stackages_.end())
+        stack.push_back(dep->second);
+      else if(stackage->is_wet_package_)
+        pkgnames.push_back(dep_pkgname);
+    }
+  }
+  if(pkgnames.empty())
+    return;
+  try
+  {
+    lookupSysPackages(pkgnames);
+  }
+  // Swallowed on purpose: the first isSysPackage() call raises it again
+  catch(Exception&)
+  {
+  }
+}
+
+// Answer from rosdep's sources cache, if it can be read here and it
+// settles the question; otherwise it's left to rosdep
+bool
+Rosstackage::lookupRosdepView(const std::string& pkgname,
+                              bool& is_sys_package)
+{
+  if(!rosdep_view_)
   {
-    return cache.find(pkgname)->second;
+    rosdep_view_.reset(new RosdepView());
+    rosdep_view_loaded_ =
+      rosdep_view_->load(RosdepView::defaultSourcesCacheDir(),
+                         getRosDistro());
   }
+  if(!rosdep_view_loaded_)
+    return false;
+  if(rosdep_view_->empty())
+  {
+    std::string errmsg = "the rosdep view is empty: call 'sudo rosdep init' and 'rosdep update'";
+    throw Exception(errmsg);
+  }
+  RosdepView::Answer answer = rosdep_view_->isSystemDependency(pkgname);
+  if(answer == RosdepView::UNDECIDED)
+    return false;
+  is_sys_package = (answer == RosdepView::SYSTEM_DEPENDENCY);
+  return true;
+}
 
+void
+Rosstackage::isSysPackagesPython(const std::vector<std::string>& pkgnames,
+                                 std::vector<bool>& values)
+{
+  values.clear();
   initPython();
   PyGILState_STATE gstate = PyGILState_Ensure();
 
@@ -1767,16 +2918,29 @@ Rosstackage::isSysPackage(const std::string& pkgname)
     throw Exception(errmsg);
   }
 
-  PyObject* pArgs = PyTuple_New(2);
-  PyTuple_SetItem(pArgs, 0, pView);
-  PyObject* pDep = PyUnicode_FromString(pkgname.c_str());
-  PyTuple_SetItem(pArgs, 1, pDep);
-  PyObject* pValue = PyObject_CallObject(pFunc, pArgs);
-  Py_INCREF(pView); // in order to keep the view when garbaging pArgs
-  Py_DECREF(pArgs);
+  // All of the names are asked about while holding the GIL once
+  for(std::vector<std::string>::const_iterator it = pkgnames.begin();
+      it != pkgnames.end();
+      ++it)
+  {
+    PyObject* pArgs = PyTuple_New(2);
+    PyTuple_SetItem(pArgs, 0, pView);
+    PyObject* pDep = PyUnicode_FromString(it->c_str());
+    PyTuple_SetItem(pArgs, 1, pDep);
+    PyObject* pValue = PyObject_CallObject(pFunc, pArgs);
+    Py_INCREF(pView); // in order to keep the view when garbaging pArgs
+    Py_DECREF(pArgs);
+    if(!pValue)
+    {
+      PyErr_Print();
+      PyGILState_Release(gstate);
+      std::string errmsg = "could not call python function 'rosdep2.rospack.is_system_dependency'";
+      throw Exception(errmsg);
+    }
 
-  bool value = PyObject_IsTrue(pValue);
-  Py_DECREF(pValue);
+    values.push_back(PyObject_IsTrue(pValue));
+    Py_DECREF(pValue);
+  }
 
   // we want to keep the static objects alive for repeated access
   // so skip all garbage collection until process ends
@@ -1786,10 +2950,6 @@ Rosstackage::isSysPackage(const std::string& pkgname)
   //Py_Finalize();
 
   PyGILState_Release(gstate);
-
-  cache[pkgname] = value;
-
-  return value;
 }
 
 void
@@ -1798,22 +2958,91 @@ Rosstackage::gatherDeps(Stackage* stackage, bool direct,
                         std::vector<Stackage*>& deps,
                         bool no_recursion_on_wet)
 {
-  boost::unordered_set<Stackage*> deps_hash;
   std::vector<std::string> indented_deps;
   gatherDepsFull(stackage, direct, order, 0,
-                 deps_hash, deps, false, indented_deps, no_recursion_on_wet);
+                 deps, false, indented_deps, no_recursion_on_wet);
+}
+
+// The error for a walk of the dependencies that went deeper than
+// MAX_DEPENDENCY_DEPTH along dep_chain, naming the cycle that the walk went
+// round, if there is one
+static void
+throwDepthExceeded(const DependencyGraph& graph,
+                   const std::vector<int>& dep_chain)
+{
+  std::string cycle;
+  for(std::vector<int>::const_iterator it = dep_chain.begin();
+      it != dep_chain.end();
+      ++it)
+  {
+    std::vector<int>::const_iterator begin = dep_chain.begin();
+    std::vector<int>::const_iterator cycle_begin = std::find(begin, it, *it);
+    if(cycle_begin != it) {
+      cycle = ": ";
+      for(std::vector<int>::const_iterator jt = cycle_begin; jt != it; ++jt) {
+        if(jt != cycle_begin) cycle += ", ";
+        cycle += graph.node(*jt)->name_;
+      }
+      break;
+    }
+  }
+  throw Exception(std::string("maximum dependency depth exceeded (likely circular dependency") + cycle + ")");
 }
 
+static const int HEIGHT_UNKNOWN = -1;
+static const int HEIGHT_ON_CHAIN = -2;
+
+// Throw the error that a walk of the dependencies from id would have
+// thrown, back when each walk descended into every stackage every time it
+// was reached and relied on the depth limit to catch cycles: going round a
+// cycle, it would have gone past the limit with the cycle's members on its
+// chain.  Here each stackage is descended into once, and heights records
+// how far below it that walk reached, so that reaching it again can be
+// checked against the limit without descending again.
+static int
+_checkDepsDepth(const DependencyGraph& graph, int id, int depth,
+                bool no_recursion_on_wet,
+                std::vector<int>& heights,
+                std::vector<int>& dep_chain)
+{
+  if(depth > MAX_DEPENDENCY_DEPTH)
+    throwDepthExceeded(graph, dep_chain);
+
+  heights[id] = HEIGHT_ON_CHAIN;
+  int height = 0;
+  for(size_t e = graph.edgesBegin(id); e != graph.edgesEnd(id); ++e)
+  {
+    int dep_id = graph.edge(e);
+    if(graph.node(dep_id)->is_wet_package_ && no_recursion_on_wet)
+      continue;
+    dep_chain.push_back(dep_id);
+    int dep_height = heights[dep_id];
+    if(dep_height == HEIGHT_ON_CHAIN)
+      throwDepthExceeded(graph, dep_chain);
+    else if(dep_height == HEIGHT_UNKNOWN)
+      dep_height = _checkDepsDepth(graph, dep_id, depth+1, no_recursion_on_wet,
+                                   heights, dep_chain);
+    else if(depth + 1 + dep_height > MAX_DEPENDENCY_DEPTH)
+      throwDepthExceeded(graph, dep_chain);
+    dep_chain.pop_back();
+    if(dep_height + 1 > height)
+      height = dep_height + 1;
+  }
+  heights[id] = height;
+  return height;
+}
+
+// Pre-condition: the walk from id can't go round a cycle
 void
-_gatherDepsFull(Stackage* stackage, bool direct,
+_gatherDepsFull(const DependencyGraph& graph, int id, bool direct,
                             traversal_order_t order, int depth,
-                            boost::unordered_set<Stackage*>& deps_hash,
+                            std::vector<char>& deps_hash,
                             std::vector<Stackage*>& deps,
                             bool get_indented_deps,
                             std::vector<std::string>& indented_deps,
-                            bool no_recursion_on_wet,
-                            std::vector<std::string>& dep_chain)
+                            bool no_recursion_on_wet)
 {
+  Stackage* stackage = graph.node(id);
   if(stackage->is_wet_package_ && no_recursion_on_wet)
   {
     return;
@@ -1821,94 +3050,90 @@ _gatherDepsFull(Stackage* stackage, bool direct,
 
   if(direct && (stackage->is_wet_package_ || !no_recursion_on_wet))
   {
-    for(std::vector<Stackage*>::const_iterator it = stackage->deps_.begin();
-        it != stackage->deps_.end();
-        ++it)
-      deps.push_back(*it);
+    for(size_t i = graph.edgesBegin(id); i != graph.edgesEnd(id); ++i)
+      deps.push_back(graph.node(graph.edge(i)));
     return;
   }
 
-  if(depth > MAX_DEPENDENCY_DEPTH) {
-    std::string cycle;
-    for(std::vector<std::string>::const_iterator it = dep_chain.begin();
-        it != dep_chain.end();
-        ++it)
-    {
-      std::vector<std::string>::const_iterator begin = dep_chain.begin();
-      std::vector<std::string>::const_iterator cycle_begin = std::find(begin, it, *it);
-      if(cycle_begin != it) {
-        cycle = ": ";
-        for(std::vector<std::string>::const_iterator jt = cycle_begin; jt != it; ++jt) {
-          if(jt != cycle_begin) cycle += ", ";
-          cycle += *jt;
-        }
-        break;
-      }
-    }
-    throw Exception(std::string("maximum dependency depth exceeded (likely circular dependency") + cycle + ")");
-  }
-
-  for(std::vector<Stackage*>::const_iterator it = stackage->deps_.begin();
-      it != stackage->deps_.end();
-      ++it)
+  for(size_t e = graph.edgesBegin(id); e != graph.edgesEnd(id); ++e)
   {
+    int dep_id = graph.edge(e);
+    Stackage* dep = graph.node(dep_id);
     if(get_indented_deps)
     {
       std::string indented_dep;
       for(int i=0; i<depth; i++)
         indented_dep.append("  ");
-      indented_dep.append((*it)->name_);
+      indented_dep.append(dep->name_);
         indented_deps.push_back(indented_dep);
     }
 
-    bool first = (deps_hash.find(*it) == deps_hash.end());
+    bool first = !deps_hash[dep_id];
     if(first)
     {
-      deps_hash.insert(*it);
+      deps_hash[dep_id] = 1;
       // We maintain the vector because the original rospack guaranteed
       // ordering in dep reporting.
       if(order == PREORDER)
-        deps.push_back(*it);
+        deps.push_back(dep);
     }
-    if(!(*it)->is_wet_package_ || !no_recursion_on_wet)
+    // The first visit to a stackage gathers all of its dependencies, so
+    // there's no need to descend again, unless it's to draw the whole tree.
+    if((first || get_indented_deps) &&
+       (!dep->is_wet_package_ || !no_recursion_on_wet))
     {
-      // We always descend, even if we're encountering this stackage for the
-      // nth time, so that we'll throw an error on recursive dependencies
-      // (detected via max stack depth being exceeded).
-      dep_chain.push_back((*it)->name_);
-      _gatherDepsFull(*it, direct, order, depth+1, deps_hash, deps,
+      _gatherDepsFull(graph, dep_id, direct, order, depth+1, deps_hash, deps,
                      get_indented_deps, indented_deps,
-                     no_recursion_on_wet, dep_chain);
-      dep_chain.pop_back();
+                     no_recursion_on_wet);
     }
     if(first)
     {
       if(order == POSTORDER)
-        deps.push_back(*it);
+        deps.push_back(dep);
     }
   }
 }
 
+// Throw the error, if any, that a walk of id's dependencies would hit by
+// going too deep.  The graph knows up front whether a cycle, or a path too
+// long, can be reached from id.  Only if one can does the walk need
+// checking, since skipping wet packages may keep it out of harm's way.
+void
+Rosstackage::checkDepsDepth(int id, int depth, bool no_recursion_on_wet)
+{
+  int length = graph_->longestPath(id);
+  if(length < 0 || depth + length > MAX_DEPENDENCY_DEPTH)
+  {
+    std::vector<int> heights(graph_->size(), HEIGHT_UNKNOWN);
+    std::vector<int> dep_chain(1, id);
+    _checkDepsDepth(*graph_, id, depth, no_recursion_on_wet, heights,
+                    dep_chain);
+  }
+}
+
 // Pre-condition: computeDeps(stackage) succeeded
 void
 Rosstackage::gatherDepsFull(Stackage* stackage, bool direct,
                             traversal_order_t order, int depth,
-                            boost::unordered_set<Stackage*>& deps_hash,
                             std::vector<Stackage*>& deps,
                             bool get_indented_deps,
                             std::vector<std::string>& indented_deps,
                             bool no_recursion_on_wet)
 {
-  std::vector<std::string> dep_chain;
-  dep_chain.push_back(stackage->name_);
-  _gatherDepsFull(stackage, direct,
+  int id = graphId(stackage);
+  // Only a walk that descends can go too deep
+  if(!(stackage->is_wet_package_ && no_recursion_on_wet) &&
+     !(direct && (stackage->is_wet_package_ || !no_recursion_on_wet)))
+    checkDepsDepth(id, depth, no_recursion_on_wet);
+
+  std::vector<char> deps_hash(graph_->size(), 0);
+  _gatherDepsFull(*graph_, id, direct,
       order, depth,
       deps_hash,
       deps,
       get_indented_deps,
       indented_deps,
-      no_recursion_on_wet,
-      dep_chain);
+      no_recursion_on_wet);
 }
 
 std::string
@@ -1959,29 +3184,79 @@ Rosstackage::getCachePath()
   return cache_path.string();
 }
 
-std::string
-Rosstackage::getCacheHash()
+// The hash that cache files are named after
+static std::string
+cacheHash(const char* key)
 {
   size_t value = 0;
-  char* rpp = getenv("ROS_PACKAGE_PATH");
-  if(rpp != NULL) {
+  if(key != NULL) {
     boost::hash<std::string> hash_func;
-    value = hash_func(rpp);
+    value = hash_func(key);
   }
   char buffer[21];
   snprintf(buffer, 21, "%020lu", value);
   return buffer;
 }
 
+std::string
+Rosstackage::getCacheHash()
+{
+  return cacheHash(getenv("ROS_PACKAGE_PATH"));
+}
+
+// Is the cache file young enough to be used, per ROS_CACHE_TIMEOUT?
+static double
+cacheMaxAge()
+{
+  double cache_max_age = DEFAULT_MAX_CACHE_AGE;
+  const char *user_cache_time_str = getenv("ROS_CACHE_TIMEOUT");
+  if(user_cache_time_str)
+    cache_max_age = atof(user_cache_time_str);
+  return cache_max_age;
+}
+
+static bool
+cacheIsFresh(const std::string& cache_path)
+{
+  double cache_max_age = cacheMaxAge();
+  if(cache_max_age == 0.0)
+    return false;
+  struct stat s;
+  if(stat(cache_path.c_str(), &s) == 0)
+  {
+    double dt = difftime(time(NULL), s.st_mtime);
+    // Negative cache_max_age means it's always new enough.  It's dangerous
+    // for the user to set this, but rosbash uses it.
+    if ((cache_max_age > 0.0) && (dt > cache_max_age))
+      return false;
+  }
+  return true;
+}
+
+// Should the caches be checked against the stamps of the directories that
+// were crawled to build them (ROS_CACHE_VALIDATION=fingerprint), instead of
+// going by their age?
+static bool
+cacheValidatedByFingerprint()
+{
+  const char* validation = getenv("ROS_CACHE_VALIDATION");
+  return validation && !strcmp(validation, "fingerprint");
+}
+
 bool
-Rosstackage::readCache()
+Rosstackage::readCache(const std::vector<std::string>& search_path)
 {
+  if(readBinaryCache(search_path))
+    return true;
+  // The text cache has nothing to check but its age
+  if(cacheValidatedByFingerprint())
+    return false;
   FILE* cache = validateCache();
   if(cache)
   {
     // We're about to read from the cache, so clear internal storage (in case this is
     // the second run in this process).
-    clearStackages();
+    setAsideStackages();
     char linebuf[30000];
     for(;;)
     {
@@ -1995,6 +3270,7 @@ Rosstackage::readCache()
       addStackage(linebuf);
     }
     fclose(cache);
+    clearReusable();
     return true;
   }
   else
@@ -2085,8 +3361,12 @@ Rosstackage::writeCache()
             ++it)
           fprintf(cache, "%s\n", it->second->path_.c_str());
         fclose(cache);
+#if defined(WIN32)
+        // Elsewhere rename() replaces the old cache in one step, so that
+        // other processes never find it missing
         if(fs::exists(cache_path))
           remove(cache_path.c_str());
+#endif
         if(rename(tmp_cache_path, cache_path.c_str()) < 0)
         {
           fprintf(stderr, "[rospack] Error: failed to rename cache file %s to %s: %s\n",
@@ -2101,26 +3381,363 @@ Rosstackage::writeCache()
   }
 }
 
+std::string
+Rosstackage::getSysPackageCachePath()
+{
+  fs::path cache_path = fs::path(getCachePath()).parent_path();
+  if(cache_path.empty())
+    return std::string();
+  cache_path /= "rospack_rosdep_cache";
+  return cache_path.string();
+}
+
+std::string
+Rosstackage::getExportCachePath()
+{
+  fs::path cache_path = fs::path(getCachePath()).parent_path();
+  if(cache_path.empty())
+    return std::string();
+  cache_path /= "rospack_export_cache";
+  return cache_path.string();
+}
+
+std::string
+Rosstackage::getShardPath(const std::string& root)
+{
+  fs::path cache_path = fs::path(getCachePath()).parent_path();
+  cache_path /= cache_prefix_ + "_shard_" + cacheHash(root.c_str());
+  return cache_path.string();
+}
+
+// The shard of the cache holding what a crawl of root found, if it can
+// stand in for crawling root again: it has to be young enough or, with
+// fingerprint validation, none of the directories it came from can have
+// changed since.
+BinaryCachePtr
+Rosstackage::openShard(const std::string& root)
+{
+  std::string shard_path = getShardPath(root);
+  bool fingerprint = cacheValidatedByFingerprint();
+  if(fingerprint ? cacheMaxAge() == 0.0 : !cacheIsFresh(shard_path + BINARY_CACHE_SUFFIX))
+    return BinaryCachePtr();
+  BinaryCachePtr shard(new BinaryCache());
+  if(!shard->open(shard_path + BINARY_CACHE_SUFFIX) || root != shard->key())
+    return BinaryCachePtr();
+
+  // However old the shard is, a crawl would find the same stackages as
+  // long as none of the directories it read has changed since.  That
+  // takes an index of every one of them.
+  if(fingerprint)
+  {
+    DirectoryIndex index;
+    index.load(shard_path + DIRECTORY_INDEX_SUFFIX);
+    if(!index.complete() || !index.unchanged(crawlThreadCount()))
+      return BinaryCachePtr();
+  }
+  return shard;
+}
+
+// Add the stackages found in a shard, in the order that the crawl found
+// them.  Each comes with its parsed manifest, so that a query answered
+// from the cache doesn't parse any XML; one whose manifest has changed
+// since (or couldn't be parsed) is read from disk as usual.
+void
+Rosstackage::addShardStackages(const BinaryCachePtr& shard)
+{
+  std::vector<std::string> manifest_paths;
+  for(size_t i = 0; i < shard->size(); i++)
+  {
+    if(shard->flags(i) & BinaryCache::STAMPED)
+      manifest_paths.push_back(shard->manifestPath(i));
+  }
+  std::vector<FileStamp> stamps;
+  std::vector<char> stamped;
+  stampFiles(manifest_paths, crawlThreadCount(), stamps, stamped);
+
+  for(size_t i = 0, k = 0; i < shard->size(); i++)
+  {
+    bool unchanged = false;
+    if(shard->flags(i) & BinaryCache::STAMPED)
+    {
+      unchanged = stamped[k] && stamps[k] == shard->manifestStamp(i);
+      k++;
+    }
+    if(unchanged && !(shard->flags(i) & BinaryCache::PARSE_ERROR))
+    {
+      // Or with the one parsed before, if it was set aside
+      Stackage* stackage = NULL;
+      boost::unordered_map<std::string, Stackage*>::iterator reuse = reusable_.find(shard->path(i));
+      if(reuse != reusable_.end())
+      {
+        if(reuse->second->manifest_path_ == shard->manifestPath(i) &&
+           reuse->second->manifest_stamp_ == shard->manifestStamp(i))
+          stackage = reuse->second;
+        else
+          delete reuse->second;
+        reusable_.erase(reuse);
+      }
+      registerStackage(stackage ? stackage : newCachedStackage(shard, i));
+    }
+    else
+      addStackage(shard->path(i));
+  }
+}
+
+// The whole cache is there if every root has a usable shard (or index).
+bool
+Rosstackage::readBinaryCache(const std::vector<std::string>& search_path)
+{
+  std::vector<BinaryCachePtr> shards;
+  for(std::vector<std::string>::const_iterator it = search_path.begin();
+      it != search_path.end();
+      ++it)
+  {
+    BinaryCachePtr shard = openSystemIndex(*it);
+    if(!shard)
+      shard = openShard(*it);
+    if(!shard)
+      return false;
+    shards.push_back(shard);
+  }
+
+  // We're about to read from the cache, so clear internal storage (in case this is
+  // the second run in this process).
+  setAsideStackages();
+  for(std::vector<BinaryCachePtr>::const_iterator it = shards.begin();
+      it != shards.end();
+      ++it)
+    addShardStackages(*it);
+  clearReusable();
+  return true;
+}
+
+// Write the shard for a root that was just crawled.  found holds the
+// stackages that the crawl found, in order, including any that lost out to
+// another of the same name.
+void
+Rosstackage::writeShard(const std::string& root,
+                        const std::vector<CrawlNode*>& found)
+{
+  std::string shard_path = getShardPath(root) + BINARY_CACHE_SUFFIX;
+  BinaryCacheWriter writer;
+  addShardRecords(found, shard_path, writer);
+  writer.write(shard_path, root);
+}
+
+// Add a record for each of the stackages in found to writer.  Manifests
+// that haven't changed since the file at old_path (a previous shard or
+// index) was written needn't be parsed again.
+void
+Rosstackage::addShardRecords(const std::vector<CrawlNode*>& found,
+                             const std::string& old_path,
+                             BinaryCacheWriter& writer)
+{
+  BinaryCache old_shard;
+  bool have_old_shard = old_shard.open(old_path);
+  double now = time_since_epoch();
+
+  boost::unordered_map<std::string, Stackage*> by_path;
+  for(boost::unordered_map<std::string, Stackage*>::const_iterator it = stackages_.begin();
+      it != stackages_.end();
+      ++it)
+    by_path[it->second->path_] = it->second;
+
+  std::vector<ManifestElement> elements;
+  for(std::vector<CrawlNode*>::const_iterator nit = found.begin();
+      nit != found.end();
+      ++nit)
+  {
+    const CrawlNode* node = *nit;
+    // Stackages that weren't kept are written too, so that the shard
+    // reports the same duplicates as the crawl did
+    Stackage* stackage;
+    boost::scoped_ptr<Stackage> discarded;
+    boost::unordered_map<std::string, Stackage*>::const_iterator it = by_path.find(node->path_);
+    if(it != by_path.end() && it->second->manifest_name_ == node->manifest_name_)
+      stackage = it->second;
+    else
+    {
+#if !defined(BOOST_FILESYSTEM_VERSION) || (BOOST_FILESYSTEM_VERSION == 2)
+      std::string dir_name = fs::path(node->path_).filename();
+#else
+      std::string dir_name = fs::path(node->path_).filename().string();
+#endif
+      discarded.reset(new Stackage(dir_name,
+                                   node->path_,
+                                   (fs::path(node->path_) / node->manifest_name_).string(),
+                                   node->manifest_name_));
+      stackage = discarded.get();
+    }
+
+    std::string name = stackage->name_;
+    int flags = 0;
+    FileStamp stamp;
+    size_t i;
+    bool have_elements = false;
+    if(!stackage->manifest_loaded_ && stackage->cache_)
+    {
+      i = stackage->cache_index_;
+      flags = stackage->cache_->flags(i);
+      stamp = stackage->cache_->manifestStamp(i);
+      have_elements = stackage->cache_->elements(i, elements);
+    }
+    else if(!stackage->manifest_loaded_ && have_old_shard &&
+            old_shard.find(stackage->manifest_path_, i) &&
+            (old_shard.flags(i) & BinaryCache::STAMPED) &&
+            stampFile(stackage->manifest_path_, stamp) &&
+            stamp == old_shard.manifestStamp(i))
+    {
+      name = old_shard.name(i);
+      flags = old_shard.flags(i);
+      have_elements = old_shard.elements(i, elements);
+    }
+    if(!have_elements)
+    {
+      flags = 0;
+      try
+      {
+        loadManifest(stackage);
+        if(discarded && stackage->is_wet_package_)
+          stackage->update_wet_information();
+        name = stackage->name_;
+        elements = stackage->elements_;
+        stamp = stackage->manifest_stamp_;
+        if(stackage->manifest_stamped_)
+          flags |= BinaryCache::STAMPED;
+      }
+      catch(Exception& e)
+      {
+        // Remember the failure, so that it's reported without parsing the
+        // manifest again
+        elements.clear();
+        flags |= BinaryCache::PARSE_ERROR;
+        if(stampFile(stackage->manifest_path_, stamp) && stamp.settled(now))
+          flags |= BinaryCache::STAMPED;
+      }
+      if(stackage->is_metapackage_)
+        flags |= BinaryCache::METAPACKAGE;
+    }
+    writer.add(name, stackage->path_, stackage->manifest_path_,
+               stackage->manifest_name_, flags, stamp, elements);
+  }
+}
+
+// A prebuilt index lives next to the tree it describes, rather than in
+// it, so that writing it doesn't change the tree's top directory.
+std::string
+Rosstackage::getSystemIndexPath(const std::string& root)
+{
+  std::string index_path = root;
+  while(index_path.size() > 1 &&
+        index_path[index_path.size() - 1] == fs::path::preferred_separator)
+    index_path.erase(index_path.size() - 1);
+  return index_path + "." + name_ + "_index";
+}
+
+// The prebuilt index for root, if there is one that only root (or we)
+// could have written, and it still describes root: none of the
+// directories that were read to build it may have changed since.
+BinaryCachePtr
+Rosstackage::openSystemIndex(const std::string& root)
+{
+  BinaryCachePtr index(new BinaryCache());
+  if(!index->open(getSystemIndexPath(root), true) || root != index->key() ||
+     !index->numDirectories())
+    return BinaryCachePtr();
+
+  std::vector<std::string> paths;
+  for(size_t i = 0; i < index->numDirectories(); i++)
+    paths.push_back(index->directoryPath(i));
+  std::vector<FileStamp> stamps;
+  std::vector<char> stamped;
+  stampFiles(paths, crawlThreadCount(), stamps, stamped);
+  for(size_t i = 0; i < paths.size(); i++)
+  {
+    if(!stamped[i] || stamps[i] != index->directoryStamp(i))
+      return BinaryCachePtr();
+  }
+  return index;
+}
+
+// Every directory below node that the crawl read, with its stamp.
+// Returns false if there's one that it couldn't read.
+static bool
+collectDirectories(const CrawlNode* node, BinaryCacheWriter& writer)
+{
+  if(node->depth_ > MAX_CRAWL_DEPTH || !node->listed_)
+    return false;
+  writer.addDirectory(node->path_, node->stamp_);
+  for(std::vector<CrawlNode*>::const_iterator it = node->children_.begin();
+      it != node->children_.end();
+      ++it)
+  {
+    if(!collectDirectories(*it, writer))
+      return false;
+  }
+  return true;
+}
+
+bool
+Rosstackage::buildIndex(const std::string& root)
+{
+  if(!fs::is_directory(root))
+  {
+    logError(std::string("can't index ") + root + ": not a directory");
+    return false;
+  }
+
+  // Crawl the tree on its own, with an empty directory index so that
+  // every directory is read and stamped
+  DirectoryIndex empty;
+  CrawlNode* node = new CrawlNode(root, 1);
+  std::vector<CrawlNode*> roots(1, node);
+  bool ok = false;
+  try
+  {
+    WorkQueue<CrawlNode*> queue(crawlThreadCount(),
+                                DirectoryCrawler(manifest_name_, &empty, &reusable_));
+    queue.run(roots);
+
+    BinaryCacheWriter writer;
+    if(!collectDirectories(node, writer))
+      logError(std::string("can't index ") + root +
+               ": not all of its directories could be read");
+    else
+    {
+      std::vector<DirectoryCrawlRecord*> dummy;
+      boost::unordered_set<std::string> dummy2;
+      clearStackages();
+      commitCrawl(node, false, dummy, dummy2);
+      std::vector<CrawlNode*> found;
+      collectStackages(node, found);
+      std::string index_path = getSystemIndexPath(root);
+      addShardRecords(found, index_path, writer);
+      ok = writer.write(index_path, root);
+      if(!ok)
+        logError(std::string("failed to write index ") + index_path, true);
+#if !defined(WIN32)
+      // Unlike the cache, the index is there for everyone to read
+      else
+        chmod(index_path.c_str(), 0644);
+#endif
+    }
+  }
+  catch(...)
+  {
+    delete node;
+    throw;
+  }
+  delete node;
+  return ok;
+}
+
 FILE*
 Rosstackage::validateCache()
 {
   std::string cache_path = getCachePath();
   // first see if it's new enough
-  double cache_max_age = DEFAULT_MAX_CACHE_AGE;
-  const char *user_cache_time_str = getenv("ROS_CACHE_TIMEOUT");
-  if(user_cache_time_str)
-    cache_max_age = atof(user_cache_time_str);
-  if(cache_max_age == 0.0)
+  if(!cacheIsFresh(cache_path))
     return NULL;
-  struct stat s;
-  if(stat(cache_path.c_str(), &s) == 0)
-  {
-    double dt = difftime(time(NULL), s.st_mtime);
-    // Negative cache_max_age means it's always new enough.  It's dangerous
-    // for the user to set this, but rosbash uses it.
-    if ((cache_max_age > 0.0) && (dt > cache_max_age))
-      return NULL;
-  }
   // try to open it
   FILE* cache = fopen(cache_path.c_str(), "r");
   if(!cache)
@@ -2165,10 +3782,152 @@ Rosstackage::validateCache()
   }
 }
 
-bool
-Rosstackage::expandExportString(Stackage* stackage,
-                                const std::string& instring,
-                                std::string& outstring)
+// How long export string expansions are kept, per
+// ROS_EXPORT_CACHE_TIMEOUT; 0 turns keeping them off
+static double
+exportCacheMaxAge()
+{
+  const char* max_age_str = getenv("ROS_EXPORT_CACHE_TIMEOUT");
+  return max_age_str ? atof(max_age_str) : DEFAULT_MAX_CACHE_AGE;
+}
+
+// Environment variables that the commands in export strings commonly
+// depend on, besides those that the strings name themselves
+static const char* EXPORT_CACHE_ENV[] = {
+  "PATH", "LD_LIBRARY_PATH", "PYTHONPATH", "CMAKE_PREFIX_PATH",
+  "ROS_ROOT", "ROS_PACKAGE_PATH", "ROS_DISTRO", "ROS_HOME",
+  "ROS_BOOST_ROOT", "ROS_BOOST_VERSION", "ROS_BOOST_LIB_DIR_NAME",
+  "PKG_CONFIG_PATH", "PKG_CONFIG_LIBDIR", "PKG_CONFIG_SYSROOT_DIR",
+  "PKG_CONFIG_ALLOW_SYSTEM_CFLAGS", "PKG_CONFIG_ALLOW_SYSTEM_LIBS",
+  "ROS_EXPORT_CACHE_KEY", NULL
+};
+
+// The key that an export string's expansion is kept under: the SHA-1 of
+// the command that expands it, the package it's from, the working
+// directory and the environment variables that may change its result.
+// ROS_EXPORT_CACHE_KEY is among them, so that changing it has every
+// command run again.
+static std::string
+exportCacheKey(const std::string& package_path, const std::string& cmd)
+{
+  std::set<std::string> names;
+  for(int i = 0; EXPORT_CACHE_ENV[i]; i++)
+    names.insert(EXPORT_CACHE_ENV[i]);
+  for(std::string::size_type i = cmd.find('$');
+      i != std::string::npos;
+      i = cmd.find('$', i + 1))
+  {
+    std::string::size_type start = i + 1;
+    if(start < cmd.size() && cmd[start] == '{')
+      start++;
+    std::string::size_type end = start;
+    while(end < cmd.size() &&
+          (isalnum((unsigned char)cmd[end]) || cmd[end] == '_'))
+      end++;
+    if(end > start && !isdigit((unsigned char)cmd[start]))
+      names.insert(cmd.substr(start, end - start));
+  }
+
+  std::string material = cmd + "\n" + package_path + "\n";
+  boost::system::error_code ec;
+  material += fs::current_path(ec).string() + "\n";
+  for(std::set<std::string>::const_iterator it = names.begin();
+      it != names.end();
+      ++it)
+  {
+    const char* value = getenv(it->c_str());
+    if(value)
+      material += *it + "=" + value + "\n";
+    else
+      material += *it + "\n";
+  }
+  return sha1_hex(material);
+}
+
+// Variables that the shell sets itself, instead of taking them as they
+// are from the environment
+static const char* SHELL_MANAGED_VARS[] = {
+  "PWD", "OLDPWD", "IFS", "PPID", "OPTIND", "OPTARG", "PS1", "PS2", "PS4",
+  "LINENO", "RANDOM", "SRANDOM", "SECONDS", "SHLVL", "UID", "EUID",
+  "GROUPS", "HOSTNAME", "HOSTTYPE", "OSTYPE", "MACHTYPE", "PIPESTATUS",
+  "SHELLOPTS", "FUNCNAME", "DIRSTACK", "HISTCMD", "EPOCHSECONDS",
+  "EPOCHREALTIME", "COLUMNS", "LINES", "_", NULL
+};
+
+// Expand an export string that only refers to environment variables, as
+// $NAME or ${NAME}, to what the shell command in expandExportString()
+// would print, without running it.  Returns false for anything that needs
+// the shell: command substitution, quotes and escapes, other forms of
+// parameter expansion, variables that aren't set or that the shell sets
+// itself, and results that echo would treat specially or that could be
+// taken for file name patterns.
+static bool
+expandVariables(const std::string& instring, std::string& outstring)
+{
+#if defined(WIN32)
+  return false;
+#else
+  std::string value;
+  for(std::string::size_type i = 0; i < instring.size(); i++)
+  {
+    char c = instring[i];
+    if(c == '"' || c == '\\' || c == '`')
+      return false;
+    if(c != '$')
+    {
+      value += c;
+      continue;
+    }
+    std::string::size_type start = i + 1;
+    bool braced = (start < instring.size() && instring[start] == '{');
+    if(braced)
+      start++;
+    std::string::size_type end = start;
+    while(end < instring.size() &&
+          (isalnum((unsigned char)instring[end]) || instring[end] == '_'))
+      end++;
+    if(end == start || isdigit((unsigned char)instring[start]) ||
+       (braced && (end == instring.size() || instring[end] != '}')))
+      return false;
+    std::string name = instring.substr(start, end - start);
+    if(boost::starts_with(name, "BASH"))
+      return false;
+    for(int j = 0; SHELL_MANAGED_VARS[j]; j++)
+    {
+      if(name == SHELL_MANAGED_VARS[j])
+        return false;
+    }
+    const char* env = getenv(name.c_str());
+    if(!env)
+      return false;
+    value += env;
+    i = braced ? end : end - 1;
+  }
+
+  // 'echo $ret' splits the value into words, expands any patterns among
+  // them and prints them with single spaces in between
+  if(value.find_first_of("*?[\\") != std::string::npos)
+    return false;
+  std::vector<std::string> words;
+  boost::split(words, value, boost::is_any_of(" \t\n"),
+               boost::token_compress_on);
+  words.erase(std::remove(words.begin(), words.end(), std::string()),
+              words.end());
+  // echo's options
+  if(!words.empty() && words[0].size() > 1 && words[0][0] == '-' &&
+     words[0].find_first_not_of("neE", 1) == std::string::npos)
+    return false;
+  outstring = boost::join(words, " ");
+  return true;
+#endif
+}
+
+// Substitute ${prefix} in an export string, and whatever else can be
+// expanded without a shell.  Returns the shell command that expands the
+// rest, or an empty string if outstring is already the result.
+static std::string
+exportCommand(Stackage* stackage, const std::string& instring,
+              std::string& outstring)
 {
   outstring = instring;
   for(std::string::size_type i = outstring.find(MANIFEST_PREFIX);
@@ -2184,7 +3943,16 @@ Rosstackage::expandExportString(Stackage* stackage,
   // a backtick wrapping a command
   if (outstring.find_first_of("$`") == std::string::npos)
   {
-    return true;
+    return std::string();
+  }
+
+  // Nor is it needed for a string that only refers to environment
+  // variables
+  std::string expanded;
+  if(expandVariables(outstring, expanded))
+  {
+    outstring = expanded;
+    return std::string();
   }
 
   // Do backquote substitution.  E.g.,  if we find this string:
@@ -2205,9 +3973,85 @@ Rosstackage::expandExportString(Stackage* stackage,
        s != std::string::npos;
        s = cmd.find(token, s))
     cmd.replace(s,token.length(),std::string(" "));
+  return cmd;
+}
 
+// Run the command that exportCommand() built, reading what it prints into
+// output.  Safe to call from several threads at once.
+static int
+runExportCommand(const std::string& cmd, std::string& output)
+{
   FILE* p;
   if(!(p = popen(cmd.c_str(), "r")))
+    return EXPORT_COMMAND_NOT_STARTED;
+  // Read the command's output, however long
+  std::string buf;
+  char chunk[8192];
+  for(;;)
+  {
+    size_t n = fread(chunk, 1, sizeof(chunk), p);
+    buf.append(chunk, n);
+    if(n == sizeof(chunk))
+      continue;
+    if(!ferror(p) || errno != EINTR)
+      break;
+    clearerr(p);
+  }
+  // Close the subprocess, checking exit status
+  if(pclose(p) != 0)
+    return EXPORT_COMMAND_FAILED;
+  // Strip trailing newline, which was added by our call to echo
+  output = buf.c_str();
+  if(!output.empty())
+    output.erase(output.size() - 1);
+  return EXPORT_COMMAND_OK;
+}
+
+ExportCache*
+Rosstackage::getExportCache()
+{
+  if(exportCacheMaxAge() <= 0.0)
+    return NULL;
+  if(!export_cache_)
+  {
+    export_cache_.reset(new ExportCache());
+    export_cache_->load(getExportCachePath(), exportCacheMaxAge());
+  }
+  return export_cache_.get();
+}
+
+bool
+Rosstackage::expandExportString(Stackage* stackage,
+                                const std::string& instring,
+                                std::string& outstring)
+{
+  std::string cmd = exportCommand(stackage, instring, outstring);
+  if(cmd.empty())
+    return true;
+
+  // Unless it's been run lately in the same setting
+  ExportCache* cache = getExportCache();
+  std::string key;
+  if(cache)
+  {
+    key = exportCacheKey(stackage->path_, cmd);
+    if(cache->find(key, outstring))
+      return true;
+  }
+
+  // or has just been run along with the rest of the query
+  int status;
+  std::string output;
+  boost::unordered_map<std::string, std::pair<int, std::string> >::const_iterator prefetched = expansions_.find(cmd);
+  if(prefetched != expansions_.end())
+  {
+    status = prefetched->second.first;
+    output = prefetched->second.second;
+  }
+  else
+    status = runExportCommand(cmd, output);
+
+  if(status == EXPORT_COMMAND_NOT_STARTED)
   {
     std::string errmsg =
             std::string("failed to execute backquote expression ") +
@@ -2216,35 +4060,232 @@ Rosstackage::expandExportString(Stackage* stackage,
     logWarn(errmsg, true);
     return false;
   }
+  else if(status == EXPORT_COMMAND_FAILED)
+  {
+    std::string errmsg =
+            std::string("got non-zero exit status from executing backquote expression ") +
+            cmd + " in " +
+            stackage->manifest_path_;
+    return false;
+  }
   else
   {
-    char buf[8192];
-    memset(buf,0,sizeof(buf));
-    // Read the command's output
-    do
-    {
-      clearerr(p);
-      while(fgets(buf + strlen(buf),sizeof(buf)-strlen(buf)-1,p));
-    } while(ferror(p) && errno == EINTR);
-    // Close the subprocess, checking exit status
-    if(pclose(p) != 0)
-    {
-      std::string errmsg =
-              std::string("got non-zero exit status from executing backquote expression ") +
-              cmd + " in " +
-              stackage->manifest_path_;
-      return false;
+    // Replace the backquote expression with the new text
+    outstring = output;
+    if(cache)
+      cache->insert(key, outstring);
+  }
+
+  return true;
+}
+
+// How many threads to run the commands in export strings on:
+// ROS_EXPORT_THREADS if set, otherwise the number of cores (up to a
+// limit).  1 runs each one as the query comes to it.
+static size_t
+exportThreadCount()
+{
+  const char* threads_str = getenv("ROS_EXPORT_THREADS");
+  if(threads_str)
+  {
+    int threads = atoi(threads_str);
+    if(threads > 0)
+      return threads;
+  }
+  size_t threads = boost::thread::hardware_concurrency();
+  if(threads < 1)
+    threads = 1;
+  return std::min(threads, MAX_DEFAULT_EXPORT_THREADS);
+}
+
+// A command from an export string, or a call to
+// rosdep2.rospack.call_pkg_config() when cmd_ is empty, that
+// prefetchExports() runs
+struct ExportJob
+{
+  std::string cmd_;
+  std::string option_;
+  std::string name_;
+  int status_;
+  std::string output_;
+};
+
+class ExportJobRunner
+{
+  public:
+    ExportJobRunner(std::vector<ExportJob>& jobs, PyObject* pkg_config) :
+            jobs_(jobs),
+            pkg_config_(pkg_config) {}
+    void operator()(const size_t& index,
+                    WorkQueue<size_t>&,
+                    size_t) const
+    {
+      ExportJob& job = jobs_[index];
+      if(!job.cmd_.empty())
+      {
+        job.status_ = runExportCommand(job.cmd_, job.output_);
+        return;
+      }
+      // The GIL is let go while call_pkg_config() waits for pkg-config
+      PyGILState_STATE gstate = PyGILState_Ensure();
+      PyObject* pValue = PyObject_CallFunction(pkg_config_, "ss",
+                                               job.option_.c_str(),
+                                               job.name_.c_str());
+      if(!pValue)
+        PyErr_Clear();
+      else if(pValue == Py_None)
+        job.status_ = EXPORT_COMMAND_FAILED;
+      else if(PyBytes_Check(pValue))
+      {
+        job.output_ = PyBytes_AsString(pValue);
+        job.status_ = EXPORT_COMMAND_OK;
+      }
+      Py_XDECREF(pValue);
+      PyGILState_Release(gstate);
     }
+  private:
+    std::vector<ExportJob>& jobs_;
+    PyObject* pkg_config_;
+};
+
+// rosdep2.rospack.call_pkg_config(), or NULL if it can't be had.  Call
+// with the GIL held.
+static PyObject*
+pkgConfigFunction()
+{
+  static PyObject* pFunc = NULL;
+  if(!pFunc)
+  {
+    PyObject* pModule = PyImport_ImportModule("rosdep2.rospack");
+    if(!pModule)
+    {
+      PyErr_Clear();
+      return NULL;
+    }
+    PyObject* pValue = PyObject_GetAttrString(pModule, "call_pkg_config");
+    if(!pValue)
+      PyErr_Clear();
+    else if(!PyCallable_Check(pValue))
+      Py_DECREF(pValue);
     else
+      pFunc = pValue;
+  }
+  return pFunc;
+}
+
+// Before a query expands the export strings of its packages one after
+// another, run the commands in them, and the calls to pkg-config for
+// wet packages that cpp_exports() can't answer in process, on up to
+// exportThreadCount() threads at once.  The query then comes to the
+// results in its own order, in expansions_ and pkg_config_flags.
+// Commands that are cached aren't run again; pkg-config calls that raise
+// exceptions are left for cpp_exports() to make again, so that they are
+// reported as they always have been.
+void
+Rosstackage::prefetchExports(const std::vector<std::pair<Stackage*, std::string> >& strings,
+                             const std::string& pkg_config_option,
+                             const std::vector<std::string>& pkg_config_names,
+                             boost::unordered_map<std::string, std::pair<int, std::string> >& pkg_config_flags)
+{
+  expansions_.clear();
+  size_t num_threads = exportThreadCount();
+  if(num_threads < 2)
+    return;
+
+  std::vector<ExportJob> jobs;
+  boost::unordered_set<std::string> cmds;
+  ExportCache* cache = getExportCache();
+  for(std::vector<std::pair<Stackage*, std::string> >::const_iterator it = strings.begin();
+      it != strings.end();
+      ++it)
+  {
+    std::string outstring;
+    std::string cmd = exportCommand(it->first, it->second, outstring);
+    if(cmd.empty() || !cmds.insert(cmd).second)
+      continue;
+    if(cache && cache->find(exportCacheKey(it->first->path_, cmd), outstring))
+      continue;
+    ExportJob job;
+    job.cmd_ = cmd;
+    job.status_ = EXPORT_COMMAND_NOT_STARTED;
+    jobs.push_back(job);
+  }
+
+  PyObject* pkg_config = NULL;
+  if(!pkg_config_names.empty())
+  {
+    initPython();
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    pkg_config = pkgConfigFunction();
+    PyGILState_Release(gstate);
+#if PY_VERSION_HEX < 0x03040000
+    // Before Python 3.4 there's no asking whether this thread holds the
+    // GIL, so pkg-config is only run ahead from the one known to
+    if(python_thread != boost::this_thread::get_id())
+      pkg_config = NULL;
+#endif
+  }
+  if(pkg_config)
+  {
+    for(std::vector<std::string>::const_iterator it = pkg_config_names.begin();
+        it != pkg_config_names.end();
+        ++it)
     {
-      // Strip trailing newline, which was added by our call to echo
-      buf[strlen(buf)-1] = '\0';
-      // Replace the backquote expression with the new text
-      outstring = buf;
+      ExportJob job;
+      job.option_ = pkg_config_option;
+      job.name_ = *it;
+      job.status_ = EXPORT_COMMAND_NOT_STARTED;
+      jobs.push_back(job);
     }
   }
+  // One job might as well be run when the query gets to it
+  if(jobs.size() < 2)
+    return;
 
-  return true;
+  // The threads can't take the GIL while this one holds it, as it does
+  // from initPython() on
+  PyThreadState* saved = NULL;
+  if(pkg_config)
+  {
+#if PY_VERSION_HEX < 0x03070000
+    PyEval_InitThreads();
+#endif
+#if PY_VERSION_HEX >= 0x03040000
+    if(PyGILState_Check())
+      saved = PyEval_SaveThread();
+#else
+    saved = PyEval_SaveThread();
+#endif
+  }
+  std::vector<size_t> indices;
+  for(size_t i = 0; i < jobs.size(); i++)
+    indices.push_back(i);
+  WorkQueue<size_t> queue(std::min(num_threads, jobs.size()),
+                          ExportJobRunner(jobs, pkg_config));
+  try
+  {
+    queue.run(indices);
+  }
+  catch(std::runtime_error&)
+  {
+    // Whatever didn't get done is done by the query itself
+  }
+  if(saved)
+    PyEval_RestoreThread(saved);
+
+  for(std::vector<ExportJob>::const_iterator it = jobs.begin();
+      it != jobs.end();
+      ++it)
+  {
+    if(!it->cmd_.empty())
+    {
+      // Commands that couldn't be started are tried again
+      if(it->status_ != EXPORT_COMMAND_NOT_STARTED)
+        expansions_[it->cmd_] = std::make_pair(it->status_, it->output_);
+    }
+    else if(it->status_ != EXPORT_COMMAND_NOT_STARTED)
+      pkg_config_flags[it->name_] = std::make_pair(it->status_, it->output_);
+  }
 }
 
 /////////////////////////////////////////////////////////////
@@ -2266,16 +4307,19 @@ Rospack::usage()
           "    help\n"
           "    cflags-only-I     [--deps-only] [package]\n"
           "    cflags-only-other [--deps-only] [package]\n"
+          "    daemon\n"
           "    depends           [package] (alias: deps)\n"
           "    depends-indent    [package] (alias: deps-indent)\n"
           "    depends-manifests [package] (alias: deps-manifests)\n"
           "    depends-msgsrv    [package] (alias: deps-msgsrv)\n"
           "    depends-on        [package]\n"
           "    depends-on1       [package]\n"
-          "    depends-why --target=<target> [package] (alias: deps-why)\n"
+          "    depends-why [--shortest | --max-paths=N | --count]\n"
+          "                --target=<target> [package] (alias: deps-why)\n"
           "    depends1          [package] (alias: deps1)\n"
           "    export [--deps-only] --lang=<lang> --attrib=<attrib> [package]\n"
           "    find [package]\n"
+          "    index build <root>\n"
           "    langs\n"
           "    libs-only-L     [--deps-only] [package]\n"
           "    libs-only-l     [--deps-only] [package]\n"
@@ -2325,11 +4369,14 @@ Rosstack::usage()
           "    depends-manifests [stack] (alias: deps-manifests)\n"
           "    depends1 [stack] (alias: deps1)\n"
           "    depends-indent [stack] (alias: deps-indent)\n"
-          "    depends-why --target=<target> [stack] (alias: deps-why)\n"
+          "    depends-why [--shortest | --max-paths=N | --count]\n"
+          "                --target=<target> [stack] (alias: deps-why)\n"
           "    depends-on [stack]\n"
           "    depends-on1 [stack]\n"
           "    contains [package]\n"
           "    contains-path [package]\n"
+          "    daemon\n"
+          "    index build <root>\n"
           "    profile [--length=<length>] \n\n"
           " If [stack] is omitted, the current working directory\n"
           " is used (if it contains a stack.xml).\n\n";
@@ -2340,17 +4387,16 @@ std::string Rosstack::get_manifest_type()
   return "stack";
 }
 
-tinyxml2::XMLElement*
-get_manifest_root(Stackage* stackage)
+const std::vector<ManifestElement>&
+get_manifest_elements(Stackage* stackage)
 {
-  tinyxml2::XMLElement* ele = stackage->manifest_.RootElement();
-  if(!ele)
+  if(!stackage->manifest_loaded_)
   {
     std::string errmsg = std::string("error parsing manifest of package ") +
             stackage->name_ + " at " + stackage->manifest_path_;
     throw Exception(errmsg);
   }
-  return ele;
+  return stackage->elements_;
 }
 
 double
@@ -31,6 +31,7 @@
 
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
 #include <algorithm>
 #include <iostream>
 #include <stdlib.h>
@@ -64,9 +65,14 @@ rospack_run(int argc, char** argv, rospack::Rosstackage& rp, std::string& output
   std::string attrib;
   std::string top;
   std::string target;
+  std::string path;
   bool zombie_only = false;
   std::string length_str;
   int length;
+  bool shortest = false;
+  bool count = false;
+  std::string max_paths_str;
+  int max_paths = -1;
   if(vm.count("command"))
     command = vm["command"].as<std::string>();
 
@@ -108,8 +114,27 @@ rospack_run(int argc, char** argv, rospack::Rosstackage& rp, std::string& output
     top = vm["top"].as<std::string>();
   if(vm.count("target"))
     target = vm["target"].as<std::string>();
+  if(vm.count("path"))
+    path = vm["path"].as<std::string>();
   if(vm.count("zombie-only"))
     zombie_only = true;
+  if(vm.count("shortest"))
+    shortest = true;
+  if(vm.count("count"))
+    count = true;
+  if(vm.count("max-paths"))
+  {
+    max_paths_str = vm["max-paths"].as<std::string>();
+    // Anything but a whole number is as invalid as one that's too small
+    try
+    {
+      max_paths = boost::lexical_cast<int>(max_paths_str);
+    }
+    catch(boost::bad_lexical_cast&)
+    {
+      max_paths = 0;
+    }
+  }
   if(vm.count("length"))
   {
     length_str = vm["length"].as<std::string>();
@@ -153,7 +178,7 @@ rospack_run(int argc, char** argv, rospack::Rosstackage& rp, std::string& output
       else if(command == "depends-indent" || command == "deps-indent")
         output.append("[package]\n\nPrint newline-separated, indented list of the entire dependency chain for the package.");
       else if(command == "depends-why" || command == "deps-why")
-        output.append("--target=TARGET [package]\n\nPrint newline-separated presentation of all dependency chains from the package to TARGET. ");
+        output.append("[--shortest | --max-paths=N | --count] --target=TARGET [package]\n\nPrint newline-separated presentation of all dependency chains from the package to TARGET. With --shortest, print just one of the shortest chains; with --max-paths, print at most N chains; with --count, print just the number of chains.");
       else if(command == "depends-msgsrv" || command == "deps-msgsrv")
         output.append("[package]\n\nPrint space-separated list of message-generation marker files for all dependencies of the package.  Used internally by rosbuild.");
       else if(command == "rosdep" || command == "rosdeps")
@@ -184,6 +209,10 @@ rospack_run(int argc, char** argv, rospack::Rosstackage& rp, std::string& output
         output.append("[--deps-only] [package]\n\nPrint space-separated list of export/cpp/libs that don't start with -l or -L.\n\nIf --deps-only is provided, then the package itself is excluded.");
       else if(command == "profile")
         output.append("[--length=<length>] [--zombie-only]\n\nForce a full crawl of package directories and report the directories that took the longest time to crawl.\n\n--length=N how many directories to display\n\n--zombie-only Only print directories that do not have any manifests.");
+      else if(command == "daemon")
+        output.append("\n\nRun in the foreground, answering the commands of other invocations over a socket in ROS_HOME, so that they needn't start up from scratch.  Invocations run commands themselves whenever no daemon is running.  Stop it with SIGINT or SIGTERM.");
+      else if(command == "index")
+        output.append(" build <root>\n\nWrite a prebuilt index of the tree at <root> (e.g., an install space), next to it.  Crawls take the tree's packages from the index instead of walking it, for as long as none of its directories has changed.  <root> should be spelled as it appears in ROS_PACKAGE_PATH.");
       output.append("\n");
     } else {
         output.append(rp.usage());
@@ -191,6 +220,37 @@ rospack_run(int argc, char** argv, rospack::Rosstackage& rp, std::string& output
     return true;
   }
 
+  // COMMAND: index build <root>
+  // The tree is crawled on its own, so the search path doesn't matter.
+  if(command == "index")
+  {
+    if(package != "build" || !path.size())
+    {
+      rp.logError(std::string("usage: ") + rp.getName() + " index build <root>");
+      return false;
+    }
+    if(target.size() || top.size() || length_str.size() ||
+       zombie_only || deps_only || lang.size() || attrib.size() ||
+       shortest || count || max_paths_str.size())
+    {
+      rp.logError( "invalid option(s) given");
+      return false;
+    }
+    return rp.buildIndex(path);
+  }
+  if(path.size())
+  {
+    rp.logError( "invalid option(s) given");
+    return false;
+  }
+  // Only depends-why takes these
+  if((shortest || count || max_paths_str.size()) &&
+     command != "depends-why" && command != "deps-why")
+  {
+    rp.logError( "invalid option(s) given");
+    return false;
+  }
+
   std::vector<std::string> search_path;
   if(!rp.getSearchPathFromEnv(search_path))
     return false;
@@ -461,13 +521,23 @@ rospack_run(int argc, char** argv, rospack::Rosstackage& rp, std::string& output
       return false;
     }
     if(top.size() || length_str.size() ||
-       zombie_only || deps_only || lang.size() || attrib.size())
+       zombie_only || deps_only || lang.size() || attrib.size() ||
+       (shortest + count + (max_paths_str.size() > 0) > 1) ||
+       (max_paths_str.size() && max_paths < 1))
     {
       rp.logError( "invalid option(s) given");
       return false;
     }
+    if(count)
+    {
+      boost::uint64_t num_chains;
+      if(!rp.depsWhyCount(package, target, num_chains))
+        return false;
+      output.append(boost::lexical_cast<std::string>(num_chains) + "\n");
+      return true;
+    }
     std::string why_output;
-    if(!rp.depsWhy(package, target, why_output))
+    if(!rp.depsWhy(package, target, why_output, shortest, max_paths))
       return false;
     output.append(why_output);
     return true;
@@ -835,18 +905,22 @@ parse_args(int argc, char** argv,
           ("command", po::value<std::string>(), "command")
           ("package", po::value<std::string>(), "package")
           ("target", po::value<std::string>(), "target")
+          ("path", po::value<std::string>(), "path")
           ("deps-only", "deps-only")
           ("lang", po::value<std::string>(), "lang")
           ("attrib", po::value<std::string>(), "attrib")
           ("top", po::value<std::string>(), "top")
           ("length", po::value<std::string>(), "length")
           ("zombie-only", "zombie-only")
+          ("shortest", "shortest")
+          ("count", "count")
+          ("max-paths", po::value<std::string>(), "max-paths")
           ("help", "help")
           ("-h", "help")
           ("quiet,q", "quiet");
 
   po::positional_options_description pd;
-  pd.add("command", 1).add("package", 1);
+  pd.add("command", 1).add("package", 1).add("path", 1);
   try
   {
     po::store(po::command_line_parser(argc, argv).options(desc).positional(pd).run(), vm);
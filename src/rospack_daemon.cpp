@@ -0,0 +1,827 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rospack_daemon.h"
+#include "rospack_cmdline.h"
+#include "crawl.h"
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+#include <vector>
+#if defined(__GNUC__)
+  #include <cxxabi.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(WIN32)
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <pwd.h>
+  #include <signal.h>
+  #include <unistd.h>
+  #include <sys/socket.h>
+  #include <sys/stat.h>
+  #include <sys/time.h>
+  #include <sys/types.h>
+  #include <sys/un.h>
+  #include <sys/wait.h>
+#endif
+
+#if !defined(WIN32)
+extern char** environ;
+#endif
+
+namespace rospack
+{
+
+#if !defined(WIN32)
+
+// A request is a header of four words (PROTOCOL_MAGIC, the size of what
+// follows, argc and the number of environment variables), then the working
+// directory, argv and the environment as NUL-terminated strings.  The
+// daemon answers with REQUEST_ACCEPTED once it has the whole request.  When
+// the command is done, it sends a reply of three words (the exit status and
+// the sizes of the command's stdout and stderr), followed by that output,
+// for the client to write out itself.
+enum
+{
+  HEADER_MAGIC = 0,
+  HEADER_SIZE = 1,
+  HEADER_ARGC = 2,
+  HEADER_ENVC = 3,
+  HEADER_WORDS = 4
+};
+enum
+{
+  REPLY_STATUS = 0,
+  REPLY_STDOUT = 1,
+  REPLY_STDERR = 2,
+  REPLY_WORDS = 3
+};
+static const boost::uint32_t PROTOCOL_MAGIC = 0x72700002;
+static const char REQUEST_ACCEPTED = 'A';
+// The exit status for a command that died of an uncaught exception
+static const boost::int32_t STATUS_ABORTED = -1;
+static const size_t MAX_REQUEST_SIZE = 16 * 1024 * 1024;
+// How long (in seconds) the daemon waits for a client to send its request,
+// and the client for the daemon to accept it
+static const double REQUEST_TIMEOUT = 2.0;
+// How long a client waits for the answer, unless ROS_DAEMON_TIMEOUT says
+// otherwise
+static const double DEFAULT_ANSWER_TIMEOUT = 60.0;
+// How many commands may be running at once; further requests wait
+static const int MAX_RUNNING = 64;
+// How many environments to keep a warm instance for, and how often (in
+// seconds) to bring one up to date with what's on disk
+static const size_t MAX_WARM = 8;
+static const double REWARM_INTERVAL = 60.0;
+
+#if defined(MSG_NOSIGNAL)
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+static double
+now()
+{
+  struct timeval tod;
+  gettimeofday(&tod, NULL);
+  return tod.tv_sec + 1e-6 * tod.tv_usec;
+}
+
+// Where the daemon for name listens: next to the cache, in ROS_HOME (or
+// ~/.ros).  Empty if that can't be worked out or is too long for a socket.
+static std::string
+socketPath(const std::string& name)
+{
+  std::string dir;
+  const char* ros_home = getenv("ROS_HOME");
+  if(ros_home)
+    dir = ros_home;
+  else
+  {
+    // Same lookup as for the cache
+    const char* home_path;
+    struct passwd* passwd_ent;
+    if((passwd_ent = getpwuid(geteuid())))
+      home_path = passwd_ent->pw_dir;
+    else
+      home_path = getenv("HOME");
+    if(!home_path)
+      return std::string();
+    dir = std::string(home_path) + "/.ros";
+  }
+  std::string path = dir + "/" + name + "_daemon.sock";
+  if(path.size() >= sizeof(((struct sockaddr_un*)NULL)->sun_path))
+    return std::string();
+  return path;
+}
+
+// Keep fd from the commands that exports run
+static void
+setCloseOnExec(int fd)
+{
+  if(fd >= 0)
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+// Sockets are non-blocking, so that nobody waits on the other side for
+// longer than they mean to
+static void
+setNonBlocking(int fd)
+{
+  if(fd >= 0)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static bool
+socketAddress(const std::string& path, struct sockaddr_un& addr)
+{
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.empty() || path.size() >= sizeof(addr.sun_path))
+    return false;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return true;
+}
+
+// Is the process at the other end of fd running as our user?  The daemon
+// runs whatever command, environment and working directory it's sent as
+// that user, so nobody else may send it any.
+static bool
+peerIsUs(int fd)
+{
+#if defined(__linux__)
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+          cred.uid == geteuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  return getpeereid(fd, &uid, &gid) == 0 && uid == geteuid();
+#endif
+}
+
+// A socket connected to whatever is listening at path, or -1.  A daemon
+// whose backlog is full counts as not there.
+static int
+connectTo(const std::string& path)
+{
+  struct sockaddr_un addr;
+  if(!socketAddress(path, addr))
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0)
+    return -1;
+  setCloseOnExec(fd);
+  setNonBlocking(fd);
+  int ret;
+  do
+    ret = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+  while(ret < 0 && errno == EINTR);
+  if(ret < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Wait until fd is ready for events or deadline (a time from now(), or
+// negative for none) has passed
+static bool
+waitFor(int fd, short events, double deadline)
+{
+  for(;;)
+  {
+    int timeout = -1;
+    if(deadline >= 0)
+    {
+      double left = deadline - now();
+      if(left <= 0)
+        return false;
+      timeout = (int)(left * 1000) + 1;
+    }
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    int ready = poll(&pfd, 1, timeout);
+    if(ready > 0)
+      return true;
+    if(ready < 0 && errno != EINTR)
+      return false;
+  }
+}
+
+static bool
+sendAll(int fd, const char* data, size_t size, double deadline)
+{
+  while(size)
+  {
+    ssize_t n = send(fd, data, size, SEND_FLAGS);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      if(!waitFor(fd, POLLOUT, deadline))
+        return false;
+      continue;
+    }
+    if(n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool
+recvAll(int fd, char* data, size_t size, double deadline)
+{
+  while(size)
+  {
+    ssize_t n = recv(fd, data, size, 0);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      if(!waitFor(fd, POLLIN, deadline))
+        return false;
+      continue;
+    }
+    if(n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool
+recvString(int fd, size_t size, std::string& str, double deadline)
+{
+  std::vector<char> buf(size + 1);
+  if(!recvAll(fd, &buf[0], size, deadline))
+    return false;
+  str.assign(&buf[0], size);
+  return true;
+}
+
+// How long to wait for the daemon's answer: ROS_DAEMON_TIMEOUT seconds, or
+// for as long as it takes if that's 0
+static double
+answerTimeout()
+{
+  const char* timeout = getenv("ROS_DAEMON_TIMEOUT");
+  if(!timeout)
+    return DEFAULT_ANSWER_TIMEOUT;
+  char* end;
+  double seconds = strtod(timeout, &end);
+  if(end == timeout || *end || seconds < 0)
+    return DEFAULT_ANSWER_TIMEOUT;
+  return seconds;
+}
+
+bool
+daemon_forward(const std::string& name,
+               int argc, char** argv,
+               int& status)
+{
+  int fd = connectTo(socketPath(name));
+  if(fd < 0)
+    return false;
+
+  std::string payload;
+  std::vector<char> cwd(256);
+  while(!getcwd(&cwd[0], cwd.size()))
+  {
+    if(errno != ERANGE)
+    {
+      close(fd);
+      return false;
+    }
+    cwd.resize(cwd.size() * 2);
+  }
+  payload.append(&cwd[0]);
+  payload.push_back('\0');
+  for(int i = 0; i < argc; i++)
+  {
+    payload.append(argv[i]);
+    payload.push_back('\0');
+  }
+  boost::uint32_t envc = 0;
+  for(char** env = environ; env && *env; env++, envc++)
+  {
+    payload.append(*env);
+    payload.push_back('\0');
+  }
+
+  boost::uint32_t header[HEADER_WORDS];
+  header[HEADER_MAGIC] = PROTOCOL_MAGIC;
+  header[HEADER_SIZE] = payload.size();
+  header[HEADER_ARGC] = argc;
+  header[HEADER_ENVC] = envc;
+
+  // Until the whole answer is in, nothing has been written, so if the
+  // daemon is too busy to take the command, doesn't answer in time or goes
+  // away, we can still run the command ourselves
+  double deadline = now() + REQUEST_TIMEOUT;
+  char accepted = 0;
+  if(!sendAll(fd, (const char*)header, sizeof(header), deadline) ||
+     !sendAll(fd, payload.data(), payload.size(), deadline) ||
+     !recvAll(fd, &accepted, 1, deadline) ||
+     accepted != REQUEST_ACCEPTED)
+  {
+    close(fd);
+    return false;
+  }
+
+  double timeout = answerTimeout();
+  deadline = timeout > 0 ? now() + timeout : -1.0;
+  boost::uint32_t reply[REPLY_WORDS];
+  std::string out;
+  std::string err;
+  bool ok = recvAll(fd, (char*)reply, sizeof(reply), deadline) &&
+          recvString(fd, reply[REPLY_STDOUT], out, deadline) &&
+          recvString(fd, reply[REPLY_STDERR], err, deadline);
+  close(fd);
+  if(!ok)
+    return false;
+
+  fwrite(err.data(), 1, err.size(), stderr);
+  fflush(stderr);
+  fwrite(out.data(), 1, out.size(), stdout);
+  fflush(stdout);
+  boost::int32_t result = (boost::int32_t)reply[REPLY_STATUS];
+  // The command would have taken us down with it
+  if(result == STATUS_ABORTED)
+    abort();
+  status = result;
+  return true;
+}
+
+// Make the environment exactly env
+static void
+setEnvironment(const std::vector<const char*>& env)
+{
+  std::vector<std::string> names;
+  for(char** it = environ; it && *it; it++)
+  {
+    const char* eq = strchr(*it, '=');
+    if(eq)
+      names.push_back(std::string(*it, eq - *it));
+  }
+  for(size_t i = 0; i < names.size(); i++)
+    unsetenv(names[i].c_str());
+  for(size_t i = 0; i < env.size(); i++)
+  {
+    const char* eq = strchr(env[i], '=');
+    if(eq && eq != env[i])
+      setenv(std::string(env[i], eq - env[i]).c_str(), eq + 1, 1);
+  }
+}
+
+// A command that a client has handed over
+struct Request
+{
+  std::vector<char> payload;
+  const char* cwd;
+  std::vector<char*> argv;
+  std::vector<const char*> env;
+};
+
+// Read a request from fd, giving up on a client that doesn't send all of
+// it in time.  The descriptors that clients of older daemons sent along
+// aren't received, which closes them.
+static bool
+readRequest(int fd, Request& request)
+{
+  double deadline = now() + REQUEST_TIMEOUT;
+  boost::uint32_t header[HEADER_WORDS];
+  if(!recvAll(fd, (char*)header, sizeof(header), deadline) ||
+     header[HEADER_MAGIC] != PROTOCOL_MAGIC ||
+     header[HEADER_SIZE] > MAX_REQUEST_SIZE ||
+     header[HEADER_ARGC] == 0)
+    return false;
+  request.payload.resize(header[HEADER_SIZE] + 1);
+  if(!recvAll(fd, &request.payload[0], header[HEADER_SIZE], deadline))
+    return false;
+
+  std::vector<char*> strings;
+  for(size_t i = 0; i < header[HEADER_SIZE]; i += strlen(&request.payload[i]) + 1)
+    strings.push_back(&request.payload[i]);
+  if(strings.size() != 1 + (size_t)header[HEADER_ARGC] + header[HEADER_ENVC])
+    return false;
+  request.cwd = strings[0];
+  request.argv.assign(strings.begin() + 1, strings.begin() + 1 + header[HEADER_ARGC]);
+  request.argv.push_back(NULL);
+  request.env.assign(strings.begin() + 1 + header[HEADER_ARGC], strings.end());
+  return true;
+}
+
+// A Rosstackage that has crawled in the environment of some client, kept
+// for the next clients that come with the same environment
+struct WarmInstance
+{
+  std::string key;
+  boost::shared_ptr<Rosstackage> rp;
+  double crawled;
+  double used;
+};
+
+// Variables that a shell or make changes from one command to the next,
+// without any bearing on the answer
+static const char* const VOLATILE_VARIABLES[] =
+{
+  "_", "OLDPWD", "PWD", "SHLVL", "MAKEFLAGS", "MAKELEVEL", "MFLAGS", NULL
+};
+
+static std::string
+environmentKey(const std::vector<const char*>& env)
+{
+  std::vector<std::string> vars;
+  for(size_t i = 0; i < env.size(); i++)
+  {
+    std::string var = env[i];
+    std::string var_name = var.substr(0, var.find('='));
+    bool keep = true;
+    for(const char* const* it = VOLATILE_VARIABLES; *it && keep; it++)
+      keep = var_name != *it;
+    if(keep)
+      vars.push_back(var);
+  }
+  std::sort(vars.begin(), vars.end());
+  std::string key;
+  for(size_t i = 0; i < vars.size(); i++)
+  {
+    key.append(vars[i]);
+    key.push_back('\0');
+  }
+  return key;
+}
+
+// The warm instance for request's environment, crawled (again) if it's
+// new or hasn't been for a while.  Null if it couldn't be.
+static WarmInstance*
+warmInstance(std::vector<WarmInstance>& warm,
+             const Request& request,
+             RosstackageFactory factory)
+{
+  std::string key = environmentKey(request.env);
+  size_t i = 0;
+  while(i < warm.size() && warm[i].key != key)
+    i++;
+  if(i == warm.size())
+  {
+    if(warm.size() >= MAX_WARM)
+    {
+      // Make room by dropping the one that went unused the longest
+      i = 0;
+      for(size_t j = 1; j < warm.size(); j++)
+      {
+        if(warm[j].used < warm[i].used)
+          i = j;
+      }
+    }
+    else
+      warm.push_back(WarmInstance());
+    warm[i].key = key;
+    warm[i].rp.reset();
+    warm[i].crawled = 0.0;
+  }
+
+  WarmInstance& instance = warm[i];
+  instance.used = now();
+  if(instance.rp && instance.used - instance.crawled < REWARM_INTERVAL)
+    return &instance;
+
+  // Crawl as the client would, so that the children that answer clients
+  // only have to check that the stackages are still there
+  setEnvironment(request.env);
+  bool ok = chdir(request.cwd) == 0;
+  try
+  {
+    if(ok && !instance.rp)
+      instance.rp.reset(factory());
+    if(ok)
+    {
+      instance.rp->setQuiet(true);
+      instance.rp->forgetCrawl();
+      std::vector<std::string> search_path;
+      instance.rp->getSearchPathFromEnv(search_path);
+      instance.rp->crawl(search_path, false);
+      instance.crawled = now();
+    }
+  }
+  catch(std::exception&)
+  {
+    ok = false;
+  }
+  // Its ring would be shared with the children
+  releaseIoRing();
+  if(!ok)
+  {
+    warm.erase(warm.begin() + i);
+    return NULL;
+  }
+  return &instance;
+}
+
+// Read everything that was written to file
+static std::string
+readAll(FILE* file)
+{
+  std::string contents;
+  rewind(file);
+  char buf[8192];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), file)) > 0)
+    contents.append(buf, n);
+  return contents;
+}
+
+// Run request on rp (or on a fresh Rosstackage from factory, if it's
+// null), in the client's environment and working directory, and send the
+// client the exit status and what the command wrote.  This is the child
+// forked for the request, so nothing it does lasts beyond the request.
+static int
+runRequest(int fd,
+           const Request& request,
+           boost::shared_ptr<Rosstackage> rp,
+           const std::string& name,
+           RosstackageFactory factory)
+{
+  FILE* out = tmpfile();
+  FILE* err = tmpfile();
+  if(!out || !err)
+    return 1;
+  fflush(stdout);
+  fflush(stderr);
+  dup2(fileno(out), STDOUT_FILENO);
+  dup2(fileno(err), STDERR_FILENO);
+
+  boost::int32_t status = 1;
+  std::string output;
+  setEnvironment(request.env);
+  if(chdir(request.cwd) < 0)
+    fprintf(stderr, "[%s] Error: can't change to directory %s: %s\n",
+            name.c_str(), request.cwd, strerror(errno));
+  else
+  {
+    try
+    {
+      if(rp)
+        rp->forgetCrawl();
+      else
+        rp.reset(factory());
+      std::vector<char*> argv(request.argv);
+      if(rospack_run(argv.size() - 1, &argv[0], *rp, output))
+        status = 0;
+      else
+        output.clear();
+      // Save what it learned, as it would on the way out of the client
+      rp.reset();
+    }
+    catch(std::exception& e)
+    {
+      // Report it the way that the runtime would have in the client
+      std::string type = typeid(e).name();
+#if defined(__GNUC__)
+      int demangle_status;
+      char* demangled = abi::__cxa_demangle(type.c_str(), NULL, NULL, &demangle_status);
+      if(demangled)
+      {
+        type = demangled;
+        free(demangled);
+      }
+#endif
+      fprintf(stderr, "terminate called after throwing an instance of '%s'\n"
+              "  what():  %s\n", type.c_str(), e.what());
+      output.clear();
+      status = STATUS_ABORTED;
+    }
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  output.insert(0, readAll(out));
+  std::string errors = readAll(err);
+  boost::uint32_t reply[REPLY_WORDS];
+  reply[REPLY_STATUS] = (boost::uint32_t)status;
+  reply[REPLY_STDOUT] = output.size();
+  reply[REPLY_STDERR] = errors.size();
+  sendAll(fd, (const char*)reply, sizeof(reply), -1.0);
+  sendAll(fd, output.data(), output.size(), -1.0);
+  sendAll(fd, errors.data(), errors.size(), -1.0);
+  return 0;
+}
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void
+handleStop(int)
+{
+  g_stop = 1;
+}
+
+// Writing to a client that has gone away mustn't kill the daemon.  A
+// handler (unlike SIG_IGN) isn't passed on to the commands that exports
+// run.
+static void
+handlePipe(int)
+{
+}
+
+// Only there to interrupt accept(), so that finished children are reaped
+static void
+handleChild(int)
+{
+}
+
+int
+daemon_serve(const std::string& name,
+             RosstackageFactory factory)
+{
+  std::string path = socketPath(name);
+  struct sockaddr_un addr;
+  if(!socketAddress(path, addr))
+  {
+    fprintf(stderr, "[%s] Error: no location available for the daemon's socket. Try setting ROS_HOME or HOME.\n",
+            name.c_str());
+    return 1;
+  }
+  std::string dir = path.substr(0, path.rfind('/'));
+  mkdir(dir.c_str(), 0755);
+
+  int probe = connectTo(path);
+  if(probe >= 0)
+  {
+    close(probe);
+    fprintf(stderr, "[%s] Error: a daemon is already listening on %s\n",
+            name.c_str(), path.c_str());
+    return 1;
+  }
+  // Left behind by a daemon that didn't exit cleanly
+  unlink(path.c_str());
+
+  // The socket is created with only our user able to connect to it, rather
+  // than narrowed down once it's there
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  setCloseOnExec(listen_fd);
+  mode_t old_umask = umask(077);
+  bool bound = listen_fd >= 0 &&
+          bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+  umask(old_umask);
+  if(!bound || listen(listen_fd, SOMAXCONN) < 0)
+  {
+    fprintf(stderr, "[%s] Error: failed to listen on %s: %s\n",
+            name.c_str(), path.c_str(), strerror(errno));
+    if(listen_fd >= 0)
+      close(listen_fd);
+    return 1;
+  }
+
+  // No SA_RESTART, so that accept() returns when we're told to stop, or
+  // when a child is done
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = handleStop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  action.sa_handler = handlePipe;
+  sigaction(SIGPIPE, &action, NULL);
+  action.sa_handler = handleChild;
+  sigaction(SIGCHLD, &action, NULL);
+
+  // Each request is run in a child of its own, so that clients don't wait
+  // on each other, and nothing that one command leaves behind in the
+  // process (e.g., Python and what it has imported) is seen by the next
+  std::vector<WarmInstance> warm;
+  int running = 0;
+  int status = 0;
+  while(!g_stop)
+  {
+    while(running > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+      running--;
+    if(running >= MAX_RUNNING)
+    {
+      if(waitpid(-1, NULL, 0) > 0)
+        running--;
+      continue;
+    }
+
+    int fd = accept(listen_fd, NULL, NULL);
+    if(fd < 0)
+    {
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      fprintf(stderr, "[%s] Error: failed to accept a connection: %s\n",
+              name.c_str(), strerror(errno));
+      status = 1;
+      break;
+    }
+    setCloseOnExec(fd);
+    setNonBlocking(fd);
+    // Root can connect whatever the socket's permissions say.  Turned away,
+    // the client runs the command itself.
+    if(!peerIsUs(fd))
+    {
+      fprintf(stderr, "[%s] Warning: ignoring a connection from another user\n",
+              name.c_str());
+      close(fd);
+      continue;
+    }
+    Request request;
+    if(!readRequest(fd, request) ||
+       !sendAll(fd, &REQUEST_ACCEPTED, 1, now() + REQUEST_TIMEOUT))
+    {
+      close(fd);
+      continue;
+    }
+
+    WarmInstance* instance = warmInstance(warm, request, factory);
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+      close(listen_fd);
+      action.sa_handler = SIG_DFL;
+      sigaction(SIGINT, &action, NULL);
+      sigaction(SIGTERM, &action, NULL);
+      sigaction(SIGCHLD, &action, NULL);
+      // Take the instance over, so that it's the only one destroyed (and
+      // saves its caches) before the client is answered
+      boost::shared_ptr<Rosstackage> rp;
+      if(instance)
+        rp.swap(instance->rp);
+      _exit(runRequest(fd, request, rp, name, factory));
+    }
+    // If we couldn't fork, the client runs the command itself
+    if(pid > 0)
+      running++;
+    close(fd);
+  }
+
+  unlink(path.c_str());
+  close(listen_fd);
+  return status;
+}
+
+#else // WIN32
+
+int
+daemon_serve(const std::string& name,
+             RosstackageFactory factory)
+{
+  fprintf(stderr, "[%s] Error: the daemon isn't supported on this platform\n",
+          name.c_str());
+  return 1;
+}
+
+bool
+daemon_forward(const std::string& name,
+               int argc, char** argv,
+               int& status)
+{
+  return false;
+}
+
+#endif
+
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ROSPACK_ROSPACK_DAEMON_H
+#define ROSPACK_ROSPACK_DAEMON_H
+
+#include "rospack/macros.h"
+#include "rospack/rospack.h"
+
+namespace rospack
+{
+
+typedef Rosstackage* (*RosstackageFactory)();
+
+/**
+ * @brief Answer queries from daemon_forward() until told to stop
+ * (SIGINT or SIGTERM).  Each query is run by rospack_run() in a child
+ * process of its own, in the client's environment and working directory,
+ * and its output handed back to the client to write.  For each of the
+ * last few environments that clients came with, the daemon keeps a
+ * Rosstackage from factory that has crawled in it; a child starts from
+ * that instance's parsed manifests, but checks the caches just as a new
+ * process would.
+ * @param name The tool being served (rospack or rosstack).
+ * @return The daemon's exit status.
+ */
+ROSPACK_DECL int daemon_serve(const std::string& name,
+                              RosstackageFactory factory);
+
+/**
+ * @brief Have the daemon for name, if one is running, run the command
+ * given by argv, writing its output to our stdout and stderr.  The daemon
+ * has to take the command at once, and answer within ROS_DAEMON_TIMEOUT
+ * seconds (60 by default; 0 to wait for as long as it takes).
+ * @param status The command's exit status is written here.
+ * @return False if there's no daemon to take the command, or it didn't
+ * answer in time, in which case the caller should run it itself.
+ */
+ROSPACK_DECL bool daemon_forward(const std::string& name,
+                                 int argc, char** argv,
+                                 int& status);
+
+}
+
+#endif
@@ -26,11 +26,27 @@
  */
 
 #include "rospack_cmdline.h"
+#include "rospack_daemon.h"
 #include <stdio.h>
+#include <string.h>
+
+static rospack::Rosstackage*
+create()
+{
+  return new rospack::Rosstack();
+}
 
 int
 main(int argc, char** argv)
 {
+  std::string name = "rosstack";
+  if(argc == 2 && !strcmp(argv[1], "daemon"))
+    return rospack::daemon_serve(name, create);
+  // If a daemon is running, it can answer faster than we can start up
+  int status;
+  if(rospack::daemon_forward(name, argc, argv, status))
+    return status;
+
   rospack::Rosstack rs;
   std::string output;
   if(!rospack::rospack_run(argc, argv, rs, output))
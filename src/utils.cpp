@@ -26,12 +26,24 @@
  */
 
 #include <string>
+#include <map>
 #include <vector>
 #include <boost/algorithm/string.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/unordered_set.hpp>
 
 #include "utils.h"
 
+#include <stdio.h>
+#if !defined(WIN32)
+  #include <stdlib.h>
+  #include <unistd.h>
+  #include <fcntl.h>
+  #include <sys/file.h>
+  #include <sys/stat.h>
+  #include <limits.h>
+#endif
+
 namespace rospack
 {
 
@@ -144,5 +156,370 @@ parse_compiler_flags(const std::string& instring,
     outstring = intermediate;
 }
 
+std::string
+sha1_hex(const std::string& message)
+{
+  boost::uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE,
+                          0x10325476, 0xC3D2E1F0};
+  std::string padded = message;
+  padded += (char)0x80;
+  while(padded.size() % 64 != 56)
+    padded += (char)0;
+  boost::uint64_t bits = (boost::uint64_t)message.size() * 8;
+  for(int i = 7; i >= 0; i--)
+    padded += (char)((bits >> (i * 8)) & 0xff);
+
+  for(size_t chunk = 0; chunk < padded.size(); chunk += 64)
+  {
+    boost::uint32_t w[80];
+    for(int i = 0; i < 16; i++)
+    {
+      const unsigned char* p =
+        (const unsigned char*)padded.data() + chunk + i * 4;
+      w[i] = ((boost::uint32_t)p[0] << 24) | ((boost::uint32_t)p[1] << 16) |
+             ((boost::uint32_t)p[2] << 8) | (boost::uint32_t)p[3];
+    }
+    for(int i = 16; i < 80; i++)
+    {
+      boost::uint32_t x = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+      w[i] = (x << 1) | (x >> 31);
+    }
+    boost::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for(int i = 0; i < 80; i++)
+    {
+      boost::uint32_t f, k;
+      if(i < 20)
+      {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      }
+      else if(i < 40)
+      {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      }
+      else if(i < 60)
+      {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      }
+      else
+      {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      boost::uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = (b << 30) | (b >> 2);
+      b = a;
+      a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  char hex[41];
+  for(int i = 0; i < 5; i++)
+    snprintf(hex + i * 8, 9, "%08x", (unsigned int)h[i]);
+  return std::string(hex, 40);
+}
+
+#if !defined(WIN32)
+// The parts of Python's posixpath that catkin_pkg's path ordering relies
+// on, so that paths compare exactly as they do there
+
+static std::string
+py_join(const std::string& a, const std::string& b)
+{
+  if(!b.empty() && b[0] == '/')
+    return b;
+  if(a.empty() || a[a.size()-1] == '/')
+    return a + b;
+  return a + "/" + b;
+}
+
+static void
+py_split(const std::string& p, std::string& head, std::string& tail)
+{
+  size_t i = p.rfind('/');
+  i = (i == std::string::npos) ? 0 : i + 1;
+  head = p.substr(0, i);
+  tail = p.substr(i);
+  if(head.find_first_not_of('/') != std::string::npos)
+  {
+    size_t end = head.find_last_not_of('/');
+    head.erase(end + 1);
+  }
 }
 
+static std::string
+py_normpath(const std::string& p)
+{
+  if(p.empty())
+    return ".";
+  int initial_slashes = 0;
+  if(p[0] == '/')
+    initial_slashes = (p.compare(0, 2, "//") == 0 &&
+                       p.compare(0, 3, "///") != 0) ? 2 : 1;
+  std::vector<std::string> comps;
+  boost::split(comps, p, boost::is_any_of("/"));
+  std::vector<std::string> new_comps;
+  for(size_t i = 0; i < comps.size(); i++)
+  {
+    const std::string& comp = comps[i];
+    if(comp.empty() || comp == ".")
+      continue;
+    if(comp != ".." || (!initial_slashes && new_comps.empty()) ||
+       (!new_comps.empty() && new_comps.back() == ".."))
+      new_comps.push_back(comp);
+    else if(!new_comps.empty())
+      new_comps.pop_back();
+  }
+  std::string result = std::string(initial_slashes, '/') +
+    boost::join(new_comps, "/");
+  return result.empty() ? "." : result;
+}
+
+// posixpath._joinrealpath(): resolve the symbolic links in rest, relative
+// to path, as far as they can be resolved
+static bool
+py_joinrealpath(std::string path, std::string rest,
+                std::map<std::string, std::pair<bool, std::string> >& seen,
+                std::string& result)
+{
+  if(!rest.empty() && rest[0] == '/')
+  {
+    rest = rest.substr(1);
+    path = "/";
+  }
+  while(!rest.empty())
+  {
+    size_t sep = rest.find('/');
+    std::string name = rest.substr(0, sep);
+    rest = (sep == std::string::npos) ? std::string() : rest.substr(sep + 1);
+    if(name.empty() || name == ".")
+      continue;
+    if(name == "..")
+    {
+      if(!path.empty())
+      {
+        std::string head;
+        py_split(path, head, name);
+        path = head;
+        if(name == "..")
+          path = py_join(py_join(path, ".."), "..");
+      }
+      else
+        path = "..";
+      continue;
+    }
+    std::string newpath = py_join(path, name);
+    struct stat st;
+    if(lstat(newpath.c_str(), &st) != 0 || !S_ISLNK(st.st_mode))
+    {
+      path = newpath;
+      continue;
+    }
+    std::map<std::string, std::pair<bool, std::string> >::const_iterator it =
+      seen.find(newpath);
+    if(it != seen.end())
+    {
+      if(it->second.first)
+      {
+        path = it->second.second;
+        continue;
+      }
+      // a loop of symbolic links
+      result = py_join(newpath, rest);
+      return false;
+    }
+    seen[newpath] = std::make_pair(false, std::string());
+    std::vector<char> target(PATH_MAX + 1);
+    ssize_t len = readlink(newpath.c_str(), &target[0], target.size());
+    if(len < 0)
+      len = 0;
+    std::string resolved;
+    if(!py_joinrealpath(path, std::string(&target[0], len), seen, resolved))
+    {
+      result = py_join(resolved, rest);
+      return false;
+    }
+    path = resolved;
+    seen[newpath] = std::make_pair(true, path);
+  }
+  result = path;
+  return true;
+}
+
+static std::string
+py_realpath(const std::string& filename, const std::string& cwd)
+{
+  std::map<std::string, std::pair<bool, std::string> > seen;
+  std::string path;
+  py_joinrealpath(std::string(), filename, seen, path);
+  if(path.empty() || path[0] != '/')
+    path = py_join(cwd, path);
+  return py_normpath(path);
+}
+#endif
+
+bool
+reorder_paths_by_workspace(const std::string& paths, std::string& reordered)
+{
+#if defined(WIN32)
+  return false;
+#else
+  // Unset is the same as empty, as in catkin_pkg.workspaces.get_workspaces()
+  const char* cmake_prefix_path = getenv("CMAKE_PREFIX_PATH");
+  if(!cmake_prefix_path)
+    cmake_prefix_path = "";
+  std::vector<char> cwd_buf(PATH_MAX + 1);
+  std::string cwd;
+  if(getcwd(&cwd_buf[0], cwd_buf.size()))
+    cwd = &cwd_buf[0];
+
+  // The workspaces, resolved as they'll be compared
+  std::vector<std::string> workspaces;
+  if(*cmake_prefix_path)
+  {
+    std::vector<std::string> prefixes;
+    boost::split(prefixes, cmake_prefix_path, boost::is_any_of(":"));
+    for(size_t i = 0; i < prefixes.size(); i++)
+    {
+      // An empty entry isn't the working directory
+      if(prefixes[i].empty())
+        continue;
+      struct stat st;
+      std::string marker = py_join(prefixes[i], ".catkin");
+      if(stat(marker.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+        workspaces.push_back(py_realpath(prefixes[i], cwd));
+    }
+  }
+
+  std::vector<std::vector<std::string> > ordered(workspaces.size() + 1);
+  if(!paths.empty())
+  {
+    std::vector<std::string> paths_to_order;
+    boost::split(paths_to_order, paths, boost::is_any_of(" "));
+    for(size_t i = 0; i < paths_to_order.size(); i++)
+    {
+      std::string path = py_realpath(paths_to_order[i], cwd);
+      size_t index = 0;
+      for(; index < workspaces.size(); index++)
+      {
+        const std::string& dir = workspaces[index];
+        if(path == dir ||
+           (path.size() > dir.size() &&
+            path.compare(0, dir.size(), dir) == 0 &&
+            path[dir.size()] == '/'))
+          break;
+      }
+      ordered[index].push_back(paths_to_order[i]);
+    }
+  }
+  std::vector<std::string> flattened;
+  for(size_t i = 0; i < ordered.size(); i++)
+    flattened.insert(flattened.end(), ordered[i].begin(), ordered[i].end());
+  reordered = boost::join(flattened, " ");
+  return true;
+#endif
+}
+
+FILE*
+create_replacement_file(const std::string& path,
+                        std::string& tmp_path)
+{
+  tmp_path = path + ".XXXXXX";
+#if defined(WIN32)
+  return fopen(tmp_path.c_str(), "wb");
+#else
+  std::vector<char> tmp_buf(tmp_path.begin(), tmp_path.end());
+  tmp_buf.push_back('\0');
+  int fd = mkstemp(&tmp_buf[0]);
+  if(fd < 0)
+    return NULL;
+  tmp_path = &tmp_buf[0];
+  FILE* file = fdopen(fd, "wb");
+  if(!file)
+  {
+    close(fd);
+    remove(tmp_path.c_str());
+  }
+  return file;
+#endif
+}
+
+bool
+replace_file(FILE* tmp_file,
+             const std::string& tmp_path,
+             const std::string& path)
+{
+  if(fclose(tmp_file) != 0)
+  {
+    remove(tmp_path.c_str());
+    return false;
+  }
+#if defined(WIN32)
+  remove(path.c_str());
+#endif
+  if(rename(tmp_path.c_str(), path.c_str()) < 0)
+  {
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// How often to try again for a lock that someone else holds
+static const double LOCK_POLL_INTERVAL = 0.01;
+
+FileLock::FileLock(const std::string& path) :
+        fd_(-1)
+{
+#if !defined(WIN32)
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+#endif
+}
+
+FileLock::~FileLock()
+{
+#if !defined(WIN32)
+  if(fd_ >= 0)
+    close(fd_);
+#endif
+}
+
+bool
+FileLock::tryLock()
+{
+#if !defined(WIN32)
+  return fd_ >= 0 && flock(fd_, LOCK_EX | LOCK_NB) == 0;
+#else
+  return false;
+#endif
+}
+
+bool
+FileLock::lock(double timeout)
+{
+#if !defined(WIN32)
+  if(fd_ < 0)
+    return false;
+  for(double waited = 0.0; ; waited += LOCK_POLL_INTERVAL)
+  {
+    if(tryLock())
+      return true;
+    if(waited >= timeout)
+      return false;
+    usleep((useconds_t)(LOCK_POLL_INTERVAL * 1e6));
+  }
+#else
+  return false;
+#endif
+}
+
+}
@@ -28,6 +28,7 @@
 #ifndef ROSPACK_UTILS_H
 #define ROSPACK_UTILS_H
 
+#include <stdio.h>
 #include <string>
 #include "rospack/macros.h"
 
@@ -55,6 +56,46 @@ ROSPACK_DECL void parse_compiler_flags(const std::string& instring,
                      bool last,
                      std::string& outstring);
 
+// The SHA-1 digest of message, in hex
+std::string sha1_hex(const std::string& message);
+
+// Order space-separated paths by the catkin workspace they're in, as
+// catkin_pkg.rospack.reorder_paths() does: those in the first workspace in
+// CMAKE_PREFIX_PATH (an entry holding a .catkin file) come first, then
+// those in the second, and so on, then the rest, each group in the order
+// given.  Returns false where this can't be done the same way: on
+// Windows.
+ROSPACK_DECL bool reorder_paths_by_workspace(const std::string& paths,
+                                             std::string& reordered);
+
+// Create a temporary file next to path, to be moved over it with
+// replace_file() once it has been written.  Returns NULL on failure.
+FILE* create_replacement_file(const std::string& path,
+                              std::string& tmp_path);
+
+// Close tmp_file and move it over path, cleaning up on failure.
+bool replace_file(FILE* tmp_file,
+                  const std::string& tmp_path,
+                  const std::string& path);
+
+// An advisory lock on a file (created if need be), held until the object
+// goes away.  Processes that crash drop their locks.  Where there's no
+// support for it (Windows), the lock can never be taken.
+class FileLock
+{
+  public:
+    explicit FileLock(const std::string& path);
+    ~FileLock();
+    // Take the lock if no one else holds it
+    bool tryLock();
+    // Wait up to timeout seconds for the lock
+    bool lock(double timeout);
+  private:
+    int fd_;
+    FileLock(const FileLock&);
+    FileLock& operator=(const FileLock&);
+};
+
 }
 
 #endif
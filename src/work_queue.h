@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2008, Willow Garage, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the names of Stanford University or Willow Garage, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ROSPACK_WORK_QUEUE_H
+#define ROSPACK_WORK_QUEUE_H
+
+#include <boost/bind/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <deque>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace rospack
+{
+
+/**
+ * @brief Runs a dynamically growing set of work items on a fixed number of
+ * threads.
+ *
+ * Each thread owns a deque.  It pushes and pops its own items at the back
+ * (so a single thread walks depth-first) and, when its deque runs dry,
+ * steals from the front of another thread's deque, where the oldest and
+ * usually largest pending pieces of work sit.  With one thread, everything
+ * runs on the calling thread and no threads are created.
+ *
+ * The handler is called as handler(item, queue, worker) and may call
+ * queue.push(item, worker) to schedule more work.  Handlers should not
+ * throw; if one does, the remaining items are still processed and run()
+ * rethrows the first error as a std::runtime_error.
+ */
+template<typename Item>
+class WorkQueue
+{
+  public:
+    typedef boost::function<void (const Item&, WorkQueue<Item>&, size_t)> Handler;
+
+    WorkQueue(size_t num_threads, const Handler& handler) :
+            handler_(handler),
+            num_deques_(num_threads ? num_threads : 1),
+            deques_(new Deque[num_deques_]),
+            pending_(0),
+            generation_(0)
+    {
+    }
+
+    size_t size() const { return num_deques_; }
+
+    /**
+     * @brief Schedule an item.  Only call from within the handler, passing
+     * the worker index the handler was given.
+     */
+    void push(const Item& item, size_t worker)
+    {
+      {
+        boost::mutex::scoped_lock lock(state_mutex_);
+        pending_++;
+      }
+      {
+        boost::mutex::scoped_lock lock(deques_[worker].mutex_);
+        deques_[worker].items_.push_back(item);
+      }
+      if(num_deques_ > 1)
+      {
+        boost::mutex::scoped_lock lock(state_mutex_);
+        generation_++;
+        state_cond_.notify_one();
+      }
+    }
+
+    /**
+     * @brief Process the given items, and everything they schedule, then
+     * return.
+     */
+    void run(const std::vector<Item>& items)
+    {
+      // Deal the initial items out round-robin, in reverse so that each
+      // worker starts with the earliest of its share.
+      pending_ = items.size();
+      for(size_t i = items.size(); i > 0; --i)
+        deques_[(i - 1) % num_deques_].items_.push_back(items[i - 1]);
+
+      if(num_deques_ == 1)
+        work(0);
+      else
+      {
+        boost::thread_group threads;
+        for(size_t i = 1; i < num_deques_; ++i)
+          threads.create_thread(boost::bind(&WorkQueue<Item>::work, this, i));
+        work(0);
+        threads.join_all();
+      }
+
+      if(!error_.empty())
+        throw std::runtime_error(error_);
+    }
+
+  private:
+    struct Deque
+    {
+      boost::mutex mutex_;
+      std::deque<Item> items_;
+    };
+
+    Handler handler_;
+    size_t num_deques_;
+    boost::scoped_array<Deque> deques_;
+    boost::mutex state_mutex_;
+    boost::condition_variable state_cond_;
+    size_t pending_;
+    size_t generation_;
+    std::string error_;
+
+    bool pop(size_t worker, Item& item)
+    {
+      Deque& d = deques_[worker];
+      boost::mutex::scoped_lock lock(d.mutex_);
+      if(d.items_.empty())
+        return false;
+      item = d.items_.back();
+      d.items_.pop_back();
+      return true;
+    }
+
+    bool steal(size_t worker, Item& item)
+    {
+      for(size_t i = 1; i < num_deques_; ++i)
+      {
+        Deque& d = deques_[(worker + i) % num_deques_];
+        boost::mutex::scoped_lock lock(d.mutex_);
+        if(d.items_.empty())
+          continue;
+        item = d.items_.front();
+        d.items_.pop_front();
+        return true;
+      }
+      return false;
+    }
+
+    void work(size_t worker)
+    {
+      for(;;)
+      {
+        size_t generation;
+        {
+          boost::mutex::scoped_lock lock(state_mutex_);
+          generation = generation_;
+        }
+        Item item;
+        if(pop(worker, item) || steal(worker, item))
+        {
+          try
+          {
+            handler_(item, *this, worker);
+          }
+          catch(std::exception& e)
+          {
+            boost::mutex::scoped_lock lock(state_mutex_);
+            if(error_.empty())
+              error_ = e.what();
+          }
+          boost::mutex::scoped_lock lock(state_mutex_);
+          if(--pending_ == 0)
+            state_cond_.notify_all();
+          continue;
+        }
+        // Nothing to do.  Quit if everybody is done; otherwise sleep until
+        // somebody pushes more work (unless that already happened since we
+        // last looked).
+        boost::mutex::scoped_lock lock(state_mutex_);
+        if(pending_ == 0)
+          return;
+        if(generation == generation_)
+          state_cond_.wait(lock);
+      }
+    }
+};
+
+}
+
+#endif
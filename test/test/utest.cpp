@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #ifndef _WIN32
 #include <unistd.h>
+#include <sys/stat.h>
 #endif
 #include <stdio.h>
 #include <time.h>
@@ -42,6 +43,8 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include "rospack/rospack.h"
+#include "export_cache.h"
+#include "pkg_config.h"
 #include "utils.h"
 
 #ifdef _WIN32
@@ -232,6 +235,202 @@ TEST(rospack, env_change)
   setenv("ROS_PACKAGE_PATH", oldrpp, 1);
 }
 
+// Test the reachability query against depends.
+TEST(rospack, depends_on_query)
+{
+  char buf[1024];
+  std::vector<std::string> search_path;
+  search_path.push_back(std::string(getcwd(buf, sizeof(buf))) + "/test");
+  rospack::Rospack rp;
+  rp.setQuiet(true);
+  rp.crawl(search_path, true);
+
+  bool depends = false;
+  EXPECT_TRUE(rp.dependsOn("deps_higher", "base", depends));
+  EXPECT_TRUE(depends);
+  EXPECT_TRUE(rp.dependsOn("deps_higher", "deps", depends));
+  EXPECT_TRUE(depends);
+  EXPECT_TRUE(rp.dependsOn("deps", "deps_higher", depends));
+  EXPECT_FALSE(depends);
+  EXPECT_TRUE(rp.dependsOn("deps_higher", "deps_higher", depends));
+  EXPECT_FALSE(depends);
+  EXPECT_FALSE(rp.dependsOn("deps_higher", "nonexistentpackage", depends));
+  // A package new to the graph, on top of what's been asked about already
+  EXPECT_TRUE(rp.dependsOn("deps_dup", "deps_higher", depends));
+  EXPECT_TRUE(depends);
+  EXPECT_TRUE(rp.dependsOn("deps_dup", "base", depends));
+  EXPECT_TRUE(depends);
+  EXPECT_TRUE(rp.dependsOn("deps_higher", "deps_dup", depends));
+  EXPECT_FALSE(depends);
+  EXPECT_TRUE(rp.dependsOn("deps_higher", "base", depends));
+  EXPECT_TRUE(depends);
+}
+
+TEST(rospack, depends_why_query)
+{
+  char buf[1024];
+  std::vector<std::string> search_path;
+  search_path.push_back(std::string(getcwd(buf, sizeof(buf))) + "/test");
+  rospack::Rospack rp;
+  rp.setQuiet(true);
+  rp.crawl(search_path, true);
+
+  std::string output;
+  EXPECT_TRUE(rp.depsWhy("deps_dup", "base", output));
+  EXPECT_EQ("Dependency chains from deps_dup to base:\n"
+            "* deps_dup -> base \n"
+            "* deps_dup -> deps_higher -> deps -> base \n", output);
+  boost::uint64_t count = 0;
+  EXPECT_TRUE(rp.depsWhyCount("deps_dup", "base", count));
+  EXPECT_EQ(2u, count);
+  EXPECT_TRUE(rp.depsWhyCount("deps", "deps_higher", count));
+  EXPECT_EQ(0u, count);
+  EXPECT_FALSE(rp.depsWhyCount("deps_dup", "nonexistentpackage", count));
+}
+
+#ifndef _WIN32
+// Test that paths are ordered by workspace as catkin_pkg orders them.
+TEST(rospack, reorder_paths_by_workspace)
+{
+  boost::filesystem::path tmp = boost::filesystem::temp_directory_path() /
+    boost::filesystem::unique_path("rospack-reorder-%%%%-%%%%");
+  boost::filesystem::create_directories(tmp / "ws1");
+  boost::filesystem::create_directories(tmp / "ws2");
+  boost::filesystem::create_directories(tmp / "other");
+  fclose(fopen((tmp / "ws1" / ".catkin").string().c_str(), "w"));
+  fclose(fopen((tmp / "ws2" / ".catkin").string().c_str(), "w"));
+  // a link into a workspace counts as being in it
+  boost::filesystem::create_symlink(tmp / "ws1", tmp / "link");
+
+  const char* old_cmake_prefix_path = getenv("CMAKE_PREFIX_PATH");
+  std::string saved = old_cmake_prefix_path ? old_cmake_prefix_path : "";
+  std::string t = tmp.string();
+  setenv("CMAKE_PREFIX_PATH",
+         (t + "/ws2:" + t + "/other:" + t + "/ws1").c_str(), 1);
+  std::string output;
+  EXPECT_TRUE(rospack::reorder_paths_by_workspace(
+    t + "/ws1/include " + t + "/x " + t + "/link/lib " + t + "/ws2/include " +
+    t + "/ws2", output));
+  EXPECT_EQ(t + "/ws2/include " + t + "/ws2 " + t + "/ws1/include " +
+            t + "/link/lib " + t + "/x", output);
+  EXPECT_TRUE(rospack::reorder_paths_by_workspace("", output));
+  EXPECT_EQ("", output);
+  // empty entries don't stand for the working directory
+  boost::filesystem::path old_cwd = boost::filesystem::current_path();
+  boost::filesystem::current_path(tmp / "ws1");
+  setenv("CMAKE_PREFIX_PATH", (":" + t + "/ws2::").c_str(), 1);
+  EXPECT_TRUE(rospack::reorder_paths_by_workspace(
+    t + "/ws1/include " + t + "/ws2/include", output));
+  EXPECT_EQ(t + "/ws2/include " + t + "/ws1/include", output);
+  // without CMAKE_PREFIX_PATH there are no workspaces
+  unsetenv("CMAKE_PREFIX_PATH");
+  EXPECT_TRUE(rospack::reorder_paths_by_workspace(
+    t + "/ws2/include " + t + "/ws1/include", output));
+  EXPECT_EQ(t + "/ws2/include " + t + "/ws1/include", output);
+  boost::filesystem::current_path(old_cwd);
+
+  if(old_cmake_prefix_path)
+    setenv("CMAKE_PREFIX_PATH", saved.c_str(), 1);
+  boost::filesystem::remove_all(tmp);
+}
+#endif
+
+static void
+writePcFile(const boost::filesystem::path& dir, const std::string& name,
+            const std::string& contents)
+{
+  boost::filesystem::create_directories(dir);
+  FILE* f = fopen((dir / (name + ".pc")).string().c_str(), "w");
+  ASSERT_TRUE(f != NULL);
+  fputs(contents.c_str(), f);
+  fclose(f);
+}
+
+// Test the in-process pkg-config against what pkg-config 0.29 prints.
+TEST(rospack, pkg_config)
+{
+  boost::filesystem::path tmp = boost::filesystem::temp_directory_path() /
+    boost::filesystem::unique_path("rospack-pkg-config-%%%%-%%%%");
+  std::string header = "prefix=/opt/x\nName: n\nDescription: d\nVersion: 1\n";
+  writePcFile(tmp / "d1", "a", header +
+              "Requires: b, c\n"
+              "Cflags: -I${prefix}/a -I/shared -DA -DSH\n"
+              "Libs: -L/la -la -lshared -Wl,x\n");
+  writePcFile(tmp / "d1", "b", header +
+              "Requires: d\n"
+              "Cflags: -I/b -I/shared -DB -DSH\n"
+              "Libs: -L/lb -lb -lshared -Wl,x\n");
+  writePcFile(tmp / "d1", "d", header +
+              "# comment\n"
+              "Cflags: -I/d -I/usr/include -I/shared \\\n  -DD -DSH\n"
+              "Libs: -L/ld -ld -lshared\n");
+  writePcFile(tmp / "d1", "e", header +
+              "Cflags: -I${pcfiledir}/e -DE\n"
+              "Libs: -L/le -le\n");
+  writePcFile(tmp / "d2", "c", header +
+              "Requires: d\n"
+              "Requires.private: e\n"
+              "CFlags: -I/c -DC\n"
+              "Libs: -L/lc -lc\n");
+  writePcFile(tmp / "d2", "versioned", header +
+              "Requires: d >= 1\n");
+  std::vector<std::string> search_path;
+  search_path.push_back((tmp / "d1").string());
+  search_path.push_back((tmp / "d2").string());
+  rospack::PkgConfig pkg_config(search_path, true);
+
+  std::string output;
+  // -I and -L follow the search path; /usr/include is left out
+  EXPECT_TRUE(pkg_config.query("--cflags-only-I", "a", output));
+  EXPECT_EQ("-I/opt/x/a -I/shared -I/b -I/shared -I" +
+            (tmp / "d1").string() + "/e -I/d -I/shared -I/c", output);
+  EXPECT_TRUE(pkg_config.query("--cflags-only-other", "a", output));
+  EXPECT_EQ("-DA -DSH -DB -DSH -DC -DE -DD -DSH", output);
+  // Requires.private doesn't count for libs
+  EXPECT_TRUE(pkg_config.query("--libs-only-L", "a", output));
+  EXPECT_EQ("-L/la -L/lb -L/ld -L/lc", output);
+  EXPECT_TRUE(pkg_config.query("--libs-only-l", "a", output));
+  EXPECT_EQ("-la -lshared -lb -lshared -lc -ld -lshared", output);
+  EXPECT_TRUE(pkg_config.query("--libs-only-other", "a", output));
+  EXPECT_EQ("-Wl,x", output);
+  // Left to pkg-config
+  EXPECT_FALSE(pkg_config.query("--cflags", "a", output));
+  EXPECT_FALSE(pkg_config.query("--cflags-only-I", "versioned", output));
+  EXPECT_FALSE(pkg_config.query("--cflags-only-I", "nonexistentpackage", output));
+
+#ifndef _WIN32
+  // pkg-config's own search path is only asked for once
+  std::string expected;
+  EXPECT_TRUE(pkg_config.query("--cflags-only-I", "c", expected));
+  std::string fake = (tmp / "pkg-config").string();
+  std::string count = (tmp / "count").string();
+  FILE* f = fopen(fake.c_str(), "w");
+  ASSERT_TRUE(f != NULL);
+  fprintf(f, "#!/bin/sh\necho x >> %s\necho %s\n", count.c_str(),
+          (tmp / "d2").string().c_str());
+  fclose(f);
+  chmod(fake.c_str(), 0755);
+  rospack::ExportCache cache;
+  cache.load((tmp / "export_cache").string(), 3600.0);
+  for(int i = 0; i < 2; i++)
+  {
+    rospack::PkgConfig fallback(std::vector<std::string>(1, (tmp / "d1").string()),
+                                false, fake, &cache);
+    EXPECT_TRUE(fallback.query("--cflags-only-I", "c", output));
+    EXPECT_EQ(expected, output);
+  }
+  f = fopen(count.c_str(), "r");
+  ASSERT_TRUE(f != NULL);
+  int num_runs = 0;
+  for(int c = fgetc(f); c != EOF; c = fgetc(f))
+    num_runs += (c == '\n');
+  fclose(f);
+  EXPECT_EQ(1, num_runs);
+#endif
+
+  boost::filesystem::remove_all(tmp);
+}
+
 int main(int argc, char **argv)
 {
   // Quiet some warnings